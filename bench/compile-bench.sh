@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Measures how compile time and memory of the pass scale with the size
+# of the TU and of the white- and blacklists. Every configuration is
+# compiled once with plain clang and once with llcov-clang; the
+# difference is the cost of the pass. Built and run by
+# 'make bench-compile', results are CSV on stdout.
+#
+# Environment: LLCOV_CC (default: clang) is the compiler for both runs,
+# BENCH_OPT (default: -O0) the optimization level.
+#
+
+DIR=`dirname "$0"`
+TOP="$DIR/.."
+CC=${LLCOV_CC:-clang}
+OPT=${BENCH_OPT:--O0}
+TMP=`mktemp -d /tmp/llcov-compile-bench.XXXXXX` || exit 1
+
+trap 'rm -rf "$TMP"' EXIT
+
+unset LLCOV_WHITELIST LLCOV_BLACKLIST LLCOV_LOGINSTFILE LLCOV_LOGINSTDEBUG
+export LLCOV_QUIET=1
+
+echo "funcs,branches,entries,plain_ms,llcov_ms,pass_ms,plain_rss_kb,llcov_rss_kb"
+
+# funcs branches entries: first the lists grow, then the TU
+
+while read FUNCS BRANCHES ENTRIES; do
+
+  "$DIR/llcov-gen" -f $FUNCS -b $BRANCHES -e $ENTRIES "$TMP/gen" || exit 1
+
+  PLAIN=`"$DIR/llcov-measure" $CC -g $OPT -c "$TMP/gen.c" -o "$TMP/plain.o"` || {
+    echo "[-] Plain compile failed ($FUNCS $BRANCHES $ENTRIES)" 1>&2
+    continue
+  }
+
+  if [ "$ENTRIES" -gt 0 ]; then
+    LISTS="LLCOV_WHITELIST=$TMP/gen.wl LLCOV_BLACKLIST=$TMP/gen.bl"
+  else
+    LISTS=""
+  fi
+
+  LLCOV=`env $LISTS "$DIR/llcov-measure" "$TOP/llcov-clang" $OPT -c "$TMP/gen.c" -o "$TMP/llcov.o"` || {
+    echo "[-] llcov-clang failed ($FUNCS $BRANCHES $ENTRIES)" 1>&2
+    continue
+  }
+
+  echo "$FUNCS,$BRANCHES,$ENTRIES,$PLAIN,$LLCOV" | awk -F, -v OFS=, \
+    '{ print $1, $2, $3, $4, $6, $6 - $4, $5, $7 }'
+
+done <<EOF
+1000 20 0
+1000 20 1000
+1000 20 10000
+1000 20 100000
+250 20 10000
+4000 20 10000
+16000 20 10000
+1000 80 10000
+EOF
@@ -0,0 +1,180 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Generates a synthetic translation unit plus white- and blacklists of a
+  given size, to measure how the compile-time cost of the pass scales.
+
+  The TU has a configurable number of functions with a configurable
+  number of branches each, one per line, so that blocks, lines and debug
+  locations grow together. The lists mix every kind of entry the pass
+  understands (file, func, line, line ranges, relblock); a configurable
+  share of them refers to the generated file, the rest to other files,
+  which is the common case for lists written for a whole project.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../config.h"
+#include "../types.h"
+#include "../debug.h"
+
+static u32 func_cnt   = 1000;         /* Functions in the TU              */
+static u32 branch_cnt = 20;           /* Branches per function            */
+static u32 entry_cnt  = 1000;         /* Entries per list                 */
+static u32 match_pct  = 10;           /* Entries that refer to the TU     */
+
+static u64 seed = 0x2545F4914F6CDD1DULL;
+
+
+static u32 rnd(u32 limit) {
+
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (seed >> 16) % limit;
+
+}
+
+
+/* Functions start at line 1 + func * (branch_cnt + 4), branches follow
+   the opening two lines. */
+
+static u32 func_line(u32 func) {
+
+  return 1 + func * (branch_cnt + 4);
+
+}
+
+
+static void write_tu(u8* fn) {
+
+  FILE* f = fopen((char*)fn, "w");
+  u32 i, j;
+
+  if (!f) PFATAL("Unable to create '%s'", fn);
+
+  for (i = 0; i < func_cnt; i++) {
+
+    fprintf(f, "int fn_%u(int x) {\n  int r = %u;\n", i, i);
+
+    for (j = 0; j < branch_cnt; j++)
+      fprintf(f, "  if ((x >> %u) & 1) r = r * 31 + %u; else r ^= %u;\n",
+              j % 31, j, i + j);
+
+    fprintf(f, "  return r;\n}\n");
+
+  }
+
+  if (fclose(f)) PFATAL("Unable to write '%s'", fn);
+
+}
+
+
+static void write_list(u8* fn, u8* tu_name) {
+
+  FILE* f = fopen((char*)fn, "w");
+  u32 i;
+
+  if (!f) PFATAL("Unable to create '%s'", fn);
+
+  for (i = 0; i < entry_cnt; i++) {
+
+    u32 func = rnd(func_cnt);
+    u32 line = func_line(func) + 2 + rnd(branch_cnt);
+    u8  other = rnd(100) >= match_pct;
+    u8  other_name[64];
+    u8* name = tu_name;
+
+    if (other) {
+      sprintf((char*)other_name, "other/file%u.c", rnd(1000));
+      name = other_name;
+    }
+
+    switch (i % 5) {
+
+      case 0: fprintf(f, "file:%s line:%u\n", name, line); break;
+      case 1: fprintf(f, "file:%s line:%u-%u\n", name, line, line + 1 + rnd(8)); break;
+      case 2: fprintf(f, "file:%s line:%u relblock:%u\n", name, line, rnd(3)); break;
+      case 3: fprintf(f, "file:%s func:fn_%u\n", name, func); break;
+
+      /* Function-only entries apply to every file, keep them rare */
+      case 4:
+        if (other || rnd(10)) fprintf(f, "file:%s func:fn_%u\n", name, func);
+        else fprintf(f, "func:fn_%u\n", func);
+        break;
+
+    }
+
+  }
+
+  if (fclose(f)) PFATAL("Unable to write '%s'", fn);
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] prefix\n\n"
+
+       "Writes prefix.c, prefix.wl (whitelist) and prefix.bl (blacklist).\n\n"
+
+       "Options:\n\n"
+
+       "  -f n          - functions in the TU (default: %u)\n"
+       "  -b n          - branches per function (default: %u)\n"
+       "  -e n          - entries per list (default: %u)\n"
+       "  -m pct        - share of entries that refer to the TU (default: %u)\n"
+       "  -s n          - random seed\n\n",
+
+       argv0, func_cnt, branch_cnt, entry_cnt, match_pct);
+
+  exit(1);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  u8 *prefix, *base, fn[4096], tu_name[4096];
+  s32 opt;
+
+  while ((opt = getopt(argc, argv, "+f:b:e:m:s:")) > 0)
+
+    switch (opt) {
+
+      case 'f': func_cnt   = atoi(optarg); break;
+      case 'b': branch_cnt = atoi(optarg); break;
+      case 'e': entry_cnt  = atoi(optarg); break;
+      case 'm': match_pct  = atoi(optarg); break;
+      case 's': seed      += strtoull(optarg, NULL, 0); break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind != argc - 1 || !func_cnt || !branch_cnt) usage((u8*)argv[0]);
+
+  prefix = (u8*)argv[optind];
+  base   = (u8*)strrchr((char*)prefix, '/');
+  base   = base ? base + 1 : prefix;
+
+  snprintf((char*)tu_name, sizeof(tu_name), "%s.c", base);
+
+  snprintf((char*)fn, sizeof(fn), "%s.c", prefix);
+  write_tu(fn);
+
+  snprintf((char*)fn, sizeof(fn), "%s.wl", prefix);
+  write_list(fn, tu_name);
+
+  snprintf((char*)fn, sizeof(fn), "%s.bl", prefix);
+  write_list(fn, tu_name);
+
+  return 0;
+
+}
@@ -0,0 +1,71 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Runs a command and prints its wall time and peak RSS as CSV:
+
+    wall_ms,max_rss_kb
+
+  The peak RSS is that of the largest process in the tree, so for a
+  compiler driver it is the compiler itself. Exits with the command's
+  status, its output is left alone.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../config.h"
+#include "../types.h"
+#include "../debug.h"
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+
+int main(int argc, char** argv) {
+
+  struct rusage ru;
+  s32 pid, status;
+  u64 start;
+
+  if (argc < 2) {
+    SAYF("Usage: %s command [ args ... ]\n", argv[0]);
+    exit(1);
+  }
+
+  start = get_cur_time_us();
+  pid   = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+    execvp(argv[1], argv + 1);
+    PFATAL("Unable to execute '%s'", argv[1]);
+  }
+
+  if (waitpid(pid, &status, 0) < 0) PFATAL("waitpid() failed");
+
+  /* ru_maxrss of waited-for children covers grandchildren as well */
+
+  getrusage(RUSAGE_CHILDREN, &ru);
+
+  printf("%.1f,%ld\n", (get_cur_time_us() - start) / 1000.0, ru.ru_maxrss);
+
+  if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+
+}
@@ -0,0 +1,206 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Microbenchmark for the cost of a single probe, i.e. one call of
+  llvm_llcov_block_call(), linked against one of the runtimes.
+
+  Patterns:
+
+    cold   - every probe hits a block that has not run before; each thread
+             runs fresh sets of LLCOV_BENCH_COLD blocks until the time is
+             up or its share of LLCOV_BENCH_COLD_MAX blocks is used up
+    hot    - threads cycle through the same 64 blocks
+    repeat - threads call the same single block over and over
+
+  One pattern and thread count per run, since the runtimes only read
+  their settings once per process and cold blocks only exist once. The
+  result is a single CSV line on stdout:
+
+    pattern,threads,probes,elapsed_us,ns_per_probe,mprobes_per_s
+
+  ns_per_probe is CPU time (user and system, all threads) per probe, so
+  it stays meaningful with more threads than cores; mprobes_per_s is the
+  throughput over wall time. bench/rt-bench.sh runs the whole matrix.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "../config.h"
+#include "../types.h"
+#include "../debug.h"
+
+#define LLCOV_BENCH_COLD  4096        /* Cold blocks per thread and round */
+#define LLCOV_BENCH_COLD_MAX (1 << 19) /* Cold blocks in all, half the map */
+#define LLCOV_BENCH_HOT   64          /* Blocks in the hot set            */
+#define FILE_CNT          16
+
+extern void llvm_llcov_block_call(const char* funcname, const char* filename,
+                                  u32 line, u32 relblock);
+
+/* The runtimes key blocks by file name pointer, so these must stay put */
+
+static const char* files[FILE_CNT] = {
+  "bench/f0.c", "bench/f1.c", "bench/f2.c", "bench/f3.c",
+  "bench/f4.c", "bench/f5.c", "bench/f6.c", "bench/f7.c",
+  "bench/f8.c", "bench/f9.c", "bench/f10.c", "bench/f11.c",
+  "bench/f12.c", "bench/f13.c", "bench/f14.c", "bench/f15.c"
+};
+
+static u8 pattern;                    /* 0 = cold, 1 = hot, 2 = repeat    */
+static u32 thread_cnt;
+static u32 done_cnt;                  /* Threads that ran out of work     */
+static volatile u8 stop_soon;
+static pthread_barrier_t start_barrier;
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+
+static u64 get_cpu_time_us(void) {
+
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  return (u64)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+         ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+}
+
+
+static void* bench_main(void* arg) {
+
+  u32 tid = (u32)(uintptr_t)arg, i, round;
+  u64 probes = 0;
+
+  pthread_barrier_wait(&start_barrier);
+
+  switch (pattern) {
+
+    case 0:
+
+      /* Rounds of all threads use disjoint line ranges */
+
+      for (round = 0; !round || (!stop_soon &&
+           (round + 1) * thread_cnt * LLCOV_BENCH_COLD <= LLCOV_BENCH_COLD_MAX); round++) {
+
+        u32 base = (round * thread_cnt + tid) * LLCOV_BENCH_COLD;
+
+        for (i = 0; i < LLCOV_BENCH_COLD; i++)
+          llvm_llcov_block_call("bench", files[i % FILE_CNT], base + i + 1, 0);
+
+        probes += LLCOV_BENCH_COLD;
+
+      }
+
+      __atomic_fetch_add(&done_cnt, 1, __ATOMIC_RELAXED);
+      break;
+
+    case 1:
+
+      while (!stop_soon) {
+
+        for (i = 0; i < 1024; i++)
+          llvm_llcov_block_call("bench", files[i % FILE_CNT],
+                                i % LLCOV_BENCH_HOT + 1, 0);
+
+        probes += 1024;
+
+      }
+
+      break;
+
+    case 2:
+
+      while (!stop_soon) {
+
+        for (i = 0; i < 1024; i++)
+          llvm_llcov_block_call("bench", files[0], 1, 0);
+
+        probes += 1024;
+
+      }
+
+      break;
+
+  }
+
+  return (void*)(uintptr_t)probes;
+
+}
+
+
+int main(int argc, char** argv) {
+
+  pthread_t* threads;
+  u32 ms = 200, i;
+  u64 start, cpu_start, us, cpu_us, probes = 0;
+
+  if (argc < 3) {
+    SAYF("Usage: %s cold|hot|repeat threads [ms]\n", argv[0]);
+    exit(1);
+  }
+
+  if (!strcmp(argv[1], "cold")) pattern = 0;
+  else if (!strcmp(argv[1], "hot")) pattern = 1;
+  else if (!strcmp(argv[1], "repeat")) pattern = 2;
+  else FATAL("Unknown pattern '%s'", argv[1]);
+
+  thread_cnt = atoi(argv[2]);
+  if (argc > 3) ms = atoi(argv[3]);
+  if (!thread_cnt || !ms) FATAL("Thread count and duration must be non-zero");
+
+  /* Get one-time runtime setup out of the way */
+
+  llvm_llcov_block_call("bench", "bench/warmup.c", 1, 0);
+
+  threads = calloc(thread_cnt, sizeof(pthread_t));
+  pthread_barrier_init(&start_barrier, NULL, thread_cnt + 1);
+
+  for (i = 0; i < thread_cnt; i++)
+    if (pthread_create(&threads[i], NULL, bench_main, (void*)(uintptr_t)i))
+      FATAL("Unable to start thread");
+
+  /* Workers wait at the barrier until we get there, so nothing they do
+     can happen before these */
+
+  start     = get_cur_time_us();
+  cpu_start = get_cpu_time_us();
+  pthread_barrier_wait(&start_barrier);
+
+  while (get_cur_time_us() - start < ms * 1000ULL &&
+         __atomic_load_n(&done_cnt, __ATOMIC_RELAXED) < thread_cnt)
+    usleep(1000);
+
+  stop_soon = 1;
+
+  for (i = 0; i < thread_cnt; i++) {
+    void* ret;
+    pthread_join(threads[i], &ret);
+    probes += (uintptr_t)ret;
+  }
+
+  us     = MAX(get_cur_time_us() - start, 1);
+  cpu_us = get_cpu_time_us() - cpu_start;
+
+  printf("%s,%u,%llu,%llu,%.2f,%.2f\n", argv[1], thread_cnt, probes, us,
+         cpu_us * 1000.0 / probes, (double)probes / us);
+
+  return 0;
+
+}
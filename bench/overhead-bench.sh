@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Measures the end-to-end cost of instrumentation on the CPU-bound
+# workloads in bench/workloads. Every workload is built once plain and
+# once per instrumentation variant, each variant is linked against every
+# runtime, and each runtime is run in each of its modes. Built and run
+# by 'make bench-overhead', results are CSV on stdout:
+#
+#   workload,instr,runtime,mode,plain_ms,llcov_ms,slowdown,output_bytes,llcov_rss_kb
+#
+# Times are the best of BENCH_RUNS runs. output_bytes is what the run
+# leaves behind: the LLCOV_FILE output, anything on stderr, or for the
+# network runtime the snapshot written by llcov-collectd.
+#
+# Instrumentation variants:
+#
+#   full - every block
+#   main - whitelist with only main() of the workload, i.e. the hot
+#          kernels are not instrumented; shows what a list saves
+#
+# Environment: LLCOV_CC (default: clang) compiles the plain builds and
+# is used by llcov-clang, LLCOV_CXX (default: clang++) links against the
+# runtimes, BENCH_OPT (default: -O2) is the optimization level and
+# BENCH_RUNS (default: 3) the number of runs per configuration and
+# BENCH_FILTER an extended regex for the runtime/mode pairs to run, e.g.
+# 'dedup|bloom' or 'rt/(map|binary)'. Note that rt/file and rt/stderr
+# write one record per executed block and are slow by design.
+#
+
+DIR=`dirname "$0"`
+TOP="$DIR/.."
+CC=${LLCOV_CC:-clang}
+CXX=${LLCOV_CXX:-clang++}
+OPT=${BENCH_OPT:--O2}
+RUNS=${BENCH_RUNS:-3}
+TMP=`mktemp -d /tmp/llcov-overhead-bench.XXXXXX` || exit 1
+
+trap 'rm -rf "$TMP"' EXIT
+
+for v in `env | sed -n 's/^\(LLCOV_[A-Z_]*\)=.*/\1/p'`; do
+  case "$v" in LLCOV_CC|LLCOV_CXX|LLCOV_PATH) ;; *) unset "$v" ;; esac
+done
+
+export LLCOV_QUIET=1
+
+# Runs a binary RUNS times with the given environment, leaves the best
+# "wall_ms,max_rss_kb" in $BEST and the output of the last run in
+# $TMP/stdout. Returns non-zero if any run fails.
+
+best_of() {
+
+  BIN="$1"; shift
+  BEST=""
+
+  i=0
+  while [ $i -lt $RUNS ]; do
+
+    rm -rf "$TMP/out" "$TMP/err" "$TMP/collect"
+
+    if [ -n "$COLLECT" ]; then
+      "$TOP/llcov-collectd" -j 1 -u "$TMP/sock" -o "$TMP/collect" >/dev/null 2>&1 &
+      CPID=$!
+      n=0
+      while [ ! -S "$TMP/sock" ] && [ $n -lt 100 ]; do sleep 0.05; n=$((n + 1)); done
+    fi
+
+    env "$@" "$DIR/llcov-measure" "$BIN" >"$TMP/stdout" 2>"$TMP/err"
+    STATUS=$?
+
+    if [ -n "$COLLECT" ]; then
+      kill $CPID; wait $CPID
+      rm -f "$TMP/sock"
+    fi
+
+    [ $STATUS -eq 0 ] || return 1
+
+    CUR=`tail -n 1 "$TMP/stdout"`
+
+    if [ -z "$BEST" ] || awk -v a="${CUR%%,*}" -v b="${BEST%%,*}" 'BEGIN { exit !(a < b) }'; then
+      BEST="$CUR"
+    fi
+
+    i=$((i + 1))
+
+  done
+
+}
+
+
+output_bytes() {
+
+  cat "$TMP/out" "$TMP/err" "$TMP"/collect/* 2>/dev/null | wc -c | tr -d ' '
+
+}
+
+
+echo "workload,instr,runtime,mode,plain_ms,llcov_ms,slowdown,output_bytes,llcov_rss_kb"
+
+for SRC in "$DIR"/workloads/*.c; do
+
+  W=`basename "$SRC" .c`
+
+  $CC $OPT "$SRC" -o "$TMP/$W-plain" || {
+    echo "[-] Plain build of $W failed" 1>&2
+    continue
+  }
+
+  COLLECT=""
+  best_of "$TMP/$W-plain" || continue
+  PLAIN_MS=${BEST%%,*}
+  head -n -1 "$TMP/stdout" >"$TMP/expected"
+
+  echo "file:$W.c func:main" >"$TMP/main.wl"
+
+  for INSTR in full main; do
+
+    if [ "$INSTR" = main ]; then LISTS="LLCOV_WHITELIST=$TMP/main.wl"; else LISTS=""; fi
+
+    env $LISTS "$TOP/llcov-clang" $OPT -c "$SRC" -o "$TMP/$W.o" || {
+      echo "[-] llcov-clang failed for $W/$INSTR" 1>&2
+      continue
+    }
+
+    while read RT MODE ENVS; do
+
+      if [ -n "$BENCH_FILTER" ] && ! echo "$RT/$MODE" | grep -qE "$BENCH_FILTER"; then
+        continue
+      fi
+
+      if [ ! -f "$TMP/$W-$RT" ]; then
+        case "$RT" in rt) RT_OBJ=llcov-llvm-rt.o ;; *) RT_OBJ=llcov-rt-$RT.o ;; esac
+        $CXX "$TMP/$W.o" "$TOP/$RT_OBJ" -pthread -o "$TMP/$W-$RT" || {
+          echo "[-] Link of $W with $RT failed" 1>&2
+          continue
+        }
+      fi
+
+      case "$ENVS" in *LLCOV_HOST*) COLLECT=1 ;; *) COLLECT="" ;; esac
+
+      best_of "$TMP/$W-$RT" $ENVS || {
+        echo "[-] $W/$INSTR $RT/$MODE failed" 1>&2
+        continue
+      }
+
+      # An instrumented build must compute the same result
+
+      if ! head -n -1 "$TMP/stdout" | cmp -s - "$TMP/expected"; then
+        echo "[-] $W/$INSTR $RT/$MODE produced different output" 1>&2
+        continue
+      fi
+
+      echo "$W,$INSTR,$RT,$MODE,$PLAIN_MS,$BEST,`output_bytes`" | awk -F, -v OFS=, \
+        '{ print $1, $2, $3, $4, $5, $6, sprintf("%.2f", $6 / ($5 ? $5 : 1)), $8, $7 }'
+
+    done <<EOF
+rt map LLCOV_MAP_SIZE=1048576
+rt hitcounts LLCOV_HITCOUNTS=1 LLCOV_MAP_SIZE=1048576
+rt file LLCOV_FILE=$TMP/out
+rt binary LLCOV_FILE=$TMP/out LLCOV_FORMAT=binary
+rt compress LLCOV_FILE=$TMP/out LLCOV_FORMAT=binary LLCOV_COMPRESS=1
+rt stderr LLCOV_STDERR=1
+dedup file LLCOV_FILE=$TMP/out
+dedup nomap LLCOV_FILE=$TMP/out LLCOV_MAP_SIZE=0
+bloom file LLCOV_FILE=$TMP/out
+bloom map LLCOV_FILE=$TMP/out LLCOV_MAP_SIZE=1048576
+net map LLCOV_MAP_SIZE=1048576
+net stream LLCOV_HOST=unix:$TMP/sock
+EOF
+
+    rm -f "$TMP/$W-"rt "$TMP/$W-"dedup "$TMP/$W-"bloom "$TMP/$W-"net
+
+  done
+
+done
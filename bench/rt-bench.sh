@@ -0,0 +1,74 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Runs llcov-rt-bench for every runtime, mode, pattern and thread count
+# and prints the results as CSV. Built and run by 'make bench-rt'.
+#
+# Usage: rt-bench.sh [ ms per run ] > results.csv
+#
+
+MS=${1:-200}
+DIR=`dirname "$0"`
+TOP="$DIR/.."
+TMP=`mktemp -d /tmp/llcov-rt-bench.XXXXXX` || exit 1
+
+trap 'rm -rf "$TMP"' EXIT
+
+for v in `env | sed -n 's/^\(LLCOV_[A-Z_]*\)=.*/\1/p'`; do unset "$v"; done
+
+echo "runtime,mode,pattern,threads,probes,elapsed_us,ns_per_probe,mprobes_per_s"
+
+# runtime mode environment...
+
+while read RT MODE ENVS; do
+
+  for PATTERN in cold hot repeat; do
+    for THREADS in 1 8 64; do
+
+      rm -rf "$TMP/out" "$TMP/collect"
+
+      # Streaming rows send to a live collector, as in overhead-bench.sh
+
+      case "$ENVS" in *LLCOV_HOST*) COLLECT=1 ;; *) COLLECT="" ;; esac
+
+      if [ -n "$COLLECT" ]; then
+        "$TOP/llcov-collectd" -j 1 -u "$TMP/sock" -o "$TMP/collect" >/dev/null 2>&1 &
+        CPID=$!
+        n=0
+        while [ ! -S "$TMP/sock" ] && [ $n -lt 100 ]; do sleep 0.05; n=$((n + 1)); done
+      fi
+
+      LINE=`env $ENVS "$DIR/llcov-rt-bench-$RT" $PATTERN $THREADS $MS 2>/dev/null`
+
+      if [ -n "$COLLECT" ]; then
+        kill $CPID; wait $CPID
+        rm -f "$TMP/sock"
+      fi
+
+      if [ -z "$LINE" ]; then
+        echo "[-] $RT/$MODE $PATTERN $THREADS failed" 1>&2
+        continue
+      fi
+
+      echo "$RT,$MODE,$LINE"
+
+    done
+  done
+
+done <<EOF
+rt map LLCOV_MAP_SIZE=1048576
+rt hitcounts LLCOV_HITCOUNTS=1 LLCOV_MAP_SIZE=1048576
+rt file LLCOV_FILE=$TMP/out
+rt binary LLCOV_FILE=$TMP/out LLCOV_FORMAT=binary
+rt stderr LLCOV_STDERR=1
+dedup file LLCOV_FILE=$TMP/out
+dedup nomap LLCOV_FILE=$TMP/out LLCOV_MAP_SIZE=0
+bloom file LLCOV_FILE=$TMP/out
+bloom map LLCOV_FILE=$TMP/out LLCOV_MAP_SIZE=1048576
+so map LLCOV_MAP_SIZE=1048576
+stub map LLCOV_MAP_SIZE=1048576
+net map LLCOV_MAP_SIZE=1048576
+net stream LLCOV_HOST=unix:$TMP/sock
+EOF
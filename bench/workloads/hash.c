@@ -0,0 +1,112 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Overhead workload: open-addressing hash table with string keys,
+  mixing inserts, lookups (hits and misses) and deletions. Short
+  functions called very often, with poorly predictable branches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define TAB_SIZE (1 << 16)
+
+struct slot {
+  char key[16];
+  uint32_t val;
+  uint8_t state;                      /* 0 = empty, 1 = used, 2 = deleted */
+};
+
+static struct slot tab[TAB_SIZE];
+static uint64_t seed = 2463534242ULL;
+
+
+static uint32_t rnd(void) {
+
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed >> 32;
+
+}
+
+
+static uint32_t hash(const char* s) {
+
+  uint32_t h = 2166136261U;
+
+  while (*s) h = (h ^ (uint8_t)*s++) * 16777619U;
+  return h;
+
+}
+
+
+static struct slot* find(const char* key, int insert) {
+
+  uint32_t i = hash(key) & (TAB_SIZE - 1);
+  struct slot* tomb = NULL;
+
+  for (;;) {
+
+    struct slot* s = &tab[i];
+
+    if (s->state == 0) {
+      if (!insert) return NULL;
+      return tomb ? tomb : s;
+    }
+
+    if (s->state == 2) {
+      if (!tomb) tomb = s;
+    } else if (!strcmp(s->key, key)) return s;
+
+    i = (i + 1) & (TAB_SIZE - 1);
+
+  }
+
+}
+
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 3000000, r, used = 0;
+  uint64_t sum = 0;
+
+  for (r = 0; r < rounds; r++) {
+
+    char key[16];
+    uint32_t op = rnd(), k = rnd() % 40000;
+    struct slot* s;
+
+    snprintf(key, sizeof(key), "k%u", k);
+
+    switch (op % 4) {
+
+      case 0:
+      case 1:
+        if (used > TAB_SIZE / 2) break;
+        s = find(key, 1);
+        if (s->state != 1) { strcpy(s->key, key); s->state = 1; used++; }
+        s->val += op;
+        break;
+
+      case 2:
+        s = find(key, 0);
+        if (s) sum += s->val;
+        break;
+
+      case 3:
+        s = find(key, 0);
+        if (s) { s->state = 2; used--; }
+        break;
+
+    }
+
+  }
+
+  printf("%llu %d\n", (unsigned long long)sum, used);
+  return 0;
+
+}
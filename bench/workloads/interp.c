@@ -0,0 +1,112 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Overhead workload: switch-dispatched bytecode interpreter for a small
+  stack machine, running a few programs (loops, arithmetic, calls).
+  Every instruction goes through a highly branchy dispatch, which is
+  the worst case for per-block probes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+enum {
+  OP_PUSH, OP_LOAD, OP_STORE, OP_ADD, OP_SUB, OP_MUL, OP_MOD, OP_XOR,
+  OP_SHR, OP_LT, OP_JMP, OP_JZ, OP_CALL, OP_RET, OP_DUP, OP_POP, OP_HALT
+};
+
+static int64_t stack[256], vars[16];
+static int64_t* sp;
+
+
+/* Counts the Collatz steps of 1..n-1 and mixes a hash of every start
+   value in through a call. Variables: 0 = i, 1 = x, 2 = acc, 3 = steps,
+   15 = n. */
+
+static const int64_t prog[] = {
+
+  /*  0 */ OP_PUSH, 1, OP_STORE, 0,
+  /*  4 */ OP_LOAD, 0, OP_LOAD, 15, OP_LT, OP_JZ, 68,         /* i < n      */
+  /* 11 */ OP_LOAD, 0, OP_STORE, 1,
+  /* 15 */ OP_PUSH, 1, OP_LOAD, 1, OP_LT, OP_JZ, 57,          /* 1 < x      */
+  /* 22 */ OP_LOAD, 1, OP_PUSH, 2, OP_MOD, OP_JZ, 41,         /* x odd      */
+  /* 29 */ OP_LOAD, 1, OP_PUSH, 3, OP_MUL, OP_PUSH, 1, OP_ADD,
+           OP_STORE, 1, OP_JMP, 48,
+  /* 41 */ OP_LOAD, 1, OP_PUSH, 1, OP_SHR, OP_STORE, 1,
+  /* 48 */ OP_LOAD, 3, OP_PUSH, 1, OP_ADD, OP_STORE, 3, OP_JMP, 15,
+  /* 57 */ OP_CALL, 76, OP_LOAD, 0, OP_PUSH, 1, OP_ADD, OP_STORE, 0,
+           OP_JMP, 4,
+  /* 68 */ OP_LOAD, 2, OP_LOAD, 3, OP_XOR, OP_STORE, 2, OP_HALT,
+  /* 76 */ OP_LOAD, 0, OP_PUSH, 2654435761LL, OP_MUL, OP_DUP, OP_PUSH, 13,
+           OP_SHR, OP_XOR, OP_LOAD, 2, OP_XOR, OP_STORE, 2, OP_RET
+
+};
+
+
+static int64_t run(int64_t n) {
+
+  const int64_t* pc = prog;
+  const int64_t* calls[64];
+  int64_t a, b;
+  uint32_t depth = 0;
+
+  sp = stack;
+  vars[2] = vars[3] = 0;
+  vars[15] = n;
+
+  for (;;) {
+
+    switch (*pc++) {
+
+      case OP_PUSH:  *sp++ = *pc++; break;
+      case OP_LOAD:  *sp++ = vars[*pc++]; break;
+      case OP_STORE: vars[*pc++] = *--sp; break;
+      case OP_ADD:   b = *--sp; a = *--sp; *sp++ = a + b; break;
+      case OP_SUB:   b = *--sp; a = *--sp; *sp++ = a - b; break;
+      case OP_MUL:   b = *--sp; a = *--sp; *sp++ = a * b; break;
+      case OP_MOD:   b = *--sp; a = *--sp; *sp++ = b ? a % b : 0; break;
+      case OP_XOR:   b = *--sp; a = *--sp; *sp++ = a ^ b; break;
+      case OP_SHR:   b = *--sp; a = *--sp; *sp++ = (uint64_t)a >> (b & 63); break;
+      case OP_LT:    b = *--sp; a = *--sp; *sp++ = a < b; break;
+      case OP_JMP:   pc = prog + *pc; break;
+      case OP_JZ:    if (*--sp) pc++; else pc = prog + *pc; break;
+      case OP_DUP:   a = sp[-1]; *sp++ = a; break;
+      case OP_POP:   sp--; break;
+
+      case OP_CALL:
+        if (depth == 64) return -1;
+        calls[depth++] = pc + 1;
+        pc = prog + *pc;
+        break;
+
+      case OP_RET:
+        if (!depth) return -1;
+        pc = calls[--depth];
+        break;
+
+      case OP_HALT:
+        return vars[2] + vars[3];
+
+      default:
+        return -1;
+
+    }
+
+  }
+
+}
+
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 20, r;
+  int64_t sum = 0;
+
+  for (r = 0; r < rounds; r++) sum += run(4000 + r);
+
+  printf("%lld\n", (long long)sum);
+  return 0;
+
+}
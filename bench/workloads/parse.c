@@ -0,0 +1,275 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Overhead workload: tokenizer and recursive-descent parser for a small
+  JSON-like language, run over generated documents. Many small
+  functions, deep call chains and character-class branches, much like
+  the input handling code that coverage is usually wanted for.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static char* doc;
+static size_t doc_len, doc_alloc;
+
+static const char* cur;
+static uint64_t sum;
+
+
+static uint32_t rnd(uint32_t limit) {
+
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (seed >> 32) % limit;
+
+}
+
+
+static void put(const char* s) {
+
+  size_t len = strlen(s);
+
+  if (doc_len + len + 1 > doc_alloc) {
+    doc_alloc = (doc_len + len + 1) * 2;
+    doc = realloc(doc, doc_alloc);
+  }
+
+  memcpy(doc + doc_len, s, len + 1);
+  doc_len += len;
+
+}
+
+
+static void gen_value(int depth) {
+
+  char buf[32];
+  int i, n;
+
+  switch (depth > 5 ? rnd(4) : rnd(6)) {
+
+    case 0:
+      snprintf(buf, sizeof(buf), "%d", (int)rnd(200000) - 100000);
+      put(buf);
+      break;
+
+    case 1:
+      snprintf(buf, sizeof(buf), "%u.%u", rnd(1000), rnd(1000));
+      put(buf);
+      break;
+
+    case 2:
+      put("\"");
+      for (i = rnd(12); i > 0; i--) {
+        buf[0] = 'a' + rnd(26);
+        buf[1] = 0;
+        put(rnd(10) ? buf : "\\n");
+      }
+      put("\"");
+      break;
+
+    case 3:
+      put(rnd(3) ? (rnd(2) ? "true" : "false") : "null");
+      break;
+
+    case 4:
+      put("[ ");
+      for (n = rnd(6), i = 0; i < n; i++) {
+        if (i) put(", ");
+        gen_value(depth + 1);
+      }
+      put(" ]");
+      break;
+
+    case 5:
+      put("{\n");
+      for (n = rnd(6), i = 0; i < n; i++) {
+        if (i) put(",\n");
+        snprintf(buf, sizeof(buf), "  \"k%u\": ", rnd(100));
+        put(buf);
+        gen_value(depth + 1);
+      }
+      put("\n}");
+      break;
+
+  }
+
+}
+
+
+static void skip_ws(void) {
+
+  while (*cur == ' ' || *cur == '\n' || *cur == '\t' || *cur == '\r') cur++;
+
+}
+
+
+static int parse_value(void);
+
+
+static int parse_string(void) {
+
+  uint32_t h = 5381;
+
+  cur++;
+
+  while (*cur != '"') {
+
+    if (!*cur) return -1;
+
+    if (*cur == '\\') {
+      cur++;
+      switch (*cur) {
+        case 'n': h = h * 33 + '\n'; break;
+        case 't': h = h * 33 + '\t'; break;
+        case '"': case '\\': h = h * 33 + *cur; break;
+        default: return -1;
+      }
+    } else h = h * 33 + *cur;
+
+    cur++;
+
+  }
+
+  cur++;
+  sum += h;
+  return 0;
+
+}
+
+
+static int parse_number(void) {
+
+  int64_t v = 0, sign = 1;
+
+  if (*cur == '-') { sign = -1; cur++; }
+  if (*cur < '0' || *cur > '9') return -1;
+
+  while (*cur >= '0' && *cur <= '9') v = v * 10 + *cur++ - '0';
+
+  if (*cur == '.') {
+    cur++;
+    while (*cur >= '0' && *cur <= '9') v = v * 10 + *cur++ - '0';
+  }
+
+  sum += v * sign;
+  return 0;
+
+}
+
+
+static int parse_word(const char* w) {
+
+  size_t len = strlen(w);
+
+  if (strncmp(cur, w, len)) return -1;
+
+  cur += len;
+  sum += len;
+  return 0;
+
+}
+
+
+static int parse_array(void) {
+
+  cur++;
+  skip_ws();
+
+  if (*cur == ']') { cur++; return 0; }
+
+  for (;;) {
+
+    if (parse_value()) return -1;
+    skip_ws();
+
+    if (*cur == ']') { cur++; return 0; }
+    if (*cur != ',') return -1;
+    cur++;
+
+  }
+
+}
+
+
+static int parse_object(void) {
+
+  cur++;
+  skip_ws();
+
+  if (*cur == '}') { cur++; return 0; }
+
+  for (;;) {
+
+    skip_ws();
+    if (*cur != '"' || parse_string()) return -1;
+
+    skip_ws();
+    if (*cur != ':') return -1;
+    cur++;
+
+    if (parse_value()) return -1;
+    skip_ws();
+
+    if (*cur == '}') { cur++; return 0; }
+    if (*cur != ',') return -1;
+    cur++;
+
+  }
+
+}
+
+
+static int parse_value(void) {
+
+  skip_ws();
+
+  switch (*cur) {
+
+    case '{': return parse_object();
+    case '[': return parse_array();
+    case '"': return parse_string();
+    case 't': return parse_word("true");
+    case 'f': return parse_word("false");
+    case 'n': return parse_word("null");
+    default: return parse_number();
+
+  }
+
+}
+
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 500, r, i;
+
+  /* Documents are generated once and parsed over and over, so that the
+     generator does not dominate the profile. */
+
+  for (i = 0; i < 4096; i++) {
+    put("{ \"doc\": ");
+    gen_value(0);
+    put(" }\n");
+  }
+
+  for (r = 0; r < rounds; r++) {
+
+    cur = doc;
+
+    while (*cur) {
+      if (parse_value()) { fprintf(stderr, "Parse error\n"); return 1; }
+      skip_ws();
+    }
+
+  }
+
+  printf("%llu %zu\n", (unsigned long long)sum, doc_len);
+  return 0;
+
+}
@@ -0,0 +1,99 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Overhead workload: introsort-style quicksort with an insertion sort
+  for small ranges, over pseudo-random arrays. Tight loops with data
+  dependent branches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+static uint64_t seed = 88172645463325252ULL;
+
+
+static uint32_t rnd(void) {
+
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed >> 32;
+
+}
+
+
+static void insertion_sort(uint32_t* a, int n) {
+
+  int i, j;
+
+  for (i = 1; i < n; i++) {
+
+    uint32_t v = a[i];
+
+    for (j = i - 1; j >= 0 && a[j] > v; j--) a[j + 1] = a[j];
+    a[j + 1] = v;
+
+  }
+
+}
+
+
+static void quick_sort(uint32_t* a, int n) {
+
+  while (n > 16) {
+
+    uint32_t p = a[n / 2], t;
+    int i = 0, j = n - 1;
+
+    if (a[0] > p && a[n - 1] > p) p = a[0] < a[n - 1] ? a[0] : a[n - 1];
+    else if (a[0] < p && a[n - 1] < p) p = a[0] > a[n - 1] ? a[0] : a[n - 1];
+
+    while (i <= j) {
+      while (a[i] < p) i++;
+      while (a[j] > p) j--;
+      if (i <= j) { t = a[i]; a[i] = a[j]; a[j] = t; i++; j--; }
+    }
+
+    /* Recurse into the smaller half */
+
+    if (j + 1 < n - i) {
+      quick_sort(a, j + 1);
+      a += i;
+      n -= i;
+    } else {
+      quick_sort(a + i, n - i);
+      n = j + 1;
+    }
+
+  }
+
+  insertion_sort(a, n);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 40, n = 100000, r, i;
+  uint32_t* a = malloc(n * sizeof(uint32_t));
+  uint64_t sum = 0;
+
+  for (r = 0; r < rounds; r++) {
+
+    for (i = 0; i < n; i++) a[i] = rnd() % (r & 1 ? 1000 : 0xFFFFFFFF);
+
+    quick_sort(a, n);
+
+    for (i = 1; i < n; i++)
+      if (a[i - 1] > a[i]) { fprintf(stderr, "Not sorted\n"); return 1; }
+
+    sum += a[n / 3] ^ a[n / 7];
+
+  }
+
+  printf("%llu\n", (unsigned long long)sum);
+  return 0;
+
+}
@@ -240,6 +240,82 @@
    100663045,    /* Large positive number (endian-agnostic) */ \
    2147483647    /* Overflow signed 32-bit when incremented */
 
+/***********************************************************
+ *                                                         *
+ *  LLCov runtime settings:                                *
+ *                                                         *
+ ***********************************************************/
+
+/* Default number of distinct blocks (2^LLCOV_MAP_SIZE_POW2) the in-memory
+   coverage map of the runtimes can hold. Override with LLCOV_MAP_SIZE at
+   run time. Memory is reserved up front but only touched as needed: */
+
+#define LLCOV_MAP_SIZE_POW2 20
+
+/* Size of the buffer used to write snapshots: */
+
+#define LLCOV_SNAP_BUF      65536
+
+/* Default port used by the network runtime (LLCOV_HOST=host[:port]): */
+
+#define LLCOV_NET_PORT      7777
+
+/* Number of records the probe-side ring buffer of the network runtime can
+   hold. Probes that find the ring full are counted and dropped. Must be a
+   power of two: */
+
+#define LLCOV_NET_RING      (1 << 16)
+
+/* Number of slots in the per-thread cache that filters repeated probes
+   before they reach the ring. Must be a power of two: */
+
+#define LLCOV_NET_TCACHE    256
+
+/* Maximum number of deduplicated records queued for the socket. Once this
+   is reached, the sender stops draining the ring: */
+
+#define LLCOV_NET_PENDING   (1 << 18)
+
+/* Maximum number of records sent in a single frame: */
+
+#define LLCOV_NET_BATCH     4096
+
+/* Reconnect backoff bounds (milliseconds): */
+
+#define LLCOV_NET_RETRY_MIN 50
+#define LLCOV_NET_RETRY_MAX 5000
+
+/* Default time the exit handler grants the sender thread to flush queued
+   records (milliseconds, override with LLCOV_NET_EXIT_MS), and the most
+   the override may ask for: */
+
+#define LLCOV_NET_EXIT_MS   500
+#define LLCOV_NET_EXIT_MAX  60000
+
+/* Size of the static Bloom filter buffer of the fixed-memory dedup runtime
+   (llcov_bloom.cc), in bytes. Filters that do not fit are mapped once at
+   startup. Must be a power of two and at least 64: */
+
+#define LLCOV_BLOOM_SIZE    (1 << 18)
+
+/* Default number of distinct blocks the filter is sized for (override with
+   LLCOV_BLOOM_EXPECT, or give the size directly with LLCOV_BLOOM_SIZE).
+   At the default rate below, 80000 blocks just fit the static buffer: */
+
+#define LLCOV_BLOOM_EXPECT  80000
+
+/* Default false-positive rate the filter is tuned for (override with
+   LLCOV_BLOOM_FPR). A false positive means a block is never reported: */
+
+#define LLCOV_BLOOM_FPR     0.0001
+
+/* Stable block ids (LLCOV_STABLE_IDS) are recorded in place of the relblock
+   and are this value plus a 15-bit hash, so they fit the relblock field of
+   llcov-merge. The pass stops counting relblocks just below, so the two
+   never collide: */
+
+#define LLCOV_ID_BASE       0x8000
+
 /***********************************************************
  *                                                         *
  *  Really exotic stuff you probably don't want to touch:  *
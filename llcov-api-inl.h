@@ -0,0 +1,99 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Implementation of the control API (llcov.h) on top of the coverage map.
+
+  Included once by each runtime, which has to define rt_api_init() first;
+  it makes sure the runtime (and with it the map) is initialized, so the
+  API can be called before the first probe fires.
+ */
+
+#ifndef _HAVE_LLCOV_API_INL_H
+#define _HAVE_LLCOV_API_INL_H
+
+#include "llcov.h"
+#include "llcov-map-inl.h"
+#include "llcov-classify-inl.h"
+
+#define LLCOV_API extern "C" __attribute__((visibility("default")))
+
+static void rt_api_init();
+
+/* Sites reserved so far, not counting ids handed out after the map was
+   already full. */
+
+static inline u32 rt_api_sites() {
+    u32 cnt = __atomic_load_n(&rt_site_cnt, __ATOMIC_ACQUIRE);
+    return cnt < rt_map_size ? cnt : rt_map_size;
+}
+
+LLCOV_API void llcov_reset(void) {
+    rt_api_init();
+    if (rt_map_reset_hook)
+        rt_map_reset_hook();
+    else
+        rt_map_reset();
+}
+
+LLCOV_API long llcov_dump_to_fd(int fd) {
+    char buf[16384];
+    u32 pos = 0;
+
+    rt_api_init();
+    /* Text as promised in llcov.h, even with LLCOV_FORMAT=binary */
+    return (long)rt_map_write_text(fd, &pos, buf, sizeof(buf));
+}
+
+LLCOV_API size_t llcov_covered_count(void) {
+    rt_api_init();
+    return __atomic_load_n(&rt_covered_cnt, __ATOMIC_ACQUIRE);
+}
+
+LLCOV_API const uint8_t* llcov_get_bitmap(size_t* size) {
+    rt_api_init();
+    if (size) *size = rt_api_sites();
+    return rt_map_size ? rt_hits : NULL;
+}
+
+LLCOV_API void llcov_classify_counts(void) {
+    rt_api_init();
+    if (rt_map_size) rt_classify_counts(rt_hits, rt_api_sites());
+}
+
+LLCOV_API int llcov_get_site(size_t id, const char** filename, const char** funcname,
+                             uint32_t* line, uint32_t* relblock) {
+    rt_api_init();
+    if (id >= rt_api_sites()) return -1;
+
+    rt_site* s = &rt_sites[id];
+    const char* fn = __atomic_load_n(&s->filename, __ATOMIC_ACQUIRE);
+
+    /* Reserved, but the record is still being filled in */
+    if (!fn) return -1;
+
+    if (filename) *filename = fn;
+    if (funcname) *funcname = s->funcname;
+    if (line) *line = s->line;
+    if (relblock) *relblock = s->relblock;
+    return 0;
+}
+
+#include "llcov-stats-inl.h"
+#include "llcov-pc-inl.h"
+
+/* Shared builds (libllcov-rt*.so) also export the probe and the module
+   registration under names of their own, which is what the static stub in
+   llcov-rt-stub.cc looks up. The probe itself is defined by each runtime
+   after this. */
+
+#ifdef LLCOV_SHARED
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock);
+
+LLCOV_API void llcov_rt_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock)
+    __attribute__((alias("llvm_llcov_block_call")));
+
+LLCOV_API void llcov_rt_register_module(llcov_module* m) __attribute__((alias("llvm_llcov_register_module")));
+#endif /* LLCOV_SHARED */
+
+#endif /* ! _HAVE_LLCOV_API_INL_H */
@@ -18,15 +18,20 @@
     http://www.apache.org/licenses/LICENSE-2.0
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "config.h"
 #include "types.h"
 #include "debug.h"
 #include "alloc-inl.h"
+#include "llcov-path.h"
 
 #define VERSION "0.9a"
 
@@ -34,6 +39,24 @@ static u8*  obj_path;               /* Path to runtime libraries         */
 static u8** cc_params;              /* Parameters passed to the real CC  */
 static u32  cc_par_cnt = 1;         /* Param count, including argv0      */
 
+static u8** src_files;              /* Source files on the command line  */
+static u32  src_cnt;
+static u8   compiling;              /* Not just preprocessing or linking */
+
+static u8** inc_files;              /* Headers the sources include       */
+static u32  inc_cnt;
+static u8   inc_state;              /* 0 = not scanned, 1 = ok, 2 = fail */
+
+/* Lines of the white- and blacklist (LLCOV_WHITELIST, LLCOV_BLACKLIST) */
+
+struct llcov_list {
+  u8** lines;
+  u8** files;                       /* file: value of each line, or NULL */
+  u32  cnt;
+};
+
+static struct llcov_list lists[2];
+
 
 /* Try to find the runtime libraries. If that fails, abort. */
 
@@ -89,12 +112,456 @@ static void find_obj(u8* argv0) {
 }
 
 
+static const u8* src_exts[] = {
+  ".c", ".cc", ".cp", ".cpp", ".cxx", ".c++", ".C", ".CC", ".CPP",
+  ".m", ".mm", ".M", ".i", ".ii", NULL
+};
+
+
+static u8 has_src_ext(u8* name) {
+
+  u8* dot = strrchr(name, '.');
+  u32 i;
+
+  if (!dot || strchr(dot, '/')) return 0;
+
+  for (i = 0; src_exts[i]; i++)
+    if (!strcmp(dot, src_exts[i])) return 1;
+
+  return 0;
+
+}
+
+
+/* Options whose value is a separate argument that may look like a file */
+
+static u8 takes_value(u8* opt) {
+
+  static const char* opts[] = {
+    "-o", "-x", "-MF", "-MT", "-MQ", "-include", "-imacros", "-Xclang",
+    "-Xlinker", "-Xpreprocessor", NULL
+  };
+
+  u32 i;
+
+  for (i = 0; opts[i]; i++)
+    if (!strcmp(opt, opts[i])) return 1;
+
+  return 0;
+
+}
+
+
+/* Finds the source files on the command line, and whether this is a
+   compilation at all (as opposed to preprocessing or linking only). */
+
+static void find_sources(u32 argc, char** argv) {
+
+  u8 *x_lang = NULL, compile = 1;
+  u32 i;
+
+  src_files = ck_alloc(argc * sizeof(u8*));
+
+  for (i = 1; i < argc; i++) {
+
+    u8* cur = argv[i];
+
+    if (!strcmp(cur, "-E") || !strcmp(cur, "-M") || !strcmp(cur, "-MM"))
+      compile = 0;
+
+    if (cur[0] == '-') {
+
+      if (!strcmp(cur, "-x") && i + 1 < argc) x_lang = argv[i + 1];
+      if (takes_value(cur)) i++;
+      continue;
+
+    }
+
+    /* With -x, anything goes */
+
+    if ((x_lang && strcmp(x_lang, "none")) || has_src_ext(cur))
+      src_files[src_cnt++] = cur;
+
+  }
+
+  compiling = compile && src_cnt;
+
+}
+
+
+/* Returns the value of the file: token of a list line, or NULL. Like the
+   pass, the value ends at the next colon. */
+
+static u8* entry_file(u8* line) {
+
+  u8* p = line;
+
+  while (*p) {
+
+    u32 len;
+
+    while (*p == ' ' || *p == '\t') p++;
+
+    len = strcspn(p, " \t");
+
+    if (!strncmp(p, "file:", 5)) {
+      u32 vlen = strcspn(p + 5, " \t:");
+      return vlen ? ck_memdup_str(p + 5, vlen) : NULL;
+    }
+
+    p += len;
+
+  }
+
+  return NULL;
+
+}
+
+
+static void read_list(struct llcov_list* l, u8* env) {
+
+  u8* path = getenv(env);
+  FILE* f;
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!path || !*path) return;
+
+  /* Leave missing files to the pass, which has a proper error for it */
+
+  if (!(f = fopen(path, "r"))) return;
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    while (len && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) buf[--len] = 0;
+    if (!len) continue;
+
+    l->lines = ck_realloc_block(l->lines, (l->cnt + 1) * sizeof(u8*));
+    l->files = ck_realloc_block(l->files, (l->cnt + 1) * sizeof(u8*));
+
+    l->lines[l->cnt] = ck_strdup((u8*)buf);
+    l->files[l->cnt] = entry_file(l->lines[l->cnt]);
+    l->cnt++;
+
+  }
+
+  free(buf);
+  fclose(f);
+
+}
+
+
+/* Gets the include set of the sources by running the real compiler with
+   -M on the same arguments, minus output and dependency options. */
+
+static void scan_includes(u32 argc, char** argv) {
+
+  u8** params = ck_alloc((argc + 8) * sizeof(u8*));
+  u8 *buf = NULL, *p;
+  u32 cnt = 0, len = 0, alloc = 0, i;
+  s32 pipefd[2], status;
+  pid_t pid;
+
+  params[cnt++] = cc_params[0];
+
+  for (i = 1; i < argc; i++) {
+
+    u8* cur = argv[i];
+
+    if (!strcmp(cur, "-o") || !strcmp(cur, "-MF") || !strcmp(cur, "-MT") ||
+        !strcmp(cur, "-MQ")) { i++; continue; }
+
+    if (!strncmp(cur, "-o", 2) || !strncmp(cur, "-MF", 3) ||
+        !strncmp(cur, "-MT", 3) || !strncmp(cur, "-MQ", 3) ||
+        !strcmp(cur, "-c") || !strcmp(cur, "-S") || !strcmp(cur, "-MD") ||
+        !strcmp(cur, "-MMD") || !strcmp(cur, "-MP")) continue;
+
+    params[cnt++] = cur;
+
+  }
+
+  params[cnt++] = "-M";
+  params[cnt++] = "-MG";
+  params[cnt++] = "-w";
+  params[cnt] = NULL;
+
+  inc_state = 2;
+
+  if (pipe(pipefd)) return;
+
+  pid = fork();
+  if (pid < 0) return;
+
+  if (!pid) {
+
+    s32 null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(pipefd[1], 1);
+    dup2(null_fd, 2);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    execvp(params[0], (char**)params);
+    _exit(1);
+
+  }
+
+  close(pipefd[1]);
+
+  for (;;) {
+
+    s32 n;
+
+    if (len + 4096 + 1 > alloc) {
+      alloc = (len + 4096 + 1) * 2;
+      buf = ck_realloc(buf, alloc);
+    }
+
+    n = read(pipefd[0], buf + len, 4096);
+    if (n <= 0) break;
+    len += n;
+
+  }
+
+  close(pipefd[0]);
+  ck_free(params);
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) ||
+      !buf) {
+    ck_free(buf);
+    return;
+  }
+
+  buf[len] = 0;
+
+  /* Make syntax: "target.o: dep dep \<newline> dep", spaces escaped */
+
+  inc_files = ck_alloc(sizeof(u8*));
+  p = buf;
+
+  while (*p) {
+
+    u8 *start, *out;
+
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ||
+           (*p == '\\' && (p[1] == '\n' || p[1] == '\r'))) p++;
+
+    if (!*p) break;
+
+    start = out = p;
+
+    while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+
+      if (*p == '\\' && (p[1] == ' ' || p[1] == '#')) p++;
+      else if (*p == '$' && p[1] == '$') p++;
+      else if (*p == '\\' && (p[1] == '\n' || p[1] == '\r')) break;
+
+      *out++ = *p++;
+
+    }
+
+    if (*p && *p != '\\') p++;
+
+    if (out == start || out[-1] == ':') continue;
+
+    inc_files = ck_realloc_block(inc_files, (inc_cnt + 1) * sizeof(u8*));
+    inc_files[inc_cnt++] = ck_memdup_str(start, out - start);
+
+  }
+
+  ck_free(buf);
+  inc_state = 1;
+
+}
+
+
+/* Decides whether a list entry for the given file can match any block of
+   this TU. Entries for anything but the TU's own sources are checked
+   against the include set, source files included: unified builds and
+   '#include "impl.c"' pull other .c/.cpp files in. If the include set
+   could not be determined, they are assumed to match. */
+
+static u8 entry_applies(u8* file) {
+
+  u32 i;
+
+  if (!file) return 1;
+
+  for (i = 0; i < src_cnt; i++)
+    if (llcov_suffix_match(src_files[i], file)) return 1;
+
+  if (inc_state == 1) {
+
+    for (i = 0; i < inc_cnt; i++)
+      if (llcov_suffix_match(inc_files[i], file)) return 1;
+
+    return 0;
+
+  }
+
+  return inc_state == 2;
+
+}
+
+
+/* Reads both lists and works out which entries apply to this TU, running
+   the include scan only if some entry needs it. */
+
+static void load_lists(u32 argc, char** argv) {
+
+  u32 i, j;
+
+  read_list(&lists[0], "LLCOV_WHITELIST");
+  read_list(&lists[1], "LLCOV_BLACKLIST");
+
+  for (i = 0; i < 2 && !inc_state; i++)
+    for (j = 0; j < lists[i].cnt; j++) {
+
+      u8* file = lists[i].files[j];
+      u32 k;
+
+      if (!file) continue;
+
+      for (k = 0; k < src_cnt; k++)
+        if (llcov_suffix_match(src_files[k], file)) break;
+
+      if (k == src_cnt) {
+        scan_includes(argc, argv);
+        break;
+      }
+
+    }
+
+}
+
+
+static int cmp_str(const void* a, const void* b) {
+
+  return strcmp(*(char**)a, *(char**)b);
+
+}
+
+
+/* FNV-1a over the list entries that apply to this TU, sorted so that the
+   order of entries in the list does not matter. Compilers and caches see
+   it as -DLLCOV_LIST_HASH=..., so a list change only invalidates cached
+   objects that it can actually affect. */
+
+static u64 list_hash(void) {
+
+  u64 h = 0xCBF29CE484222325ULL;
+  u32 i, j;
+
+  for (i = 0; i < 2; i++) {
+
+    u8** applied;
+    u32 cnt = 0;
+
+    /* Whether a list has entries matters too: a whitelist without any
+       applicable entries means no probes, an empty one means all */
+
+    h = (h ^ (lists[i].cnt ? 'W' + i : 0)) * 0x100000001B3ULL;
+
+    if (!lists[i].cnt) continue;
+
+    applied = ck_alloc(lists[i].cnt * sizeof(u8*));
+
+    for (j = 0; j < lists[i].cnt; j++)
+      if (entry_applies(lists[i].files[j])) applied[cnt++] = lists[i].lines[j];
+
+    qsort(applied, cnt, sizeof(u8*), cmp_str);
+
+    for (j = 0; j < cnt; j++) {
+      u8* p = applied[j];
+      while (*p) h = (h ^ *p++) * 0x100000001B3ULL;
+      h = (h ^ '\n') * 0x100000001B3ULL;
+    }
+
+    ck_free(applied);
+
+  }
+
+  return h;
+
+}
+
+
+/* With a whitelist, a TU that none of its entries can match gets no
+   probes at all. It is then compiled exactly as the plain compiler would,
+   without loading the pass and without the extra -g. */
+
+static u8 skip_pass(void) {
+
+  u32 i;
+
+  if (!compiling || !lists[0].cnt || getenv("LLCOV_NO_PREFILTER")) return 0;
+
+  for (i = 0; i < lists[0].cnt; i++)
+    if (entry_applies(lists[0].files[i])) return 0;
+
+  return 1;
+
+}
+
+
+/* Picks the runtime object to link from LLCOV_RUNTIME, see HOWTO. */
+
+static u8* runtime_obj(u8* need_cxx, u8* shared) {
+
+  static const char* names[][2] = {
+    { "default", "llcov-llvm-rt.o" },
+    { "dedup",   "llcov-rt-dedup.o" },
+    { "bloom",   "llcov-rt-bloom.o" },
+    { "net",     "llcov-rt-net.o" },
+    { "shared",  "llcov-rt-stub.o" },
+    { NULL, NULL }
+  };
+
+  u8 *rt = getenv("LLCOV_RUNTIME"), *obj;
+  u32 i;
+
+  *need_cxx = 0;
+  *shared   = 0;
+
+  if (!rt || !*rt) rt = "default";
+
+  /* Anything with a slash is a runtime built elsewhere. It may be one of
+     the C++ ones (llcov-rt-dedup.o needs libstdc++), and linking
+     libstdc++ for nothing does no harm. */
+
+  if (strchr(rt, '/')) {
+    *need_cxx = 1;
+    return rt;
+  }
+
+  for (i = 0; names[i][0]; i++)
+    if (!strcmp(rt, names[i][0])) break;
+
+  if (!names[i][0])
+    FATAL("Unknown LLCOV_RUNTIME '%s' (try default, dedup, bloom, net or shared)", rt);
+
+  obj = alloc_printf("%s/%s", obj_path, names[i][1]);
+
+  if (access(obj, R_OK))
+    FATAL("Runtime '%s' not found in '%s' - was it built?", names[i][1], obj_path);
+
+  /* The deduplicating runtime keeps a std::set */
+
+  *need_cxx = !strcmp(rt, "dedup");
+  *shared   = !strcmp(rt, "shared");
+
+  return obj;
+
+}
+
+
 /* Copy argv to cc_params, making the necessary edits. */
 
 static void edit_params(u32 argc, char** argv) {
 
-  u8 x_set = 0, maybe_linking = 1;
-  u8 *name;
+  u8 x_set = 0, maybe_linking = 1, skip;
+  u8 *name, *use_ld = NULL;
 
   cc_params = ck_alloc((argc + 64) * sizeof(u8*));
 
@@ -109,11 +576,19 @@ static void edit_params(u32 argc, char** argv) {
     cc_params[0] = alt_cc ? alt_cc : (u8*)"clang";
   }
 
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/llcov-llvm-pass.so", obj_path);
-  cc_params[cc_par_cnt++] = "-Qunused-arguments";
+  find_sources(argc, argv);
+
+  if (compiling) load_lists(argc, argv);
+
+  skip = skip_pass();
+
+  if (!skip) {
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/llcov-llvm-pass.so", obj_path);
+    cc_params[cc_par_cnt++] = "-Qunused-arguments";
+  }
 
   while (--argc) {
     u8* cur = *(++argv);
@@ -124,6 +599,8 @@ static void edit_params(u32 argc, char** argv) {
 
     if (!strcmp(cur, "-x")) x_set = 1;
 
+    if (!strncmp(cur, "-fuse-ld=", 9)) use_ld = cur + 9;
+
     if (!strcmp(cur, "-c") || !strcmp(cur, "-S") || !strcmp(cur, "-E") ||
         !strcmp(cur, "-v")) maybe_linking = 0;
 
@@ -131,18 +608,62 @@ static void edit_params(u32 argc, char** argv) {
 
   }
 
-  /* Debug information is required to properly resolve the original
-     locations of the instrumented basic blocks */
-  cc_params[cc_par_cnt++] = "-g";
+  if (!skip) {
+
+    /* Debug information is required to properly resolve the original
+       locations of the instrumented basic blocks */
+    cc_params[cc_par_cnt++] = "-g";
+
+    /* PC probes are identical calls; tail merging in the backend would
+       fold probes of different blocks into one */
+    if (getenv("LLCOV_PC")) {
+      cc_params[cc_par_cnt++] = "-mllvm";
+      cc_params[cc_par_cnt++] = "-enable-tail-merge=false";
+    }
+
+    if (compiling && (lists[0].cnt || lists[1].cnt))
+      cc_params[cc_par_cnt++] = alloc_printf("-DLLCOV_LIST_HASH=0x%016llx", list_hash());
+
+  }
 
   if (maybe_linking) {
 
+    u8 need_cxx, shared;
+
     if (x_set) {
       cc_params[cc_par_cnt++] = "-x";
       cc_params[cc_par_cnt++] = "none";
     }
 
-    cc_params[cc_par_cnt++] = alloc_printf("%s/llcov-llvm-rt.o", obj_path);
+    cc_params[cc_par_cnt++] = runtime_obj(&need_cxx, &shared);
+
+    /* The stub finds the runtime with dlsym(), so the library has to stay
+       needed even though nothing refers to it directly */
+
+    if (shared) {
+
+      /* --push-state is understood by GNU ld, gold, lld and mold only */
+
+#ifdef __APPLE__
+      FATAL("LLCOV_RUNTIME=shared needs GNU ld, gold, lld or mold");
+#endif /* __APPLE__ */
+
+      if (use_ld && !strstr(use_ld, "bfd") && !strstr(use_ld, "gold") &&
+          !strstr(use_ld, "lld") && !strstr(use_ld, "mold"))
+        FATAL("LLCOV_RUNTIME=shared needs GNU ld, gold, lld or mold, not '%s'", use_ld);
+
+      cc_params[cc_par_cnt++] = alloc_printf("-L%s", obj_path);
+      cc_params[cc_par_cnt++] = alloc_printf("-Wl,-rpath,%s", obj_path);
+      cc_params[cc_par_cnt++] = "-Wl,--push-state,--no-as-needed";
+      cc_params[cc_par_cnt++] = "-lllcov-rt";
+      cc_params[cc_par_cnt++] = "-Wl,--pop-state";
+      cc_params[cc_par_cnt++] = "-ldl";
+    }
+
+    /* The runtime uses pthread_atfork() to stay correct across fork() */
+    cc_params[cc_par_cnt++] = "-lpthread";
+
+    if (need_cxx) cc_params[cc_par_cnt++] = "-lstdc++";
 
   }
 
@@ -0,0 +1,134 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Hit count classification, as in AFL.
+
+  With LLCOV_HITCOUNTS set, every byte of the coverage map counts the
+  executions of its block (saturating at 255) rather than being a simple
+  flag. Before counts from different runs are compared, they are folded
+  into log2 buckets, so that a loop running a few more or fewer times
+  shows up as a change without every single iteration being one:
+
+    1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+  ->  1, 2, 4, 8, 16, 32, 64, 128
+
+  On x86 the work is done with SSE2, or AVX2 where the CPU has it; the
+  choice is made once at run time. Vectors of zeroes are not skipped: in
+  sparse maps the branch mispredicts often enough to cost more than it
+  saves.
+ */
+
+#ifndef _HAVE_LLCOV_CLASSIFY_INL_H
+#define _HAVE_LLCOV_CLASSIFY_INL_H
+
+#include "types.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define RT_CLASSIFY_X86 1
+#endif
+
+static const u8 rt_count_class[256] = {
+    0, 1, 2, 4, 8, 8, 8, 8,
+    16, 16, 16, 16, 16, 16, 16, 16,
+    32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+#define X4 64, 64, 64, 64
+#define X16 X4, X4, X4, X4
+    X16, X16, X16, X16, X16, X16,
+#undef X4
+#define X4 128, 128, 128, 128
+    X16, X16, X16, X16, X16, X16, X16, X16
+#undef X4
+#undef X16
+};
+
+static void rt_classify_scalar(u8* mem, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (mem[i]) mem[i] = rt_count_class[mem[i]];
+}
+
+#ifdef RT_CLASSIFY_X86
+
+/* SSE2 has no byte shuffle, so compare against the bucket thresholds
+   instead. Counts of 0-2 stay as they are, each later threshold overrides
+   the bucket picked by the earlier ones. */
+
+__attribute__((target("sse2")))
+static void rt_classify_sse2(u8* mem, size_t len) {
+    const __m128i min[6] = {
+        _mm_set1_epi8(3), _mm_set1_epi8(4), _mm_set1_epi8(8),
+        _mm_set1_epi8(16), _mm_set1_epi8(32), _mm_set1_epi8((char)128)
+    };
+    const __m128i val[6] = {
+        _mm_set1_epi8(4), _mm_set1_epi8(8), _mm_set1_epi8(16),
+        _mm_set1_epi8(32), _mm_set1_epi8(64), _mm_set1_epi8((char)128)
+    };
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(mem + i));
+        __m128i r = x;
+        for (u32 k = 0; k < 6; k++) {
+            /* x >= min, unsigned: max(x, min) == x */
+            __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(x, min[k]), x);
+            r = _mm_or_si128(_mm_and_si128(m, val[k]), _mm_andnot_si128(m, r));
+        }
+
+        _mm_storeu_si128((__m128i*)(mem + i), r);
+    }
+
+    rt_classify_scalar(mem + i, len - i);
+}
+
+/* With a byte shuffle, the bucket is a table lookup on the low nibble for
+   counts below 16 and on the high nibble otherwise. */
+
+__attribute__((target("avx2")))
+static void rt_classify_avx2(u8* mem, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    const __m256i lo_tab = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16));
+    const __m256i hi_tab = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        0, 32, 64, 64, 64, 64, 64, 64, (char)128, (char)128, (char)128, (char)128,
+        (char)128, (char)128, (char)128, (char)128));
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(mem + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nib);
+        __m256i lo = _mm256_shuffle_epi8(lo_tab, _mm256_and_si256(x, nib));
+        __m256i r = _mm256_shuffle_epi8(hi_tab, hi);
+
+        r = _mm256_blendv_epi8(r, lo, _mm256_cmpeq_epi8(hi, zero));
+        _mm256_storeu_si256((__m256i*)(mem + i), r);
+    }
+
+    rt_classify_scalar(mem + i, len - i);
+}
+
+#endif /* RT_CLASSIFY_X86 */
+
+static void (*rt_classify_impl)(u8* mem, size_t len);
+
+/* Fold the hit counts in mem into buckets, in place. */
+
+static void rt_classify_counts(u8* mem, size_t len) {
+    void (*f)(u8*, size_t) = __atomic_load_n(&rt_classify_impl, __ATOMIC_RELAXED);
+
+    if (!f) {
+        f = rt_classify_scalar;
+#ifdef RT_CLASSIFY_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            f = rt_classify_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            f = rt_classify_sse2;
+#endif
+        __atomic_store_n(&rt_classify_impl, f, __ATOMIC_RELAXED);
+    }
+
+    f(mem, len);
+}
+
+#endif /* ! _HAVE_LLCOV_CLASSIFY_INL_H */
@@ -0,0 +1,882 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Collector daemon for coverage streamed by the network runtime.
+
+  Accepts connections on TCP and/or Unix sockets, decodes the framed
+  records (see llcov-proto.h) and merges them into in-memory bitmaps, one
+  set per build id. The bitmaps are sharded by file name so that worker
+  threads rarely contend, and bits are set with atomic operations.
+
+  Snapshots are written periodically (and on shutdown) to the output
+  directory as <build-id>.cov, using the regular text record format.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-proto.h"
+#include "llcov-lz.h"
+
+#define SHARDS       64               /* File table shards per build      */
+#define REL_SHIFT    3                /* Bits reserved for relblock       */
+#define BM_LINES     (1 << 20)        /* Lines covered by the bitmap      */
+#define PAGE_BITS    4096             /* Bits per lazily allocated page   */
+#define PAGE_CNT     ((BM_LINES << REL_SHIFT) / PAGE_BITS)
+#define MAX_EVENTS   64
+#define READ_CHUNK   65536
+
+/* Overflow set of a file, (line << 32) | rel. Entries are stored + 1 so
+   that zero marks empty slots. */
+
+struct ovf_set {
+  u32 size, cnt;
+  u64 keys[];
+};
+
+/* Coverage of one source file. Lines beyond BM_LINES and relblocks that
+   do not fit into REL_SHIFT bits (stable block ids, PC offsets) go into
+   the overflow set. That is the slow path: looking a block up there needs
+   no lock, but the first sighting of every block takes the shard lock to
+   insert it. */
+
+struct cov_file {
+  u8*  name;
+  u64  hash;
+  u64** pages;                        /* PAGE_CNT pointers, CAS-installed */
+  struct ovf_set* ovf;                /* Published with release stores   */
+};
+
+struct cov_shard {
+  pthread_mutex_t lock;
+  struct cov_file** tab;
+  u32 size, cnt;
+};
+
+struct cov_build {
+  u8  id[LLCOV_MAX_BUILD_ID];
+  u16 id_len;
+  struct cov_shard shards[SHARDS];
+  struct cov_build* next;
+};
+
+struct conn {
+  s32 fd;
+  u8* buf;
+  u32 len, alloc;
+  u32 pid;
+  u64 drops;                          /* Last drop count reported         */
+  struct cov_build* build;
+  struct cov_file** ids;              /* Stream string id -> file         */
+  u32 ids_alloc;
+};
+
+struct worker {
+  pthread_t thread;
+  s32 efd;
+  u64 recs;                           /* Records merged (atomic)          */
+  u8* zbuf;                           /* Scratch for LZ frames            */
+};
+
+static u8* out_dir;                   /* Snapshot directory               */
+static u32 snap_secs = 60;            /* Snapshot interval                */
+static u32 worker_cnt;
+
+static struct worker* workers;
+
+static struct cov_build* builds;      /* All builds seen so far           */
+static pthread_mutex_t builds_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u64 conn_total, conn_live, client_drops, bad_streams;
+
+static volatile sig_atomic_t stop_soon;
+
+
+static u64 hash_bytes(const u8* p, u32 len) {
+
+  u64 h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+
+}
+
+
+static u64 get_cur_time_ms(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+}
+
+
+/* Find or create the build with the given id. */
+
+static struct cov_build* get_build(const u8* id, u16 id_len) {
+
+  struct cov_build* b;
+  u32 i;
+
+  pthread_mutex_lock(&builds_lock);
+
+  for (b = builds; b; b = b->next)
+    if (b->id_len == id_len && !memcmp(b->id, id, id_len)) break;
+
+  if (!b) {
+
+    b = ck_alloc(sizeof(struct cov_build));
+    memcpy(b->id, id, id_len);
+    b->id_len = id_len;
+
+    for (i = 0; i < SHARDS; i++) {
+      pthread_mutex_init(&b->shards[i].lock, NULL);
+      b->shards[i].size = 64;
+      b->shards[i].tab = ck_alloc(64 * sizeof(struct cov_file*));
+    }
+
+    b->next = builds;
+    builds = b;
+
+  }
+
+  pthread_mutex_unlock(&builds_lock);
+
+  return b;
+
+}
+
+
+/* Find or create the coverage record for a file name within a build. */
+
+static struct cov_file* get_file(struct cov_build* b, const u8* name, u32 len) {
+
+  u64 h = hash_bytes(name, len);
+  struct cov_shard* s = &b->shards[h % SHARDS];
+  struct cov_file* f;
+  u32 i;
+
+  pthread_mutex_lock(&s->lock);
+
+  for (i = (h / SHARDS) & (s->size - 1); (f = s->tab[i]); i = (i + 1) & (s->size - 1))
+    if (f->hash == h && !strncmp((char*)f->name, (char*)name, len) && !f->name[len]) break;
+
+  if (!f) {
+
+    f = ck_alloc(sizeof(struct cov_file));
+    f->name  = ck_memdup_str((u8*)name, len);
+    f->hash  = h;
+    f->pages = ck_alloc(PAGE_CNT * sizeof(u64*));
+
+    s->tab[i] = f;
+
+    if (++s->cnt * 2 > s->size) {
+
+      struct cov_file** old = s->tab;
+      u32 old_size = s->size, j;
+
+      s->size *= 2;
+      s->tab = ck_alloc(s->size * sizeof(struct cov_file*));
+
+      for (j = 0; j < old_size; j++) {
+        if (!old[j]) continue;
+        for (i = (old[j]->hash / SHARDS) & (s->size - 1); s->tab[i];
+             i = (i + 1) & (s->size - 1));
+        s->tab[i] = old[j];
+      }
+
+      ck_free(old);
+
+    }
+
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  return f;
+
+}
+
+
+/* Lock-free lookup. A block inserted concurrently may be missed, the
+   caller then takes the lock and finds it there. */
+
+static u8 ovf_find(struct ovf_set* o, u64 key) {
+
+  u32 i;
+  u64 v;
+
+  for (i = key % o->size; (v = __atomic_load_n(&o->keys[i], __ATOMIC_RELAXED));
+       i = (i + 1) % o->size)
+    if (v == key + 1) return 1;
+
+  return 0;
+
+}
+
+
+/* Add an entry to the overflow set of a file, shard lock must be held.
+   Replaced sets are not freed, since lookups may still be reading them;
+   together they never take more memory than the current one. */
+
+static void ovf_add(struct cov_file* f, u64 key) {
+
+  struct ovf_set* o = f->ovf;
+  u32 i;
+
+  if (!o || o->cnt * 2 >= o->size) {
+
+    u32 size = o ? o->size * 2 : 16, j;
+    struct ovf_set* n = ck_alloc(sizeof(struct ovf_set) + size * sizeof(u64));
+
+    n->size = size;
+
+    for (j = 0; o && j < o->size; j++) {
+      if (!o->keys[j]) continue;
+      for (i = o->keys[j] % size; n->keys[i]; i = (i + 1) % size);
+      n->keys[i] = o->keys[j];
+    }
+
+    n->cnt = o ? o->cnt : 0;
+    __atomic_store_n(&f->ovf, n, __ATOMIC_RELEASE);
+    o = n;
+
+  }
+
+  for (i = key % o->size; o->keys[i]; i = (i + 1) % o->size)
+    if (o->keys[i] == key + 1) return;
+
+  __atomic_store_n(&o->keys[i], key + 1, __ATOMIC_RELAXED);
+  o->cnt++;
+
+}
+
+
+static void mark_block(struct cov_build* b, struct cov_file* f, u32 line, u32 relblock) {
+
+  if (line < BM_LINES && relblock < (1 << REL_SHIFT)) {
+
+    u32 bit = (line << REL_SHIFT) | relblock;
+    u64** slot = &f->pages[bit / PAGE_BITS];
+    u64* page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    u64 mask = 1ULL << (bit % 64);
+
+    if (!page) {
+
+      u64* fresh = ck_alloc(PAGE_BITS / 8);
+
+      if (__atomic_compare_exchange_n(slot, &page, fresh, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        page = fresh;
+      else
+        ck_free(fresh);
+
+    }
+
+    page += (bit % PAGE_BITS) / 64;
+    if (!(__atomic_load_n(page, __ATOMIC_RELAXED) & mask))
+      __atomic_fetch_or(page, mask, __ATOMIC_RELAXED);
+
+  } else {
+
+    struct cov_shard* s = &b->shards[f->hash % SHARDS];
+    struct ovf_set* o = __atomic_load_n(&f->ovf, __ATOMIC_ACQUIRE);
+    u64 key = ((u64)line << 32) | relblock;
+
+    if (o && ovf_find(o, key)) return;
+
+    pthread_mutex_lock(&s->lock);
+    ovf_add(f, key);
+    pthread_mutex_unlock(&s->lock);
+
+  }
+
+}
+
+
+/* Process one complete frame. Returns 0 if the stream must be dropped. */
+
+static u8 handle_frame(struct worker* w, struct conn* c, u8 type, const u8* p, u32 len) {
+
+  u32 i;
+
+  if (type == LLCOV_FR_LZ) {
+
+    u32 raw, off = 0;
+
+    if (len < 4 || (raw = llcov_get_u32(p)) > LLCOV_MAX_FRAME) return 0;
+
+    if (!w->zbuf) w->zbuf = ck_alloc_nozero(LLCOV_MAX_FRAME);
+
+    if (llcov_lz_decompress(p + 4, len - 4, w->zbuf, raw) != (s32)raw) return 0;
+
+    /* Complete frames only, and no nesting */
+
+    while (off < raw) {
+
+      s64 flen = llcov_frame_len(w->zbuf + off, raw - off);
+
+      if (flen <= 0 || w->zbuf[off] == LLCOV_FR_LZ) return 0;
+
+      if (!handle_frame(w, c, w->zbuf[off], w->zbuf + off + LLCOV_FRAME_HDR_SIZE,
+                        flen - LLCOV_FRAME_HDR_SIZE)) return 0;
+
+      off += flen;
+
+    }
+
+    return 1;
+
+  }
+
+  if (type == LLCOV_FR_HELLO) {
+
+    u16 id_len;
+
+    if (len < 12 || llcov_get_u32(p) != LLCOV_PROTO_MAGIC) return 0;
+
+    id_len = llcov_get_u16(p + 6);
+    if (id_len > LLCOV_MAX_BUILD_ID || 12 + id_len > len) return 0;
+
+    c->pid   = llcov_get_u32(p + 8);
+    c->build = get_build(p + 12, id_len);
+    return 1;
+
+  }
+
+  /* Everything else needs to know which build it belongs to */
+
+  if (!c->build) return 0;
+
+  switch (type) {
+
+    case LLCOV_FR_STRING: {
+
+      u32 id;
+
+      if (len < 4) return 0;
+      id = llcov_get_u32(p);
+
+      /* Only this connection is dropped, not the whole daemon */
+
+      if (id >= LLCOV_MAX_STRING_ID) return 0;
+
+      if (id >= c->ids_alloc) {
+        u32 n = MAX(id + 1, c->ids_alloc * 2);
+        c->ids = ck_realloc(c->ids, n * sizeof(struct cov_file*));
+        c->ids_alloc = n;
+      }
+
+      c->ids[id] = get_file(c->build, p + 4, len - 4);
+      return 1;
+
+    }
+
+    case LLCOV_FR_BLOCKS:
+
+      if (len % LLCOV_REC_SIZE) return 0;
+
+      for (i = 0; i < len; i += LLCOV_REC_SIZE) {
+
+        u32 id = llcov_get_u32(p + i);
+
+        if (id >= c->ids_alloc || !c->ids[id]) return 0;
+
+        mark_block(c->build, c->ids[id], llcov_get_u32(p + i + 4),
+                   llcov_get_u32(p + i + 8));
+
+      }
+
+      __atomic_fetch_add(&w->recs, len / LLCOV_REC_SIZE, __ATOMIC_RELAXED);
+      return 1;
+
+    case LLCOV_FR_VBLOCKS: {
+
+      struct llcov_vstate st = { 0, 0 };
+      const u8* end = p + len;
+      u32 cnt = 0;
+
+      while (p < end) {
+
+        u32 id, line, relblock, n = llcov_get_vrec(p, end, &st, &id, &line, &relblock);
+
+        if (!n || id >= c->ids_alloc || !c->ids[id]) return 0;
+
+        mark_block(c->build, c->ids[id], line, relblock);
+        p += n;
+        cnt++;
+
+      }
+
+      __atomic_fetch_add(&w->recs, cnt, __ATOMIC_RELAXED);
+      return 1;
+
+    }
+
+    case LLCOV_FR_STATS:
+
+      /* The sender reports its cumulative drop count */
+
+      if (len >= 8 && llcov_get_u64(p) > c->drops) {
+        __atomic_fetch_add(&client_drops, llcov_get_u64(p) - c->drops, __ATOMIC_RELAXED);
+        c->drops = llcov_get_u64(p);
+      }
+
+      return 1;
+
+  }
+
+  /* Unknown frame types are skipped for forward compatibility */
+
+  return 1;
+
+}
+
+
+static void close_conn(struct conn* c) {
+
+  close(c->fd);
+  ck_free(c->buf);
+  ck_free(c->ids);
+  ck_free(c);
+
+  __atomic_fetch_sub(&conn_live, 1, __ATOMIC_RELAXED);
+
+}
+
+
+/* Read whatever is available and process all complete frames. Returns 0
+   once the connection is closed. */
+
+static u8 service_conn(struct worker* w, struct conn* c) {
+
+  for (;;) {
+
+    s64 r, flen;
+    u32 off = 0;
+
+    if (c->alloc - c->len < READ_CHUNK) {
+      c->alloc = MAX(c->alloc * 2, c->len + READ_CHUNK);
+      c->buf = ck_realloc(c->buf, c->alloc);
+    }
+
+    r = read(c->fd, c->buf + c->len, c->alloc - c->len);
+
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+      return 0;
+    }
+
+    if (!r) return 0;
+
+    c->len += r;
+
+    while ((flen = llcov_frame_len(c->buf + off, c->len - off)) > 0) {
+
+      if (!handle_frame(w, c, c->buf[off], c->buf + off + LLCOV_FRAME_HDR_SIZE,
+                        flen - LLCOV_FRAME_HDR_SIZE)) flen = -1;
+
+      if (flen < 0) break;
+      off += flen;
+
+    }
+
+    if (flen < 0) {
+      __atomic_fetch_add(&bad_streams, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+
+  }
+
+}
+
+
+static void* worker_main(void* arg) {
+
+  struct worker* w = arg;
+  struct epoll_event ev[MAX_EVENTS];
+
+  while (!stop_soon) {
+
+    s32 n = epoll_wait(w->efd, ev, MAX_EVENTS, 200), i;
+
+    for (i = 0; i < n; i++) {
+
+      struct conn* c = ev[i].data.ptr;
+
+      if (!service_conn(w, c)) close_conn(c);
+
+    }
+
+  }
+
+  return NULL;
+
+}
+
+
+/* Write all bits set for one file in the text record format. */
+
+static void dump_file(FILE* f, struct cov_file* cf) {
+
+  u32 i, j;
+
+  for (i = 0; i < PAGE_CNT; i++) {
+
+    u64* page = __atomic_load_n(&cf->pages[i], __ATOMIC_ACQUIRE);
+    if (!page) continue;
+
+    for (j = 0; j < PAGE_BITS / 64; j++) {
+
+      u64 v = __atomic_load_n(&page[j], __ATOMIC_RELAXED);
+
+      while (v) {
+        u32 bit = i * PAGE_BITS + j * 64 + __builtin_ctzll(v);
+        fprintf(f, "file:%s line:%u relblock:%u\n", cf->name,
+                bit >> REL_SHIFT, bit & ((1 << REL_SHIFT) - 1));
+        v &= v - 1;
+      }
+
+    }
+
+  }
+
+  for (i = 0; cf->ovf && i < cf->ovf->size; i++)
+    if (cf->ovf->keys[i])
+      fprintf(f, "file:%s line:%u relblock:%u\n", cf->name,
+              (u32)((cf->ovf->keys[i] - 1) >> 32), (u32)(cf->ovf->keys[i] - 1));
+
+}
+
+
+/* Write one snapshot file per build, replacing the previous one
+   atomically. */
+
+static void write_snapshots(void) {
+
+  struct cov_build* b;
+
+  pthread_mutex_lock(&builds_lock);
+  b = builds;
+  pthread_mutex_unlock(&builds_lock);
+
+  for (; b; b = b->next) {
+
+    u8 hex[LLCOV_MAX_BUILD_ID * 2 + 1];
+    u8 *fn, *tmp;
+    FILE* f;
+    u32 i, j;
+
+    for (i = 0; i < b->id_len; i++) sprintf((char*)hex + i * 2, "%02x", b->id[i]);
+    hex[b->id_len * 2] = 0;
+
+    fn  = alloc_printf("%s/%s.cov", out_dir, hex);
+    tmp = alloc_printf("%s.tmp", fn);
+
+    f = fopen((char*)tmp, "w");
+    if (!f) PFATAL("Unable to create '%s'", tmp);
+
+    for (i = 0; i < SHARDS; i++) {
+
+      struct cov_shard* s = &b->shards[i];
+
+      /* The lock keeps the table stable, page bits are read atomically */
+
+      pthread_mutex_lock(&s->lock);
+
+      for (j = 0; j < s->size; j++)
+        if (s->tab[j]) dump_file(f, s->tab[j]);
+
+      pthread_mutex_unlock(&s->lock);
+
+    }
+
+    if (fclose(f) || rename((char*)tmp, (char*)fn))
+      PFATAL("Unable to write '%s'", fn);
+
+    ck_free(fn);
+    ck_free(tmp);
+
+  }
+
+}
+
+
+/* Create a non-blocking listening socket. */
+
+static s32 listen_tcp(u8* spec) {
+
+  struct addrinfo hints, *res;
+  u8 *host = NULL, *port = spec, *colon = (u8*)strrchr((char*)spec, ':');
+  s32 fd, one = 1;
+
+  if (colon) {
+    host = ck_memdup_str(spec, colon - spec);
+    port = colon + 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags    = AI_PASSIVE;
+
+  if (getaddrinfo(host && *host ? (char*)host : NULL, (char*)port, &hints, &res))
+    FATAL("Unable to resolve '%s'", spec);
+
+  fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) PFATAL("socket() failed");
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 1024))
+    PFATAL("Unable to listen on '%s'", spec);
+
+  freeaddrinfo(res);
+  ck_free(host);
+
+  return fd;
+
+}
+
+
+static s32 listen_unix(u8* path) {
+
+  struct sockaddr_un sun;
+  s32 fd;
+
+  if (strlen((char*)path) >= sizeof(sun.sun_path)) FATAL("Socket path too long");
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, (char*)path);
+
+  unlink((char*)path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) PFATAL("socket() failed");
+
+  if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) || listen(fd, 1024))
+    PFATAL("Unable to listen on '%s'", path);
+
+  return fd;
+
+}
+
+
+static void handle_stop_sig(int sig) {
+
+  stop_soon = 1;
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] -o dir\n\n"
+
+       "Required parameters:\n\n"
+
+       "  -o dir        - directory for coverage snapshots\n\n"
+
+       "Listening sockets (default: TCP port %u):\n\n"
+
+       "  -l [host:]port - accept TCP connections\n"
+       "  -u path        - accept Unix domain connections\n\n"
+
+       "Other settings:\n\n"
+
+       "  -t secs       - snapshot interval (default: %u)\n"
+       "  -j n          - number of worker threads (default: CPU count)\n\n",
+
+       argv0, LLCOV_NET_PORT, snap_secs);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt, efd, lfd[16];
+  u32 lfd_cnt = 0, next_worker = 0, i;
+  u64 last_snap, last_stat, last_recs = 0;
+  struct sigaction sa;
+
+  SAYF(cCYA "llcov-collectd " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+o:l:u:t:j:")) > 0)
+
+    switch (opt) {
+
+      case 'o': out_dir = (u8*)optarg; break;
+
+      case 'l':
+        if (lfd_cnt == 16) FATAL("Too many listening sockets");
+        lfd[lfd_cnt++] = listen_tcp((u8*)optarg);
+        break;
+
+      case 'u':
+        if (lfd_cnt == 16) FATAL("Too many listening sockets");
+        lfd[lfd_cnt++] = listen_unix((u8*)optarg);
+        break;
+
+      case 't':
+        snap_secs = atoi(optarg);
+        if (!snap_secs) FATAL("Bad snapshot interval");
+        break;
+
+      case 'j':
+        worker_cnt = atoi(optarg);
+        if (!worker_cnt) FATAL("Bad worker count");
+        break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (!out_dir || optind != argc) usage((u8*)argv[0]);
+
+  if (mkdir((char*)out_dir, 0755) && errno != EEXIST)
+    PFATAL("Unable to create '%s'", out_dir);
+
+  if (!lfd_cnt) lfd[lfd_cnt++] = listen_tcp((u8*)STRINGIFY(LLCOV_NET_PORT));
+
+  if (!worker_cnt) {
+    s32 n = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_cnt = n > 0 ? n : 1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop_sig;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  workers = ck_alloc(worker_cnt * sizeof(struct worker));
+
+  for (i = 0; i < worker_cnt; i++) {
+
+    workers[i].efd = epoll_create1(EPOLL_CLOEXEC);
+    if (workers[i].efd < 0) PFATAL("epoll_create1() failed");
+
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+      FATAL("Unable to start worker thread");
+
+  }
+
+  /* The main thread accepts connections and hands them to the workers */
+
+  efd = epoll_create1(EPOLL_CLOEXEC);
+  if (efd < 0) PFATAL("epoll_create1() failed");
+
+  for (i = 0; i < lfd_cnt; i++) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = lfd[i] };
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, lfd[i], &ev)) PFATAL("epoll_ctl() failed");
+  }
+
+  OKF("Listening with %u workers, writing snapshots to '%s'.", worker_cnt, out_dir);
+
+  last_snap = last_stat = get_cur_time_ms();
+
+  while (!stop_soon) {
+
+    struct epoll_event ev[16];
+    s32 n = epoll_wait(efd, ev, 16, 1000), j;
+    u64 now;
+
+    for (j = 0; j < n; j++) {
+
+      s32 fd;
+
+      while ((fd = accept4(ev[j].data.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+
+        struct conn* c = ck_alloc(sizeof(struct conn));
+        struct worker* w = &workers[next_worker++ % worker_cnt];
+        struct epoll_event cev;
+
+        c->fd = fd;
+
+        cev.events = EPOLLIN | EPOLLRDHUP;
+        cev.data.ptr = c;
+
+        conn_total++;
+        __atomic_fetch_add(&conn_live, 1, __ATOMIC_RELAXED);
+
+        if (epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &cev)) PFATAL("epoll_ctl() failed");
+
+      }
+
+    }
+
+    now = get_cur_time_ms();
+
+    if (now - last_stat >= 10000) {
+
+      u64 recs = 0;
+
+      for (i = 0; i < worker_cnt; i++)
+        recs += __atomic_load_n(&workers[i].recs, __ATOMIC_RELAXED);
+
+      ACTF("%llu records (%llu/s), %llu live / %llu total connections, "
+           "%llu client drops, %llu bad streams", recs,
+           (recs - last_recs) * 1000 / (now - last_stat),
+           __atomic_load_n(&conn_live, __ATOMIC_RELAXED), conn_total,
+           __atomic_load_n(&client_drops, __ATOMIC_RELAXED),
+           __atomic_load_n(&bad_streams, __ATOMIC_RELAXED));
+
+      last_recs = recs;
+      last_stat = now;
+
+    }
+
+    if (now - last_snap >= snap_secs * 1000ULL) {
+      write_snapshots();
+      last_snap = now;
+    }
+
+  }
+
+  for (i = 0; i < worker_cnt; i++) pthread_join(workers[i].thread, NULL);
+
+  write_snapshots();
+
+  {
+    u64 recs = 0;
+    for (i = 0; i < worker_cnt; i++) recs += workers[i].recs;
+    OKF("Final snapshot written, %llu records from %llu connections merged.",
+        recs, conn_total);
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,81 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Crash flush hook shared by the runtimes that hold coverage back.
+
+  rt_crash_init() installs a handler for the fatal signals (on an
+  alternate stack, so stack overflows are covered too) and the sanitizer
+  death callback. Both call the runtime's flush function once, then the
+  signal goes on to whatever handler was installed before. The flush runs
+  in a signal handler and has to be async-signal-safe.
+ */
+
+#ifndef _HAVE_LLCOV_CRASH_INL_H
+#define _HAVE_LLCOV_CRASH_INL_H
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "types.h"
+
+extern "C" void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+static const int rt_crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTRAP };
+
+static struct sigaction rt_crash_old[sizeof(rt_crash_signals) / sizeof(int)];
+static void (*rt_crash_flush_fn)();
+
+static void rt_crash_handler(int sig, siginfo_t* info, void* ctx) {
+    int saved = errno;
+
+    rt_crash_flush_fn();
+
+    for (u32 i = 0; i < sizeof(rt_crash_signals) / sizeof(int); i++) {
+        if (rt_crash_signals[i] != sig) continue;
+
+        struct sigaction* old = &rt_crash_old[i];
+        sigaction(sig, old, NULL);
+
+        if (old->sa_flags & SA_SIGINFO) {
+            old->sa_sigaction(sig, info, ctx);
+        } else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+            old->sa_handler(sig);
+        } else if (info->si_code <= 0) {
+            /* Sent by kill(), raise() or abort(): goes off with the default
+               action as soon as we return. Faults simply happen again. */
+            raise(sig);
+        }
+        break;
+    }
+
+    errno = saved;
+}
+
+static void rt_crash_init(void (*flush)()) {
+    static const size_t stack_size = 65536;
+    stack_t ss;
+
+    rt_crash_flush_fn = flush;
+
+    /* Stack overflows in the initializing thread still get flushed */
+    ss.ss_sp = mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ss.ss_size = stack_size;
+    ss.ss_flags = 0;
+    if (ss.ss_sp != MAP_FAILED) sigaltstack(&ss, NULL);
+
+    for (u32 i = 0; i < sizeof(rt_crash_signals) / sizeof(int); i++) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = rt_crash_handler;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        sigaction(rt_crash_signals[i], &sa, &rt_crash_old[i]);
+    }
+
+    if (__sanitizer_set_death_callback) __sanitizer_set_death_callback(flush);
+}
+
+#endif /* ! _HAVE_LLCOV_CRASH_INL_H */
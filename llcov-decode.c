@@ -0,0 +1,283 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Converts binary coverage streams (LLCOV_FORMAT=binary, or a captured
+  network stream) back into the text format:
+
+    file:<name> line:<line> relblock:<relblock>
+
+  Compressed streams (LLCOV_COMPRESS) are handled transparently. Input that
+  is not a binary stream is copied through unchanged, so this can be run
+  on any LLCov output.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-proto.h"
+#include "llcov-lz.h"
+
+static u8** names;                    /* String table, by id              */
+static u32  names_alloc;
+
+static u64 total_recs, total_hellos;
+
+static u8* zbuf;                      /* Scratch for LZ frames            */
+
+static FILE* out_file;
+
+
+/* Forget all strings, ids are only valid until the next HELLO. */
+
+static void reset_names(void) {
+
+  u32 i;
+
+  for (i = 0; i < names_alloc; i++) {
+    ck_free(names[i]);
+    names[i] = NULL;
+  }
+
+}
+
+
+static void set_name(u32 id, const u8* p, u32 len) {
+
+  if (id >= names_alloc) {
+
+    u32 n = MAX(id + 1, names_alloc * 2);
+
+    names = ck_realloc(names, n * sizeof(u8*));
+    names_alloc = n;
+
+  }
+
+  ck_free(names[id]);
+  names[id] = ck_alloc(len + 1);
+  memcpy(names[id], p, len);
+
+}
+
+
+static void emit(const u8* fn, u32 id, u32 line, u32 relblock) {
+
+  if (id >= names_alloc || !names[id])
+    FATAL("Record for unknown string id %u in '%s'", id, fn);
+
+  fprintf(out_file, "file:%s line:%u relblock:%u\n", names[id], line, relblock);
+  total_recs++;
+
+}
+
+
+static void handle_frame(const u8* fn, u8 type, const u8* p, u32 len) {
+
+  const u8* end = p + len;
+
+  switch (type) {
+
+    case LLCOV_FR_HELLO:
+
+      if (len < 12 || llcov_get_u32(p) != LLCOV_PROTO_MAGIC)
+        FATAL("Bad HELLO frame in '%s'", fn);
+
+      reset_names();
+      total_hellos++;
+      break;
+
+    case LLCOV_FR_STRING:
+
+      if (len < 4 || llcov_get_u32(p) >= LLCOV_MAX_STRING_ID)
+        FATAL("Bad STRING frame in '%s'", fn);
+      set_name(llcov_get_u32(p), p + 4, len - 4);
+      break;
+
+    case LLCOV_FR_BLOCKS:
+
+      if (len % LLCOV_REC_SIZE) FATAL("Bad BLOCKS frame in '%s'", fn);
+
+      for (; p < end; p += LLCOV_REC_SIZE)
+        emit(fn, llcov_get_u32(p), llcov_get_u32(p + 4), llcov_get_u32(p + 8));
+
+      break;
+
+    case LLCOV_FR_VBLOCKS: {
+
+      struct llcov_vstate st = { 0, 0 };
+
+      while (p < end) {
+
+        u32 id, line, relblock, n = llcov_get_vrec(p, end, &st, &id, &line, &relblock);
+
+        if (!n) FATAL("Bad VBLOCKS frame in '%s'", fn);
+
+        emit(fn, id, line, relblock);
+        p += n;
+
+      }
+
+      break;
+
+    }
+
+    case LLCOV_FR_LZ: {
+
+      u32 raw, off = 0;
+
+      if (len < 4 || (raw = llcov_get_u32(p)) > LLCOV_MAX_FRAME)
+        FATAL("Bad LZ frame in '%s'", fn);
+
+      if (!zbuf) zbuf = ck_alloc_nozero(LLCOV_MAX_FRAME);
+
+      if (llcov_lz_decompress(p + 4, len - 4, zbuf, raw) != (s32)raw)
+        FATAL("Corrupt LZ frame in '%s'", fn);
+
+      while (off < raw) {
+
+        s64 flen = llcov_frame_len(zbuf + off, raw - off);
+
+        if (flen <= 0 || zbuf[off] == LLCOV_FR_LZ)
+          FATAL("Bad frame inside LZ frame in '%s'", fn);
+
+        handle_frame(fn, zbuf[off], zbuf + off + LLCOV_FRAME_HDR_SIZE,
+                     flen - LLCOV_FRAME_HDR_SIZE);
+        off += flen;
+
+      }
+
+      break;
+
+    }
+
+    /* STATS and unknown frames carry no coverage */
+
+  }
+
+}
+
+
+/* Decode one input. Binary streams start with a HELLO or LZ frame. */
+
+static void decode_fd(const u8* fn, s32 fd) {
+
+  u32 alloc = LLCOV_MAX_FRAME + LLCOV_FRAME_HDR_SIZE + 65536;
+  u8* buf = ck_alloc_nozero(alloc);
+  u32 len = 0, off = 0;
+  u8 binary = 2;
+
+  for (;;) {
+
+    s32 r = read(fd, buf + len, alloc - len);
+
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      PFATAL("Unable to read '%s'", fn);
+    }
+
+    if (!r) break;
+    len += r;
+
+    if (binary == 2) binary = buf[0] == LLCOV_FR_HELLO || buf[0] == LLCOV_FR_LZ;
+
+    if (!binary) {
+      if (fwrite(buf, 1, len, out_file) != len) PFATAL("Short write");
+      len = 0;
+      continue;
+    }
+
+    for (;;) {
+
+      s64 flen = llcov_frame_len(buf + off, len - off);
+
+      if (flen < 0) FATAL("Broken stream in '%s' at offset %u", fn, off);
+      if (!flen) break;
+
+      handle_frame(fn, buf[off], buf + off + LLCOV_FRAME_HDR_SIZE,
+                   flen - LLCOV_FRAME_HDR_SIZE);
+      off += flen;
+
+    }
+
+    /* Keep the incomplete tail */
+
+    memmove(buf, buf + off, len - off);
+    len -= off;
+    off = 0;
+
+  }
+
+  if (binary == 1 && len) WARNF("Truncated frame at the end of '%s'", fn);
+
+  ck_free(buf);
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] [ file ... ]\n\n"
+
+       "Reads standard input if no files are given.\n\n"
+
+       "Options:\n\n"
+
+       "  -o file       - write to file instead of standard output\n\n", argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt, i;
+
+  SAYF(cCYA "llcov-decode " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  out_file = stdout;
+
+  while ((opt = getopt(argc, argv, "+o:")) > 0)
+
+    switch (opt) {
+
+      case 'o':
+        out_file = fopen(optarg, "w");
+        if (!out_file) PFATAL("Unable to create '%s'", optarg);
+        break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind == argc) decode_fd((u8*)"<stdin>", 0);
+
+  for (i = optind; i < argc; i++) {
+
+    s32 fd = open(argv[i], O_RDONLY);
+
+    if (fd < 0) PFATAL("Unable to open '%s'", argv[i]);
+    decode_fd((u8*)argv[i], fd);
+    close(fd);
+
+  }
+
+  if (fclose(out_file)) PFATAL("Unable to write output");
+
+  OKF("Decoded %llu records from %llu binary chunks.", total_recs, total_hellos);
+
+  return 0;
+
+}
@@ -0,0 +1,480 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Turns a unified diff into an LLCOV_WHITELIST that covers exactly the
+  lines the patch adds or changes, so that a build instruments nothing
+  but the patch.
+
+  Consecutive lines are coalesced into line:<first>-<last> ranges. With
+  an instrumentation manifest (LLCOV_LOGINSTFILE from a previous build),
+  functions that the patch mostly rewrites are listed as a whole instead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-path.h"
+
+struct dfile {
+  u8*  name;
+  u32* lines;                         /* Changed lines, new-file numbers  */
+  u32  cnt, alloc;
+  struct dfile* next;
+};
+
+struct mfunc {
+  u8*  file;
+  u8*  name;
+  u32* lines;                         /* Instrumented lines               */
+  u32  cnt, alloc;
+  struct mfunc* next;
+};
+
+static struct dfile *files, *files_tail;
+static struct mfunc* funcs;
+
+static u32 strip = 1;                 /* Path components to strip (-p)    */
+static u32 widen_pct;                 /* Widen to functions (-w), 0 = off */
+static u32 max_gap;                   /* Merge ranges this close (-g)     */
+static u8  no_ranges;                 /* One entry per line (-L)          */
+static u8  deletions = 1;             /* Mark lines next to deletions     */
+
+static u64 total_lines, total_entries;
+
+
+static void add_line(u32** lines, u32* cnt, u32* alloc, u32 line) {
+
+  if (*cnt && (*lines)[*cnt - 1] == line) return;
+
+  if (*cnt == *alloc) {
+    *alloc = MAX(*alloc * 2, 64);
+    *lines = ck_realloc(*lines, *alloc * sizeof(u32));
+  }
+
+  (*lines)[(*cnt)++] = line;
+
+}
+
+
+static int cmp_u32(const void* a, const void* b) {
+
+  u32 x = *(u32*)a, y = *(u32*)b;
+
+  return x < y ? -1 : x > y;
+
+}
+
+
+static void sort_uniq(u32* lines, u32* cnt) {
+
+  u32 i, n = 0;
+
+  qsort(lines, *cnt, sizeof(u32), cmp_u32);
+
+  for (i = 0; i < *cnt; i++)
+    if (!n || lines[n - 1] != lines[i]) lines[n++] = lines[i];
+
+  *cnt = n;
+
+}
+
+
+/* Git puts names with unusual characters (anything non-ASCII, by default)
+   in double quotes with C escapes: "b/\303\251t\303\251.c". Decodes such a
+   name in place, leaves anything else alone. */
+
+static void unquote_path(u8* path) {
+
+  u8 *in = path + 1, *out = path;
+
+  if (*path != '"') return;
+
+  while (*in && *in != '"') {
+
+    if (*in != '\\' || !in[1]) {
+      *out++ = *in++;
+      continue;
+    }
+
+    in++;
+
+    if (*in >= '0' && *in <= '7') {
+
+      u32 v = 0, n;
+
+      for (n = 0; n < 3 && *in >= '0' && *in <= '7'; n++)
+        v = v * 8 + *in++ - '0';
+
+      *out++ = v;
+      continue;
+
+    }
+
+    switch (*in) {
+      case 'a': *out++ = '\a'; break;
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 'v': *out++ = '\v'; break;
+      default:  *out++ = *in;
+    }
+
+    in++;
+
+  }
+
+  *out = 0;
+
+}
+
+
+/* "+++ b/dir/file.c\t<timestamp>" -> "dir/file.c", or NULL for /dev/null */
+
+static struct dfile* new_file(u8* path) {
+
+  struct dfile* f;
+  u8* tab = (u8*)strchr((char*)path, '\t');
+  u32 i;
+
+  if (tab) *tab = 0;
+  unquote_path(path);
+  if (!strcmp((char*)path, "/dev/null")) return NULL;
+
+  for (i = 0; i < strip; i++) {
+    u8* sl = (u8*)strchr((char*)path, '/');
+    if (!sl) break;
+    path = sl + 1;
+  }
+
+  for (f = files; f; f = f->next)
+    if (!strcmp((char*)f->name, (char*)path)) return f;
+
+  f = ck_alloc(sizeof(struct dfile));
+  f->name = (u8*)ck_strdup(path);
+
+  if (files_tail) files_tail->next = f;
+  else files = f;
+  files_tail = f;
+
+  return f;
+
+}
+
+
+static void read_diff(FILE* in) {
+
+  struct dfile* cur = NULL;
+  char* buf = NULL;
+  size_t alloc = 0;
+  u32 line = 0, old_left = 0, new_left = 0;
+
+  while (getline(&buf, &alloc, in) > 0) {
+
+    /* Inside a hunk, the counts say what is what */
+
+    if (old_left || new_left) {
+
+      switch (buf[0]) {
+
+        case '+':
+          if (cur) add_line(&cur->lines, &cur->cnt, &cur->alloc, line);
+          line++;
+          new_left--;
+          break;
+
+        case '-':
+
+          /* A pure deletion changes the code around it; mark the line
+             that now follows the deleted ones. */
+
+          if (cur && deletions) add_line(&cur->lines, &cur->cnt, &cur->alloc, line);
+          old_left--;
+          break;
+
+        case '\\':                    /* "\ No newline at end of file"    */
+          break;
+
+        default:
+          line++;
+          if (old_left) old_left--;
+          if (new_left) new_left--;
+
+      }
+
+      continue;
+
+    }
+
+    if (!strncmp(buf, "+++ ", 4)) {
+
+      u8* nl = (u8*)strchr(buf, '\n');
+
+      if (nl) *nl = 0;
+      cur = new_file((u8*)buf + 4);
+
+    } else if (!strncmp(buf, "@@ -", 4)) {
+
+      u32 old_cnt = 1, new_start, new_cnt = 1;
+      char* p = buf + 4;
+
+      strtoul(p, &p, 10);
+      if (*p == ',') old_cnt = strtoul(p + 1, &p, 10);
+      if (strncmp(p, " +", 2)) FATAL("Malformed hunk header: %s", buf);
+      new_start = strtoul(p + 2, &p, 10);
+      if (*p == ',') new_cnt = strtoul(p + 1, &p, 10);
+
+      line     = new_start;
+      old_left = old_cnt;
+      new_left = new_cnt;
+
+    }
+
+  }
+
+  free(buf);
+
+}
+
+
+static struct mfunc* get_func(u8* file, u8* name) {
+
+  struct mfunc* f;
+
+  for (f = funcs; f; f = f->next)
+    if (!strcmp((char*)f->name, (char*)name) && !strcmp((char*)f->file, (char*)file))
+      return f;
+
+  f = ck_alloc(sizeof(struct mfunc));
+  f->file = (u8*)ck_strdup(file);
+  f->name = (u8*)ck_strdup(name);
+  f->next = funcs;
+  funcs = f;
+
+  return f;
+
+}
+
+
+/* Only manifest entries for files touched by the diff are kept. */
+
+static void read_manifest(u8* fn) {
+
+  FILE* in = fopen((char*)fn, "r");
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!in) PFATAL("Unable to open '%s'", fn);
+
+  while ((len = getline(&buf, &alloc, in)) > 0) {
+
+    u8 *func, *ln, *file = (u8*)buf + 5;
+    struct dfile* d;
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+    if (strncmp(buf, "file:", 5)) continue;
+
+    ln   = (u8*)strstr(buf, " line:");
+    func = (u8*)strstr(buf, " func:");
+    if (!ln || !func || func > ln) continue;
+
+    *func = 0;
+    func += 6;
+    *(u8*)strchr((char*)func, ' ') = 0;
+
+    for (d = files; d; d = d->next)
+      if (llcov_suffix_match(file, d->name)) break;
+
+    if (!d) continue;
+
+    {
+      struct mfunc* f = get_func(d->name, func);
+      add_line(&f->lines, &f->cnt, &f->alloc, atoi((char*)ln + 6));
+    }
+
+  }
+
+  free(buf);
+  fclose(in);
+
+}
+
+
+static void emit_lines(FILE* out, struct dfile* f) {
+
+  u32 i = 0, n = 0;
+
+  /* Drop what widen() covered already */
+
+  for (i = 0; i < f->cnt; i++)
+    if (f->lines[i]) f->lines[n++] = f->lines[i];
+
+  f->cnt = n;
+  i = 0;
+
+  while (i < f->cnt) {
+
+    u32 first = f->lines[i], last = first;
+
+    if (no_ranges) {
+
+      fprintf(out, "file:%s line:%u\n", f->name, first);
+      total_entries++;
+      i++;
+      continue;
+
+    }
+
+    for (i++; i < f->cnt && f->lines[i] <= last + 1 + max_gap; i++)
+      last = f->lines[i];
+
+    if (first == last) fprintf(out, "file:%s line:%u\n", f->name, first);
+    else fprintf(out, "file:%s line:%u-%u\n", f->name, first, last);
+
+    total_entries++;
+
+  }
+
+}
+
+
+/* Emits whole functions for which at least widen_pct percent of their
+   instrumented lines changed, and drops the changed lines inside them. */
+
+static void widen(FILE* out, struct dfile* d) {
+
+  struct mfunc* f;
+  u32 i, j;
+
+  for (f = funcs; f; f = f->next) {
+
+    u32 hit = 0;
+
+    if (strcmp((char*)f->file, (char*)d->name)) continue;
+
+    sort_uniq(f->lines, &f->cnt);
+
+    for (i = 0, j = 0; i < f->cnt && j < d->cnt; ) {
+      if (f->lines[i] == d->lines[j]) { hit++; i++; j++; }
+      else if (f->lines[i] < d->lines[j]) i++;
+      else j++;
+    }
+
+    if (!hit || hit * 100 < widen_pct * f->cnt) continue;
+
+    fprintf(out, "file:%s func:%s\n", d->name, f->name);
+    total_entries++;
+
+    /* Line 0 never appears in a diff, use it to mark dropped lines */
+
+    for (j = 0; j < d->cnt; j++)
+      if (d->lines[j] >= f->lines[0] && d->lines[j] <= f->lines[f->cnt - 1])
+        d->lines[j] = 0;
+
+  }
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] [ patch ]\n\n"
+
+       "Reads the unified diff from standard input if no file is given.\n\n"
+
+       "Options:\n\n"
+
+       "  -o file       - write the whitelist to file (default: stdout)\n"
+       "  -p n          - strip n leading path components (default: 1)\n"
+       "  -g n          - merge ranges at most n lines apart (default: 0)\n"
+       "  -L            - no line ranges, one entry per line\n"
+       "  -D            - ignore pure deletions\n"
+       "  -m manifest   - instrumentation manifest (LLCOV_LOGINSTFILE)\n"
+       "  -w pct        - with -m, list functions as a whole once pct\n"
+       "                  percent of their lines changed\n\n", argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  u8 *out_fn = NULL, *manifest = NULL;
+  struct dfile* f;
+  FILE* out;
+  s32 opt;
+
+  SAYF(cCYA "llcov-difflist " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+o:p:g:LDm:w:")) > 0)
+
+    switch (opt) {
+
+      case 'o': out_fn = (u8*)optarg; break;
+      case 'p': strip = atoi(optarg); break;
+      case 'g': max_gap = atoi(optarg); break;
+      case 'L': no_ranges = 1; break;
+      case 'D': deletions = 0; break;
+      case 'm': manifest = (u8*)optarg; break;
+      case 'w': widen_pct = atoi(optarg); break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind < argc - 1) usage((u8*)argv[0]);
+  if (widen_pct && !manifest) FATAL("-w requires a manifest (-m)");
+  if (manifest && !widen_pct) widen_pct = 50;
+
+  if (optind == argc) read_diff(stdin);
+  else {
+
+    FILE* in = fopen(argv[optind], "r");
+
+    if (!in) PFATAL("Unable to open '%s'", argv[optind]);
+    read_diff(in);
+    fclose(in);
+
+  }
+
+  if (manifest) read_manifest(manifest);
+
+  if (out_fn) {
+    out = fopen((char*)out_fn, "w");
+    if (!out) PFATAL("Unable to create '%s'", out_fn);
+  } else out = stdout;
+
+  for (f = files; f; f = f->next) {
+
+    sort_uniq(f->lines, &f->cnt);
+    total_lines += f->cnt;
+
+    if (manifest) widen(out, f);
+    emit_lines(out, f);
+
+  }
+
+  if (fclose(out)) PFATAL("Unable to write output");
+
+  if (!total_entries) WARNF("The diff does not add or change any lines");
+
+  OKF("Wrote %llu entries for %llu changed lines.", total_entries, total_lines);
+
+  return 0;
+
+}
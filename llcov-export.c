@@ -0,0 +1,692 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Converts LLCov coverage into lcov tracefiles (.info) or Cobertura XML.
+
+  LLCov output only lists the blocks that ran. The blocks that did not run
+  come from the instrumentation manifest the compiler pass writes when
+  LLCOV_LOGINSTFILE is set; without it, only covered lines are reported.
+
+  Memory use does not depend on the input size: records are first
+  partitioned by source directory into temporary bucket files, then each
+  bucket is sorted and converted on its own, one file at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+#define MAX_BUCKETS  512              /* Stays well below the fd limit    */
+
+struct rec {
+  u8* file;
+  u8* func;                           /* NULL for coverage records        */
+  u32 dir_len;                        /* Length of the directory part     */
+  u32 line;
+  u8  hit;
+};
+
+struct func {
+  u8* name;
+  u32 line;                           /* First line of the function       */
+  u32 first, cnt;                     /* Range in the sorted entry array  */
+  u8  hit;
+};
+
+struct fentry {
+  u8* name;
+  u32 line;
+  u8  hit;
+  u8  dup;                            /* Same line listed again           */
+};
+
+static u8  cobertura;                 /* Output format                    */
+static u32 bucket_cnt = 1;
+static FILE** buckets;
+
+static u8* tmp_dir;
+
+static u64 total_valid, total_hit, total_recs, total_bad;
+
+/* Per-file scratch, reused */
+
+static struct fentry* fents;
+static struct func* funcs;
+static u32 fents_alloc, funcs_alloc;
+
+
+/* Splits "file:<name> [func:<f>] line:<n> [relblock:<n>]" in place.
+   Fields are taken from the end, so file names may contain spaces. */
+
+static u8 parse_rec(u8* s, u8** file, u8** func, u32* line) {
+
+  u8* sp;
+  u8 have_line = 0;
+
+  *func = NULL;
+
+  if (strncmp((char*)s, "file:", 5)) return 0;
+
+  while ((sp = (u8*)strrchr((char*)s + 5, ' '))) {
+
+    if (!strncmp((char*)sp + 1, "line:", 5)) {
+
+      *line = atoi((char*)sp + 6);
+      have_line = 1;
+
+    } else if (!strncmp((char*)sp + 1, "func:", 5)) {
+
+      *func = sp + 6;
+
+    } else if (strncmp((char*)sp + 1, "relblock:", 9) &&
+               strncmp((char*)sp + 1, "id:", 3)) break;
+
+    *sp = 0;
+
+  }
+
+  *file = s + 5;
+
+  return have_line && **file;
+
+}
+
+
+static u32 dir_len(const u8* file) {
+
+  u8* sl = (u8*)strrchr((char*)file, '/');
+
+  return sl ? sl - file : 0;
+
+}
+
+
+static u32 bucket_of(const u8* file) {
+
+  u32 len = dir_len(file), h = 2166136261U;
+
+  while (len--) h = (h ^ *file++) * 16777619U;
+  return h % bucket_cnt;
+
+}
+
+
+/* Pass 1: read one input and scatter its records into the buckets. */
+
+static void scatter(u8* fn, u8 manifest) {
+
+  FILE* f = strcmp((char*)fn, "-") ? fopen((char*)fn, "r") : stdin;
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!f) PFATAL("Unable to open '%s'", fn);
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    u8 *file, *func;
+    u32 line;
+
+    if (buf[len - 1] == '\n') buf[--len] = 0;
+
+    /* The manifest may also contain LLCOV_LOGINSTDEBUG output */
+
+    if (!parse_rec((u8*)buf, &file, &func, &line)) {
+      if (!manifest) total_bad++;
+      continue;
+    }
+
+    fprintf(buckets[bucket_of(file)], "%c\t%u\t%s\t%s\n", manifest ? 'M' : 'H',
+            line, file, (manifest && func) ? (char*)func : "");
+    total_recs++;
+
+  }
+
+  free(buf);
+  if (f != stdin) fclose(f);
+
+}
+
+
+static int cmp_rec(const void* a, const void* b) {
+
+  const struct rec *x = a, *y = b;
+  s32 r;
+
+  r = memcmp(x->file, y->file, MIN(x->dir_len, y->dir_len));
+  if (r) return r;
+  if (x->dir_len != y->dir_len) return x->dir_len < y->dir_len ? -1 : 1;
+
+  r = strcmp((char*)x->file, (char*)y->file);
+  if (r) return r;
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+
+  return (s32)y->hit - (s32)x->hit;
+
+}
+
+
+static int cmp_fent(const void* a, const void* b) {
+
+  const struct fentry *x = a, *y = b;
+  s32 r = strcmp((char*)x->name, (char*)y->name);
+
+  if (r) return r;
+  return x->line < y->line ? -1 : x->line > y->line;
+
+}
+
+
+static int cmp_func(const void* a, const void* b) {
+
+  const struct func *x = a, *y = b;
+
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+  return strcmp((char*)x->name, (char*)y->name);
+
+}
+
+
+static void xml_str(FILE* f, const u8* s) {
+
+  for (; *s; s++)
+
+    switch (*s) {
+      case '&':  fputs("&amp;", f); break;
+      case '<':  fputs("&lt;", f); break;
+      case '>':  fputs("&gt;", f); break;
+      case '"':  fputs("&quot;", f); break;
+      case '\'': fputs("&apos;", f); break;
+      default:   fputc(*s, f);
+    }
+
+}
+
+
+static double rate(u32 hit, u32 valid) {
+
+  return valid ? (double)hit / valid : 1.0;
+
+}
+
+
+/* Line stats of one file, records [0, n) all belong to it. */
+
+static void file_stats(struct rec* r, u32 n, u32* valid, u32* hit) {
+
+  u32 i;
+
+  *valid = *hit = 0;
+
+  for (i = 0; i < n; i++) {
+
+    if (i && r[i].line == r[i - 1].line) continue;
+
+    (*valid)++;
+
+    /* Hits sort first within a line */
+    if (r[i].hit) (*hit)++;
+
+  }
+
+}
+
+
+/* Groups the manifest entries of a file by function name. */
+
+static u32 collect_funcs(struct rec* r, u32 n) {
+
+  u32 i, fe = 0, fc = 0;
+  u8 line_hit = 0;
+
+  for (i = 0; i < n; i++) {
+
+    if (!i || r[i].line != r[i - 1].line) line_hit = r[i].hit;
+    if (!r[i].func || !*r[i].func) continue;
+
+    if (fe == fents_alloc) {
+      fents_alloc = MAX(fents_alloc * 2, 256);
+      fents = ck_realloc(fents, fents_alloc * sizeof(struct fentry));
+    }
+
+    fents[fe].name = r[i].func;
+    fents[fe].line = r[i].line;
+    fents[fe].hit  = line_hit;
+    fents[fe].dup  = 0;
+    fe++;
+
+  }
+
+  qsort(fents, fe, sizeof(struct fentry), cmp_fent);
+
+  for (i = 0; i < fe; i++) {
+
+    if (i && !strcmp((char*)fents[i].name, (char*)fents[i - 1].name)) {
+
+      /* Same line listed twice, e.g. from two translation units */
+      if (fents[i].line != fents[i - 1].line) funcs[fc - 1].cnt++;
+      else fents[i].dup = 1;
+
+      funcs[fc - 1].hit |= fents[i].hit;
+      continue;
+
+    }
+
+    if (fc == funcs_alloc) {
+      funcs_alloc = MAX(funcs_alloc * 2, 64);
+      funcs = ck_realloc(funcs, funcs_alloc * sizeof(struct func));
+    }
+
+    funcs[fc].name  = fents[i].name;
+    funcs[fc].line  = fents[i].line;
+    funcs[fc].first = i;
+    funcs[fc].cnt   = 1;
+    funcs[fc].hit   = fents[i].hit;
+    fc++;
+
+  }
+
+  return fc;
+
+}
+
+
+static void emit_lcov(FILE* out, struct rec* r, u32 n) {
+
+  u32 i, fc = collect_funcs(r, n), fh = 0, valid, hit;
+
+  file_stats(r, n, &valid, &hit);
+
+  fprintf(out, "TN:\nSF:%s\n", r[0].file);
+
+  /* collect_funcs() leaves them sorted by name, lcov wants line order */
+
+  qsort(funcs, fc, sizeof(struct func), cmp_func);
+
+  for (i = 0; i < fc; i++) fprintf(out, "FN:%u,%s\n", funcs[i].line, funcs[i].name);
+
+  for (i = 0; i < fc; i++) {
+    fprintf(out, "FNDA:%u,%s\n", funcs[i].hit, funcs[i].name);
+    fh += funcs[i].hit;
+  }
+
+  fprintf(out, "FNF:%u\nFNH:%u\n", fc, fh);
+
+  for (i = 0; i < n; i++)
+    if (!i || r[i].line != r[i - 1].line)
+      fprintf(out, "DA:%u,%u\n", r[i].line, r[i].hit);
+
+  fprintf(out, "LF:%u\nLH:%u\nend_of_record\n", valid, hit);
+
+  total_valid += valid;
+  total_hit   += hit;
+
+}
+
+
+static void emit_class(FILE* out, struct rec* r, u32 n) {
+
+  u32 i, j, fc = collect_funcs(r, n), valid, hit;
+
+  file_stats(r, n, &valid, &hit);
+
+  fputs("        <class name=\"", out);
+  xml_str(out, r[0].file + (r[0].dir_len ? r[0].dir_len + 1 : 0));
+  fputs("\" filename=\"", out);
+  xml_str(out, r[0].file);
+  fprintf(out, "\" line-rate=\"%.4f\" branch-rate=\"0\" complexity=\"0\">\n"
+               "          <methods>\n", rate(hit, valid));
+
+  for (i = 0; i < fc; i++) {
+
+    struct fentry* fe = fents + funcs[i].first;
+    u32 mh = 0, mv = 0;
+
+    for (j = 0; j < funcs[i].cnt; fe++) {
+      if (fe->dup) continue;
+      mv++;
+      mh += fe->hit;
+      j++;
+    }
+
+    fputs("            <method name=\"", out);
+    xml_str(out, funcs[i].name);
+    fprintf(out, "\" signature=\"\" line-rate=\"%.4f\" branch-rate=\"0\" "
+                 "complexity=\"0\">\n              <lines>\n", rate(mh, mv));
+
+    fe = fents + funcs[i].first;
+
+    for (j = 0; j < funcs[i].cnt; fe++) {
+      if (fe->dup) continue;
+      fprintf(out, "                <line number=\"%u\" hits=\"%u\"/>\n",
+              fe->line, fe->hit);
+      j++;
+    }
+
+    fputs("              </lines>\n            </method>\n", out);
+
+  }
+
+  fputs("          </methods>\n          <lines>\n", out);
+
+  for (i = 0; i < n; i++)
+    if (!i || r[i].line != r[i - 1].line)
+      fprintf(out, "            <line number=\"%u\" hits=\"%u\"/>\n",
+              r[i].line, r[i].hit);
+
+  fputs("          </lines>\n        </class>\n", out);
+
+  total_valid += valid;
+  total_hit   += hit;
+
+}
+
+
+static u32 same_file_end(struct rec* r, u32 i, u32 n) {
+
+  u32 j = i + 1;
+
+  while (j < n && !strcmp((char*)r[j].file, (char*)r[i].file)) j++;
+  return j;
+
+}
+
+
+/* Cobertura wants the rate of a package before its classes, so the
+   stats of the whole directory are computed first. */
+
+static void emit_package(FILE* out, struct rec* r, u32 n) {
+
+  u32 i, j, valid = 0, hit = 0;
+
+  for (i = 0; i < n; i = j) {
+
+    u32 v, h;
+
+    j = same_file_end(r, i, n);
+    file_stats(r + i, j - i, &v, &h);
+    valid += v;
+    hit   += h;
+
+  }
+
+  fputs("    <package name=\"", out);
+  if (r[0].dir_len) {
+    u8 c = r[0].file[r[0].dir_len];
+    r[0].file[r[0].dir_len] = 0;
+    xml_str(out, r[0].file);
+    r[0].file[r[0].dir_len] = c;
+  } else fputs(".", out);
+  fprintf(out, "\" line-rate=\"%.4f\" branch-rate=\"0\" complexity=\"0\">\n"
+               "      <classes>\n", rate(hit, valid));
+
+  for (i = 0; i < n; i = j) {
+    j = same_file_end(r, i, n);
+    emit_class(out, r + i, j - i);
+  }
+
+  fputs("      </classes>\n    </package>\n", out);
+
+}
+
+
+/* Pass 2: sort one bucket and convert it, file by file. */
+
+static void convert_bucket(FILE* bf, FILE* out) {
+
+  struct stat st;
+  struct rec* r;
+  u8 *mem, *p, *end;
+  u32 n = 0, alloc = 1024, i, j;
+
+  if (fflush(bf) || fstat(fileno(bf), &st)) PFATAL("Unable to write bucket");
+  if (!st.st_size) return;
+
+  mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+             fileno(bf), 0);
+  if (mem == MAP_FAILED) PFATAL("Unable to mmap bucket");
+
+  r   = ck_alloc(alloc * sizeof(struct rec));
+  end = mem + st.st_size;
+
+  for (p = mem; p < end; ) {
+
+    u8 *t1, *t2, *nl;
+
+    t1 = memchr(p, '\t', end - p);
+    t2 = t1 ? memchr(t1 + 1, '\t', end - t1 - 1) : NULL;
+    nl = t2 ? memchr(t2 + 1, '\n', end - t2 - 1) : NULL;
+    if (!nl) FATAL("Corrupt bucket file");
+
+    /* The function name is the last field; the file name is before it */
+
+    nl[0] = 0;
+    t2 = memrchr(t1 + 1, '\t', nl - t1 - 1);
+    t2[0] = 0;
+    t1[0] = 0;
+
+    if (n == alloc) {
+      if ((u64)alloc * 2 * sizeof(struct rec) > MAX_ALLOC)
+        FATAL("Bucket too large, use a smaller -M");
+      alloc *= 2;
+      r = ck_realloc(r, alloc * sizeof(struct rec));
+    }
+
+    r[n].hit  = p[0] == 'H';
+    r[n].line = atoi((char*)p + 2);
+    r[n].file = (u8*)strchr((char*)p + 2, '\t') + 1;
+    r[n].func = t2[1] ? t2 + 1 : NULL;
+    r[n].dir_len = dir_len(r[n].file);
+    n++;
+
+    p = nl + 1;
+
+  }
+
+  qsort(r, n, sizeof(struct rec), cmp_rec);
+
+  for (i = 0; i < n; i = j) {
+
+    if (cobertura) {
+
+      j = i + 1;
+      while (j < n && r[j].dir_len == r[i].dir_len &&
+             !memcmp(r[j].file, r[i].file, r[i].dir_len)) j++;
+      emit_package(out, r + i, j - i);
+
+    } else {
+
+      j = same_file_end(r, i, n);
+      emit_lcov(out, r + i, j - i);
+
+    }
+
+  }
+
+  ck_free(r);
+  munmap(mem, st.st_size);
+
+}
+
+
+/* Bucket files are unlinked right after creation, only the directory
+   needs to go, FATAL() included. */
+
+static void remove_tmp_dir(void) {
+
+  rmdir((char*)tmp_dir);
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] coverage_file ...\n\n"
+
+       "Coverage files are in LLCov text format, '-' reads standard input.\n"
+       "Binary output can be converted with llcov-decode first.\n\n"
+
+       "Options:\n\n"
+
+       "  -m file       - instrumentation manifest (LLCOV_LOGINSTFILE), may\n"
+       "                  be given more than once\n"
+       "  -f format     - lcov (default) or cobertura\n"
+       "  -o file       - output file (default: stdout)\n"
+       "  -M mb         - memory budget per bucket (default: 256)\n"
+       "  -T dir        - directory for temporary files (default: $TMPDIR)\n\n",
+
+       argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  u8** manifests = ck_alloc(argc * sizeof(u8*));
+  u8 *out_fn = NULL, *tmp = (u8*)getenv("TMPDIR"), *body_fn = NULL;
+  u32 manifest_cnt = 0, budget = 256, i;
+  u64 in_size = 0;
+  u8 have_stdin = 0;
+  FILE *out, *body;
+  s32 opt;
+
+  SAYF(cCYA "llcov-export " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+m:f:o:M:T:")) > 0)
+
+    switch (opt) {
+
+      case 'm': manifests[manifest_cnt++] = (u8*)optarg; break;
+
+      case 'f':
+        if (!strcmp(optarg, "cobertura")) cobertura = 1;
+        else if (strcmp(optarg, "lcov")) FATAL("Unknown format '%s'", optarg);
+        break;
+
+      case 'o': out_fn = (u8*)optarg; break;
+      case 'M': budget = atoi(optarg); break;
+      case 'T': tmp = (u8*)optarg; break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind == argc) usage((u8*)argv[0]);
+  if (!budget) FATAL("Memory budget must be non-zero");
+
+  /* A bucket takes about twice its size in memory once parsed */
+
+  for (i = 0; i < manifest_cnt + argc - optind; i++) {
+
+    u8* fn = i < manifest_cnt ? manifests[i] : (u8*)argv[optind + i - manifest_cnt];
+    struct stat st;
+
+    if (!strcmp((char*)fn, "-")) have_stdin = 1;
+    else if (!stat((char*)fn, &st)) in_size += st.st_size;
+
+  }
+
+  bucket_cnt = have_stdin ? 64 : 1;
+  bucket_cnt = MAX(bucket_cnt, in_size * 2 / ((u64)budget << 20) + 1);
+  bucket_cnt = MIN(bucket_cnt, MAX_BUCKETS);
+
+  tmp_dir = alloc_printf("%s/llcov-export-XXXXXX", tmp ? tmp : (u8*)"/tmp");
+  if (!mkdtemp((char*)tmp_dir)) PFATAL("Unable to create '%s'", tmp_dir);
+  atexit(remove_tmp_dir);
+
+  buckets = ck_alloc(bucket_cnt * sizeof(FILE*));
+
+  for (i = 0; i < bucket_cnt; i++) {
+
+    u8* fn = alloc_printf("%s/%u", tmp_dir, i);
+
+    buckets[i] = fopen((char*)fn, "w+");
+    if (!buckets[i]) PFATAL("Unable to create '%s'", fn);
+
+    /* Keep only the open handle around */
+    unlink((char*)fn);
+    ck_free(fn);
+
+  }
+
+  ACTF("Partitioning records into %u buckets...", bucket_cnt);
+
+  for (i = 0; i < manifest_cnt; i++) scatter(manifests[i], 1);
+  for (i = optind; i < argc; i++) scatter((u8*)argv[i], 0);
+
+  if (total_bad) WARNF("Skipped %llu malformed coverage lines", total_bad);
+
+  if (out_fn) {
+    out = fopen((char*)out_fn, "w");
+    if (!out) PFATAL("Unable to create '%s'", out_fn);
+  } else out = stdout;
+
+  /* Cobertura needs the totals up front, so the packages go through
+     another temporary file first. */
+
+  if (cobertura) {
+
+    body_fn = alloc_printf("%s/body", tmp_dir);
+    body = fopen((char*)body_fn, "w+");
+    if (!body) PFATAL("Unable to create '%s'", body_fn);
+    unlink((char*)body_fn);
+
+  } else body = out;
+
+  for (i = 0; i < bucket_cnt; i++) {
+    convert_bucket(buckets[i], body);
+    fclose(buckets[i]);
+  }
+
+  if (cobertura) {
+
+    u8 buf[65536];
+    size_t len;
+
+    fprintf(out, "<?xml version=\"1.0\" ?>\n"
+                 "<!DOCTYPE coverage SYSTEM \"http://cobertura.sourceforge.net/xml/coverage-04.dtd\">\n"
+                 "<coverage line-rate=\"%.4f\" branch-rate=\"0\" lines-covered=\"%llu\" "
+                 "lines-valid=\"%llu\" branches-covered=\"0\" branches-valid=\"0\" "
+                 "complexity=\"0\" version=\"0.9a\" timestamp=\"%llu\">\n"
+                 "  <sources>\n    <source>.</source>\n  </sources>\n"
+                 "  <packages>\n",
+            total_valid ? (double)total_hit / total_valid : 1.0, total_hit,
+            total_valid, (u64)time(NULL) * 1000);
+
+    rewind(body);
+
+    while ((len = fread(buf, 1, sizeof(buf), body)))
+      if (fwrite(buf, 1, len, out) != len) PFATAL("Short write");
+
+    fputs("  </packages>\n</coverage>\n", out);
+    fclose(body);
+    ck_free(body_fn);
+
+  }
+
+  if (fclose(out)) PFATAL("Unable to write output");
+
+  OKF("Exported %llu of %llu lines covered (%llu records).", total_hit,
+      total_valid, total_recs);
+
+  return 0;
+
+}
@@ -15,11 +15,13 @@
 #define DEBUG_TYPE "llcov"
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #if defined(LLVM34)
 #include "llvm/DebugInfo.h"
@@ -36,8 +38,12 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <vector>
+#include <algorithm>
 #include <utility>
 
+#include "config.h"
+
 using namespace llvm;
 
 /* Start of helper classes */
@@ -69,8 +75,16 @@ public:
       return (matchFileName(fileName) && matchFuncName(funcName));
    }
 
+   bool matchLine(unsigned int line) {
+      return (line >= myLine && line <= myLineEnd);
+   }
+
+   bool matchRelblock(unsigned int relblock) {
+      return (myRelblock == relblock);
+   }
+
    bool matchAll(const std::string &fileName, const std::string &funcName, unsigned int line) {
-      return ((line == myLine) && matchFileFuncName(fileName, funcName));
+      return (matchLine(line) && matchFileFuncName(fileName, funcName));
    }
    
    bool matchAllRelblock(const std::string &fileName, const std::string &funcName, unsigned int line, unsigned int relblock) {
@@ -78,7 +92,7 @@ public:
    }
 
    bool matchFileLine(const std::string &fileName, unsigned int line) {
-      return ((line == myLine) && matchFileName(fileName));
+      return (matchLine(line) && matchFileName(fileName));
    }
 
    bool matchFileLineRelblock(const std::string &fileName, unsigned int line, unsigned int relblock) {
@@ -90,6 +104,9 @@ public:
    bool hasRelblock() { return myHasRelblock; }
 
    const std::string& getFilename() { return myFilename; }
+   const std::string& getFunction() { return myFunction; }
+   unsigned int getLine() { return myLine; }
+   unsigned int getLineEnd() { return myLineEnd; }
 
    void setFilename(const std::string &fileName) {
       myFilename = fileName;
@@ -100,7 +117,12 @@ public:
    }
 
    void setLine(unsigned int line) {
-         myLine = line;
+         setLineRange(line, line);
+   }
+
+   void setLineRange(unsigned int first, unsigned int last) {
+         myLine = first;
+         myLineEnd = last;
          myHasLine = true;
    }
 
@@ -114,9 +136,19 @@ protected:
    std::string myFilename;
    std::string myFunction;
    unsigned int myLine;
+   unsigned int myLineEnd;
    unsigned int myRelblock;
 };
 
+/* The entries that apply to one source file, built on first use */
+struct LLCovFileIndex {
+   LLCovFileIndex() : myMaxSpan(0) {}
+
+   std::vector<LLCovListEntry*> myEntries;     // All entries matching the file
+   std::vector<LLCovListEntry*> myLineEntries;  // Entries with a line, by first line
+   unsigned int myMaxSpan;                      // Longest line range
+};
+
 struct LLCovList {
 public:
    LLCovList(const std::string &path);
@@ -127,42 +159,78 @@ public:
    virtual bool doExactMatch( StringRef filename, Function &F, unsigned int line, unsigned int relblock );
    virtual bool doExactMatch( StringRef filename, unsigned int line, unsigned int relblock );
    virtual bool isEmpty() { return myEntries.empty(); }
+   bool hasIds() { return myHasIds; }
 protected:
    virtual bool doMatch(StringRef filename, Function &F, bool exact);
+   virtual bool doLineMatch(StringRef filename, const std::string *funcName, unsigned int line, const unsigned int *relblock);
+   LLCovFileIndex &getFileIndex(StringRef filename);
    std::multimap<std::string, LLCovListEntry> myEntries;
+   std::multimap<std::string, LLCovListEntry*> myFuncEntries; // Entries without a file, by function
+   std::map<std::string, LLCovFileIndex> myFileIndex;
+   bool myHasIds; // Some relblock is a stable block id
 };
 
+static bool lessFirstLine(LLCovListEntry *entry, unsigned int line) {
+   return entry->getLine() < line;
+}
+
+static bool lessLineFirst(unsigned int line, LLCovListEntry *entry) {
+   return line < entry->getLine();
+}
+
+static bool lessEntryLine(LLCovListEntry *a, LLCovListEntry *b) {
+   return a->getLine() < b->getLine();
+}
+
+/*
+ * Filenames in lists only need to be a suffix of the actual filename
+ * (which might be a full path), so entries cannot simply be looked up by
+ * name. Instead, the entries matching a file are collected once, the first
+ * time the file is seen, which makes all further lookups for it cheap
+ * even with huge lists.
+ */
+LLCovFileIndex &LLCovList::getFileIndex(StringRef filename) {
+   std::string name = filename.str();
+   std::map<std::string, LLCovFileIndex>::iterator found = myFileIndex.find(name);
+
+   if (found != myFileIndex.end()) return found->second;
+
+   LLCovFileIndex &idx = myFileIndex[name];
+
+   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
+      if (!it->second.hasFilename() || !it->second.matchFileName(name)) continue;
+
+      idx.myEntries.push_back(&it->second);
+
+      if (it->second.hasLine()) {
+         idx.myLineEntries.push_back(&it->second);
+         idx.myMaxSpan = std::max(idx.myMaxSpan, it->second.getLineEnd() - it->second.getLine());
+      }
+   }
+
+   std::stable_sort(idx.myLineEntries.begin(), idx.myLineEntries.end(), lessEntryLine);
+
+   return idx;
+}
+
 bool LLCovList::doMatch(StringRef filename, Function &F, bool exact) {
    /*
     * Search one entry that mentiones either this file
     * or this function to return true.
     */
-   // XXX: TODO: This and all of the following commented equal_range optimizations don't work because we're having trouble
-   // with absolute vs. relative paths used for the filenames. Filename matching requires a substring match to the end.
-   // Maybe a custom key comparison operator can solve this problem to make compilation with huge black- and whitelists
-   // faster.
+   LLCovFileIndex &idx = getFileIndex(filename);
 
-   /*std::pair<std::multimap<std::string, LLCovListEntry>::iterator, std::multimap<std::string, LLCovListEntry>::iterator> peqr
-        = myEntries.equal_range(filename.str());
-
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = peqr.first; it != peqr.second; ++it) {*/
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
-      if (exact && (it->second.hasLine() || it->second.hasRelblock())) { continue; }
-      if (it->second.hasFilename()) {
-         if (exact && it->second.hasFunction()) {
-            if (it->second.matchFileFuncName(filename, F.getName().str())) { return true; }
-         } else {
-            if (it->second.matchFileName(filename)) { return true; }
-         }
+   for (std::vector<LLCovListEntry*>::iterator it = idx.myEntries.begin(); it != idx.myEntries.end(); ++it) {
+      if (exact && ((*it)->hasLine() || (*it)->hasRelblock())) { continue; }
+      if (exact && (*it)->hasFunction()) {
+         if ((*it)->matchFuncName(F.getName().str())) { return true; }
       } else {
-         /* Must have function */
-         if (it->second.matchFuncName(F.getName().str())) {
-            return true;
-         }
+         return true;
       }
    }
 
-   return false;
+   /* Entries without a file must have a function */
+   return myFuncEntries.count(F.getName().str()) > 0;
 }
 
 /* Check if there are any list entries that mention this file OR function */
@@ -176,60 +244,53 @@ bool LLCovList::doExactMatch( StringRef filename, Function &F ) {
    return doMatch(filename, F, true);
 }
 
-/* Check if there are any list entries that match all three attributes exactly. */
-bool LLCovList::doExactMatch( StringRef filename, Function &F, unsigned int line ) {
-   /*std::pair<std::multimap<std::string, LLCovListEntry>::iterator, std::multimap<std::string, LLCovListEntry>::iterator> peqr
-        = myEntries.equal_range(filename.str());
-
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = peqr.first; it != peqr.second; ++it) {*/
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
-      if (!it->second.hasLine() || !it->second.hasFunction() || !it->second.hasFilename() || it->second.hasRelblock()) continue;
-      if (it->second.matchAll(filename, F.getName().str(), line)) return true;
+/*
+ * Common part of all line matches: the entry must cover the line, have a
+ * relblock exactly if one is asked for, and a function if one is given.
+ */
+bool LLCovList::doLineMatch(StringRef filename, const std::string *funcName, unsigned int line, const unsigned int *relblock) {
+   LLCovFileIndex &idx = getFileIndex(filename);
+
+   std::vector<LLCovListEntry*>::iterator first = std::lower_bound(idx.myLineEntries.begin(), idx.myLineEntries.end(),
+         line > idx.myMaxSpan ? line - idx.myMaxSpan : 0, lessFirstLine);
+   std::vector<LLCovListEntry*>::iterator last = std::upper_bound(first, idx.myLineEntries.end(), line, lessLineFirst);
+
+   for (std::vector<LLCovListEntry*>::iterator it = first; it != last; ++it) {
+      LLCovListEntry *entry = *it;
+
+      if (entry->hasRelblock() != (relblock != NULL)) continue;
+      if (funcName && (!entry->hasFunction() || !entry->matchFuncName(*funcName))) continue;
+      if (!entry->matchLine(line)) continue;
+      if (relblock && !entry->matchRelblock(*relblock)) continue;
+      return true;
    }
    return false;
 }
 
+/* Check if there are any list entries that match all three attributes exactly. */
+bool LLCovList::doExactMatch( StringRef filename, Function &F, unsigned int line ) {
+   std::string funcName = F.getName().str();
+   return doLineMatch(filename, &funcName, line, NULL);
+}
+
 /* Check if there are any list entries that match all four attributes exactly. */
 bool LLCovList::doExactMatch( StringRef filename, Function &F, unsigned int line, unsigned int relblock ) {
-   /*std::pair<std::multimap<std::string, LLCovListEntry>::iterator, std::multimap<std::string, LLCovListEntry>::iterator> peqr
-        = myEntries.equal_range(filename.str());
-
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = peqr.first; it != peqr.second; ++it) {*/
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
-      if (!it->second.hasLine() || !it->second.hasFunction() || !it->second.hasFilename() || !it->second.hasRelblock()) continue;
-      if (it->second.matchAllRelblock(filename, F.getName().str(), line, relblock)) return true;
-   }
-   return false;
+   std::string funcName = F.getName().str();
+   return doLineMatch(filename, &funcName, line, &relblock);
 }
 
 /* Check if there are any list entries that match the function/line attributes exactly. */
 bool LLCovList::doExactMatch( StringRef filename, unsigned int line ) {
-   /* std::pair<std::multimap<std::string, LLCovListEntry>::iterator, std::multimap<std::string, LLCovListEntry>::iterator> peqr
-        = myEntries.equal_range(filename.str());
-
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = peqr.first; it != peqr.second; ++it) {*/
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
-      if (!it->second.hasLine() || !it->second.hasFilename() || it->second.hasRelblock()) continue;
-      if (it->second.matchFileLine(filename, line)) return true;
-   }
-   return false;
+   return doLineMatch(filename, NULL, line, NULL);
 }
 
 
 /* Check if there are any list entries that match the function/line/relblock attributes exactly. */
 bool LLCovList::doExactMatch( StringRef filename, unsigned int line, unsigned int relblock ) {
-   /*std::pair<std::multimap<std::string, LLCovListEntry>::iterator, std::multimap<std::string, LLCovListEntry>::iterator> peqr
-        = myEntries.equal_range(filename.str());
-
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = peqr.first; it != peqr.second; ++it) {*/
-   for (std::multimap<std::string, LLCovListEntry>::iterator it = myEntries.begin(); it != myEntries.end(); ++it) {
-      if (!it->second.hasLine() || !it->second.hasFilename() || !it->second.hasRelblock()) continue;
-      if (it->second.matchFileLineRelblock(filename, line, relblock)) return true;
-   }
-   return false;
+   return doLineMatch(filename, NULL, line, &relblock);
 }
 
-LLCovList::LLCovList(const std::string &path) : myEntries() {
+LLCovList::LLCovList(const std::string &path) : myEntries(), myHasIds(false) {
    /* If no file is specified, do nothing */
    if (!path.size()) return;
 
@@ -289,12 +350,23 @@ LLCovList::LLCovList(const std::string &path) : myEntries() {
          if ( func.size() )
             entry.setFunction( func );
 
-         if ( line.size() )
+         /* line:<n> or an inclusive range line:<first>-<last> */
+         size_t dash = line.find('-');
+
+         if ( dash != std::string::npos ) {
+            if ( atoi( line.c_str() ) > atoi( line.c_str() + dash + 1 ) )
+               report_fatal_error( "Reversed line range " + line + " in file " + path );
+            entry.setLineRange( atoi( line.c_str() ), atoi( line.c_str() + dash + 1 ) );
+         } else if ( line.size() )
             entry.setLine( atoi( line.c_str() ) );
          if ( relblock.size() ) {
             if ( !line.size() )
                report_fatal_error( "Cannot use relblock without line in file " + path );
+            if ( dash != std::string::npos )
+               report_fatal_error( "Cannot use relblock with a line range in file " + path );
             entry.setRelblock( atoi( relblock.c_str() ) );
+            if ( (unsigned int)atoi( relblock.c_str() ) >= LLCOV_ID_BASE )
+               myHasIds = true;
          }
 
        } else if ( func.size() ) {
@@ -306,7 +378,11 @@ LLCovList::LLCovList(const std::string &path) : myEntries() {
          report_fatal_error( "Must either specify file or function in file " + path );
        }
 
-       myEntries.insert(std::pair<std::string, LLCovListEntry>(file, entry));
+       std::multimap<std::string, LLCovListEntry>::iterator inserted =
+          myEntries.insert(std::pair<std::string, LLCovListEntry>(file, entry));
+
+       if ( !inserted->second.hasFilename() )
+          myFuncEntries.insert(std::pair<std::string, LLCovListEntry*>(inserted->second.getFunction(), &inserted->second));
 
        getline(fileStream, configLine);
    }
@@ -333,14 +409,26 @@ public:
 protected:
    virtual bool runOnFunction( Function &F, StringRef filename );
    Constant* getInstrumentationFunction();
+   Constant* getPCInstrumentationFunction();
+   Constant* getStringPtr( StringRef str, const std::string &name, bool shared = false, StringRef comdat = StringRef() );
+   Constant* getFileString( StringRef filename );
+   Constant* getFuncString( Function &F );
+   void emitModuleRegistration();
 
    Module* M;
    LLCovList* myBlackList;
    LLCovList* myWhiteList;
 
+   /* One string per file and module, shared by all probes and the module
+    * table, so the runtime can attribute sites to files by pointer */
+   std::map<std::string, Constant*> myFileStrings;
+   std::map<std::string, unsigned int> myFileBlocks;
+
    std::ofstream myLogInstStream;
    bool myDoLogInstrumentation;
    bool myDoLogInstrumentationDebug;
+   bool myPCMode;
+   bool myStableIds;
 };
 
 char LLCov::ID = 0;
@@ -349,7 +437,8 @@ char LLCov::ID = 0;
 LLCov::LLCov() : ModulePass( ID ), M(NULL),
       myBlackList(new LLCovList(getenv("LLCOV_BLACKLIST") != NULL ? std::string(getenv("LLCOV_BLACKLIST")) : "" )),
       myWhiteList(new LLCovList(getenv("LLCOV_WHITELIST") != NULL ? std::string(getenv("LLCOV_WHITELIST")) : "" )),
-      myDoLogInstrumentation(false), myDoLogInstrumentationDebug(false) {
+      myDoLogInstrumentation(false), myDoLogInstrumentationDebug(false),
+      myPCMode(getenv("LLCOV_PC") != NULL), myStableIds(getenv("LLCOV_STABLE_IDS") != NULL) {
       
       if (getenv("LLCOV_LOGINSTFILE") != NULL) {
          myDoLogInstrumentation = true;
@@ -371,6 +460,9 @@ bool LLCov::runOnModule( Module &M ) {
 
    bool modified = false;
 
+   myFileStrings.clear();
+   myFileBlocks.clear();
+
    NamedMDNode *CU_Nodes = this->M->getNamedMetadata("llvm.dbg.cu");
    if (!CU_Nodes) return false;
 
@@ -405,9 +497,35 @@ bool LLCov::runOnModule( Module &M ) {
 
    }
 
+   /* PC probes are not attributed to file strings, nothing to register */
+   if (modified && !myPCMode) emitModuleRegistration();
+
    return modified;
 }
 
+/*
+ * Stable block id: unlike the relblock, which counts blocks in the order
+ * they happen to be in, it is a 15-bit hash of what the block looks like:
+ * where it starts in the source (file and line are part of every record
+ * anyway, plus column and the function the code belongs to, before any
+ * inlining) and how it ends (location of the terminator relative to the
+ * start, its opcode and number of successors). Only blocks that agree in
+ * all of that are told apart by their order. Ids stay the same as long as
+ * the blocks of a line keep their shape, no matter how blocks get
+ * reordered or what happens elsewhere in the function; a change to the
+ * line itself, or the optimizer splitting its blocks differently, gives
+ * new ids.
+ */
+static unsigned int stableBlockId( StringRef scope, const unsigned int* vals, size_t cnt ) {
+   uint32_t h = 2166136261U;
+
+   for (size_t i = 0; i < scope.size(); i++) h = (h ^ (unsigned char)scope[i]) * 16777619U;
+   for (size_t i = 0; i < cnt; i++)
+      for (int shift = 0; shift < 32; shift += 8) h = (h ^ ((vals[i] >> shift) & 0xff)) * 16777619U;
+
+   return LLCOV_ID_BASE | ((h ^ (h >> 15)) & (LLCOV_ID_BASE - 1));
+}
+
 bool LLCov::runOnFunction( Function &F, StringRef filename ) {
    //errs() << "Hello: ";
    //errs().write_escaped( F.getName() ) << '\n';
@@ -439,6 +557,10 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
    }
    int lastBBLine = -1;
    unsigned int relblock = 0;
+   bool relblockCapped = false;
+   Constant* funcNameVal = NULL;
+   std::map<std::string, unsigned int> idSeen; // Blocks per source position and shape, for stable ids
+   std::map<std::pair<std::string, unsigned int>, std::string> idOwner; // Shape that has a line's id
 
    /* Iterate over all basic blocks in this function */
    for ( Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB ) {
@@ -456,8 +578,12 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
 
       bool haveLine = false;
       unsigned int line = 0;
+      unsigned int blockId = 0;
 
       StringRef blockFilename;
+#ifndef LLVM_OLD_DEBUG_API
+      DILocation *blockLoc = NULL;
+#endif /* LLVM_OLD_DEBUG_API */
 
       /* Iterate over the instructions in the BasicBlock to find line number */
       for ( BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I ) {
@@ -484,6 +610,7 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
         }
 #else
         DILocation *cDILoc = dyn_cast<DILocation>(Loc.getAsMDNode());
+        DILocation *instLoc = cDILoc;
 
         unsigned int instLine = cDILoc->getLine();
         StringRef instFilename = cDILoc->getFilename();
@@ -494,6 +621,7 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
             if (oDILoc) {
                 instFilename = oDILoc->getFilename();
                 instLine = oDILoc->getLine();
+                instLoc = oDILoc;
             }
         }
 #endif /* LLVM_OLD_DEBUG_API */
@@ -509,10 +637,19 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
             * increase the relative basic block count to distinguish the
             * the blocks in the callback later */
            if (line == lastBBLine) {
-               relblock++;
+               /* Relblocks from LLCOV_ID_BASE on would be taken for stable
+                * ids, the rest of such a line shares the last one */
+               if (relblock + 1 < LLCOV_ID_BASE) {
+                  relblock++;
+               } else if (!relblockCapped) {
+                  errs() << "LLCov: warning: more than " << LLCOV_ID_BASE << " blocks on line " << line
+                         << " of " << F.getName() << ", the rest share relblock " << relblock << "\n";
+                  relblockCapped = true;
+               }
            } else {
                /* New line, reset relative basic block count to 0 */
                relblock = 0;
+               relblockCapped = false;
            }
            
            /* Store away line of last basic block */
@@ -520,6 +657,37 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
 
            // Also resolve the file now that this block originally belonged to
            blockFilename = instFilename;
+           DebugLoc termLoc = TI->getDebugLoc();
+#ifndef LLVM_OLD_DEBUG_API
+           blockLoc = instLoc;
+
+           DISubprogram *SP = instLoc->getScope()->getSubprogram();
+           StringRef scope = !SP ? F.getName() : SP->getLinkageName().empty() ? SP->getName() : SP->getLinkageName();
+           unsigned int column = instLoc->getColumn();
+           bool haveTermLoc = (bool)termLoc;
+#else
+           StringRef scope = F.getName();
+           unsigned int column = 0;
+           bool haveTermLoc = !termLoc.isUnknown();
+#endif /* LLVM_OLD_DEBUG_API */
+
+           unsigned int shape[] = { column, haveTermLoc ? termLoc.getLine() - line : 0, haveTermLoc ? termLoc.getCol() : 0,
+                                    TI->getOpcode(), TI->getNumSuccessors(), 0 };
+           std::string pos = blockFilename.str() + ":" + std::to_string(line) + ":" + scope.str();
+
+           for (size_t i = 0; i < 5; i++) pos += ":" + std::to_string(shape[i]);
+           shape[5] = idSeen[pos]++;
+           pos += ":" + std::to_string(shape[5]);
+
+           /* Blocks of one line that hash to the same id: later shapes
+            * move on to the next free one */
+           blockId = stableBlockId(scope, shape, 6);
+           for (;;) {
+              std::string &owner = idOwner[std::make_pair(blockFilename.str() + ":" + std::to_string(line), blockId)];
+              if (owner.empty()) owner = pos;
+              if (owner == pos) break;
+              blockId = LLCOV_ID_BASE | ((blockId + 1) & (LLCOV_ID_BASE - 1));
+           }
 
            if (blockFilename != filename) {
                if (myBlackList->doCoarseMatch(blockFilename, F)) {
@@ -547,27 +715,50 @@ bool LLCov::runOnFunction( Function &F, StringRef filename ) {
         if (!instrumentBlock) {
         instrumentBlock = instrumentBlock 
                            || myWhiteList->doExactMatch(instFilename, instLine)
-                           || myWhiteList->doExactMatch(instFilename, instLine, relblock);
+                           || myWhiteList->doExactMatch(instFilename, instLine, relblock)
+                           || (myWhiteList->hasIds() && myWhiteList->doExactMatch(instFilename, instLine, blockId));
            //if (instrumentBlock) myLogInstStream << "Decision made for " << instFilename.str() << " line: " << instLine << " blockline " << line << std::endl;
         }
-        if (myBlackList->doExactMatch(instFilename, instLine) || myBlackList->doExactMatch(instFilename, instLine, relblock)) {
+        if (myBlackList->doExactMatch(instFilename, instLine) || myBlackList->doExactMatch(instFilename, instLine, relblock)
+            || (myBlackList->hasIds() && myBlackList->doExactMatch(instFilename, instLine, blockId))) {
            instrumentBlock = false;
            break;
         }
       }
 
-      if ((instrumentAll && haveLine && blockFilename == filename) || (haveLine && instrumentBlock)) {
+      if (((instrumentAll && haveLine && blockFilename == filename) || (haveLine && instrumentBlock)) && myPCMode) {
+         /*
+          * PC mode: a call without arguments, the runtime records its
+          * return address. The call carries the block's location with
+          * relblock + 1 as discriminator, so that llcov-symbolize gets
+          * file, line and relblock back from the line table.
+          */
+         CallInst *CI = Builder.CreateCall( getPCInstrumentationFunction() );
+#ifndef LLVM_OLD_DEBUG_API
+         CI->setDebugLoc( DebugLoc( blockLoc->cloneWithDiscriminator( (myStableIds ? blockId : relblock) + 1 ) ) );
+#else
+         (void)CI;
+#endif /* LLVM_OLD_DEBUG_API */
+
+         if (myDoLogInstrumentation) {
+            myLogInstStream << "file:" << blockFilename.str() << " " << "func:" << F.getName().str() << " " << "line:" << line << " " << "relblock:" << relblock << " " << "id:" << blockId << std::endl;
+         }
+
+         ret = true;
+      } else if ((instrumentAll && haveLine && blockFilename == filename) || (haveLine && instrumentBlock)) {
          /* Create arguments for our function */
-         Value* funcNameVal = Builder.CreateGlobalStringPtr(F.getName());
-         Value* filenameVal = Builder.CreateGlobalStringPtr(blockFilename);
+         if (!funcNameVal) funcNameVal = getFuncString(F);
+         Value* filenameVal = getFileString(blockFilename);
          Value* lineVal = ConstantInt::get(Type::getInt32Ty(M->getContext()), line, false);
-         Value* relblockVal = ConstantInt::get(Type::getInt32Ty(M->getContext()), relblock, false);
+         /* With LLCOV_STABLE_IDS, records carry the stable id in place of the relblock */
+         Value* relblockVal = ConstantInt::get(Type::getInt32Ty(M->getContext()), myStableIds ? blockId : relblock, false);
 
          /* Add function call: void func(const char* function, const char* filename, uint32_t line, uint32_t relblock);  */
          Builder.CreateCall( getInstrumentationFunction(), { funcNameVal, filenameVal, lineVal, relblockVal });
+         myFileBlocks[blockFilename.str()]++;
 
          if (myDoLogInstrumentation) {
-            myLogInstStream << "file:" << blockFilename.str() << " " << "func:" << F.getName().str() << " " << "line:" << line << std::endl;
+            myLogInstStream << "file:" << blockFilename.str() << " " << "func:" << F.getName().str() << " " << "line:" << line << " " << "relblock:" << relblock << " " << "id:" << blockId << std::endl;
          }
 
          ret = true;
@@ -594,6 +785,149 @@ Constant* LLCov::getInstrumentationFunction() {
    return M->getOrInsertFunction( "llvm_llcov_block_call", FTy );
 }
 
+/* void llvm_llcov_pc_call(void), also in the runtime */
+Constant* LLCov::getPCInstrumentationFunction() {
+   FunctionType *FTy = FunctionType::get( Type::getVoidTy( M->getContext() ), false );
+   return M->getOrInsertFunction( "llvm_llcov_pc_call", FTy );
+}
+
+/*
+ * Not unnamed_addr: the runtime keys sites by this pointer. Shared strings
+ * are the ones many modules emit alike (file names, and the names of
+ * inline functions and templates): they are linkonce_odr, hidden and in a
+ * COMDAT group where the object format has them, so the linker keeps one
+ * copy per binary and all probes refer to the same one.
+ */
+Constant* LLCov::getStringPtr( StringRef str, const std::string &name, bool shared, StringRef comdat ) {
+   Constant* data = ConstantDataArray::getString( M->getContext(), str );
+   GlobalVariable* GV = new GlobalVariable( *M, data->getType(), true,
+                                            shared ? GlobalValue::LinkOnceODRLinkage : GlobalValue::PrivateLinkage,
+                                            data, name );
+
+   if (shared) {
+      GV->setVisibility( GlobalValue::HiddenVisibility );
+#ifndef LLVM34
+      /* Mach-O has no COMDATs, weak definitions are coalesced by name */
+      if (!comdat.empty() && !Triple( M->getTargetTriple() ).isOSBinFormatMachO())
+         GV->setComdat( M->getOrInsertComdat( comdat ) );
+#endif /* LLVM34 */
+   }
+
+   Constant* zero = ConstantInt::get( Type::getInt32Ty( M->getContext() ), 0 );
+   Constant* idx[] = { zero, zero };
+
+#ifdef LLVM_OLD_DEBUG_API
+   return ConstantExpr::getInBoundsGetElementPtr( GV, idx );
+#else
+   return ConstantExpr::getInBoundsGetElementPtr( data->getType(), GV, idx );
+#endif /* LLVM_OLD_DEBUG_API */
+}
+
+Constant* LLCov::getFileString( StringRef filename ) {
+   std::map<std::string, Constant*>::iterator found = myFileStrings.find(filename.str());
+   if (found != myFileStrings.end()) return found->second;
+
+   /* Named after a hash of the contents, one group per file name */
+   uint64_t h = 0xcbf29ce484222325ULL;
+   for (size_t i = 0; i < filename.size(); i++) h = (h ^ (unsigned char)filename[i]) * 0x100000001b3ULL;
+
+   std::ostringstream name;
+   name << "__llcov_file_" << std::hex << h << "_" << filename.size();
+
+   Constant* str = getStringPtr( filename, name.str(), true, name.str() );
+   myFileStrings[filename.str()] = str;
+   return str;
+}
+
+/* One name string per function; inline functions and templates keep it in
+ * their own COMDAT group, so it goes wherever the linker's copy goes */
+Constant* LLCov::getFuncString( Function &F ) {
+   if (!F.hasLinkOnceODRLinkage() && !F.hasWeakODRLinkage())
+      return getStringPtr( F.getName(), ".llcov.func" );
+
+   StringRef comdat;
+#ifndef LLVM34
+   if (F.hasComdat()) comdat = F.getComdat()->getName();
+#endif /* LLVM34 */
+
+   return getStringPtr( F.getName(), "__llcov_func." + F.getName().str(), true, comdat );
+}
+
+/*
+ * Emits a table of the instrumented files of this module with their block
+ * counts, and a constructor that hands it to the runtime for the live
+ * statistics (llcov-stats-inl.h, struct llcov_module):
+ *
+ *   { const char* name; { const char* filename; uint32_t blocks; }* files;
+ *     uint32_t nfiles; uint32_t blocks; llcov_module* next; }
+ *
+ * The registration function is a weak reference, so objects still link
+ * against a runtime that does not have it.
+ */
+void LLCov::emitModuleRegistration() {
+   LLVMContext &C = M->getContext();
+   Type* Int8PtrTy = Type::getInt8PtrTy( C );
+   Type* Int32Ty = Type::getInt32Ty( C );
+
+   Type* fileFields[] = { Int8PtrTy, Int32Ty };
+   StructType* FileTy = StructType::get( C, fileFields );
+   std::vector<Constant*> files;
+   unsigned int blocks = 0;
+
+   for (std::map<std::string, unsigned int>::iterator it = myFileBlocks.begin(); it != myFileBlocks.end(); ++it) {
+      Constant* fields[] = { getFileString(it->first), ConstantInt::get( Int32Ty, it->second ) };
+      files.push_back( ConstantStruct::get( FileTy, fields ) );
+      blocks += it->second;
+   }
+
+   ArrayType* FilesTy = ArrayType::get( FileTy, files.size() );
+   GlobalVariable* FilesGV = new GlobalVariable( *M, FilesTy, true, GlobalValue::PrivateLinkage,
+                                                 ConstantArray::get( FilesTy, files ), ".llcov.files" );
+   Constant* zero = ConstantInt::get( Int32Ty, 0 );
+   Constant* idx[] = { zero, zero };
+
+#ifdef LLVM_OLD_DEBUG_API
+   Constant* filesPtr = ConstantExpr::getInBoundsGetElementPtr( FilesGV, idx );
+#else
+   Constant* filesPtr = ConstantExpr::getInBoundsGetElementPtr( FilesTy, FilesGV, idx );
+#endif /* LLVM_OLD_DEBUG_API */
+
+   /* The runtime links modules through the last field, so this is writable */
+   StructType* ModTy = StructType::create( C, "struct.llcov_module" );
+   Type* modFields[] = { Int8PtrTy, PointerType::getUnqual( FileTy ), Int32Ty, Int32Ty, PointerType::getUnqual( ModTy ) };
+   ModTy->setBody( modFields );
+
+   Constant* modInit[] = { getStringPtr( M->getModuleIdentifier(), ".llcov.module_name" ), filesPtr,
+                           ConstantInt::get( Int32Ty, files.size() ), ConstantInt::get( Int32Ty, blocks ),
+                           ConstantPointerNull::get( PointerType::getUnqual( ModTy ) ) };
+   GlobalVariable* ModGV = new GlobalVariable( *M, ModTy, false, GlobalValue::InternalLinkage,
+                                               ConstantStruct::get( ModTy, modInit ), "__llcov_module" );
+
+   /* void llvm_llcov_register_module(llcov_module* module); */
+   FunctionType* RegTy = FunctionType::get( Type::getVoidTy( C ), Int8PtrTy, false );
+   Constant* Reg = M->getOrInsertFunction( "llvm_llcov_register_module", RegTy );
+   if (Function* RegF = dyn_cast<Function>(Reg)) RegF->setLinkage( GlobalValue::ExternalWeakLinkage );
+
+   Function* Ctor = Function::Create( FunctionType::get( Type::getVoidTy( C ), false ),
+                                      GlobalValue::InternalLinkage, "llcov.module_ctor", M );
+   BasicBlock* Entry = BasicBlock::Create( C, "entry", Ctor );
+   BasicBlock* Call = BasicBlock::Create( C, "register", Ctor );
+   BasicBlock* Done = BasicBlock::Create( C, "done", Ctor );
+
+   IRBuilder<> Builder( Entry );
+   Builder.CreateCondBr( Builder.CreateIsNotNull( Reg ), Call, Done );
+
+   Builder.SetInsertPoint( Call );
+   Builder.CreateCall( Reg, ConstantExpr::getBitCast( ModGV, Int8PtrTy ) );
+   Builder.CreateBr( Done );
+
+   Builder.SetInsertPoint( Done );
+   Builder.CreateRetVoid();
+
+   /* Ahead of other constructors, which may run instrumented code */
+   appendToGlobalCtors( *M, Ctor, 0 );
+}
+
 static void registerLLCovPass(const PassManagerBuilder &,
                             legacy::PassManagerBase &PM) {
   PM.add(new LLCov());
@@ -4,29 +4,35 @@
 #include <string.h>
 #include <string>
 
-static FILE* filefd = NULL;
+#include "llcov-rt-inl.h"
+#include "llcov-api-inl.h"
 
-inline __attribute__((always_inline))
-void writeData(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
-    fprintf(filefd, "file:%s line:%u relblock:%u\n", filename, line, relblock);
-    fflush(filefd);
+static void rt_api_init() {
+    rt_get_mode();
+    rt_map_demand();
 }
 
 extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) 
 	__attribute__((visibility("default")));
 
 extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
-    if (filefd != NULL) {
-        writeData(funcname, filename, line, relblock);
-    } else if (getenv("LLCOV_ABORT")) {
+    int fd;
+
+    switch (rt_get_mode()) {
+    case RT_FILE:
+        rt_map_hit(funcname, filename, line, relblock);
+        if ((fd = __atomic_load_n(&rt_outfd, __ATOMIC_ACQUIRE)) < 0) fd = rt_open_output();
+        if (fd >= 0) rt_write_rec(fd, filename, line, relblock);
+        break;
+    case RT_MAP:
+        rt_map_hit(funcname, filename, line, relblock);
+        break;
+    case RT_ABORT:
         fprintf(stderr, "Assertion failure: LLCov: Block executed in file %s, line %u (function %s, line-relative block %u)\n", filename, line, funcname, relblock);
         abort();
-    } else if (getenv("LLCOV_STDERR")) {
+    case RT_STDERR:
+        rt_map_hit(funcname, filename, line, relblock);
         fprintf(stderr, "file:%s line:%u func:%s relblock:%u\n", filename, line, funcname, relblock);
-    } else if (getenv("LLCOV_FILE")) {
-        filefd = fopen(getenv("LLCOV_FILE"), "a");
-        if (filefd != NULL) {
-            writeData(funcname, filename, line, relblock);
-        }
+        break;
     }
 }
@@ -0,0 +1,280 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Load generator for llcov-collectd.
+
+  Simulates many instrumented processes streaming coverage at once. Each
+  connection behaves like one run of the network runtime: it sends a HELLO
+  for one of a configurable number of builds, the file name table and then
+  BLOCKS frames as fast as the collector accepts them. When the per-process
+  record budget is used up, the connection is closed and a new "process"
+  connects, so connection churn is part of the benchmark.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-proto.h"
+
+static u8* target;                    /* host[:port] or unix:path         */
+static u32 conn_cnt  = 64;            /* Concurrent connections           */
+static u32 duration  = 10;            /* Seconds to run                   */
+static u32 file_cnt  = 1000;          /* Distinct file names per build    */
+static u32 line_cnt  = 5000;          /* Distinct lines per file          */
+static u32 build_cnt = 4;             /* Distinct build ids               */
+static u32 proc_recs = 1000000;       /* Records per simulated process    */
+static u8  use_vblocks;               /* Send LLCOV_FR_VBLOCKS frames     */
+
+static volatile u8 stop_soon;
+
+static u64 total_recs, total_conns;
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+
+static s32 connect_target(void) {
+
+  s32 fd;
+
+  if (!strncmp((char*)target, "unix:", 5)) {
+
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, (char*)target + 5, sizeof(sun.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&sun, sizeof(sun)))
+      PFATAL("Unable to connect to '%s'", target);
+
+  } else {
+
+    struct addrinfo hints, *res;
+    u8 *host = target, *port = (u8*)STRINGIFY(LLCOV_NET_PORT);
+    u8* colon = (u8*)strrchr((char*)target, ':');
+
+    if (colon) {
+      host = ck_memdup_str(target, colon - target);
+      port = colon + 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo((char*)host, (char*)port, &hints, &res))
+      FATAL("Unable to resolve '%s'", target);
+
+    fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen))
+      PFATAL("Unable to connect to '%s'", target);
+
+    freeaddrinfo(res);
+    if (colon) ck_free(host);
+
+  }
+
+  return fd;
+
+}
+
+
+static void send_all(s32 fd, u8* buf, u32 len) {
+
+  while (len) {
+
+    s32 r = send(fd, buf, len, MSG_NOSIGNAL);
+
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      PFATAL("send() failed");
+    }
+
+    buf += r;
+    len -= r;
+
+  }
+
+}
+
+
+/* One simulated process after another, until time is up. */
+
+static void* conn_main(void* arg) {
+
+  u64 seed = (u64)(uintptr_t)arg * 0x9E3779B97F4A7C15ULL + 1;
+  u32 frame_size = LLCOV_FRAME_HDR_SIZE + LLCOV_NET_BATCH * LLCOV_VREC_MAX;
+  u8* frame = ck_alloc(frame_size);
+  u8* hdr = ck_alloc(LLCOV_FRAME_HDR_SIZE + 64);
+
+  while (!stop_soon) {
+
+    s32 fd = connect_target();
+    u32 build = seed % build_cnt, sent = 0, i;
+    u8 build_id[20] = { 0 };
+    u8* p;
+
+    /* HELLO with a synthetic 20 byte build id */
+
+    llcov_put_u32(build_id, build);
+    send_all(fd, hdr, llcov_put_hello(hdr, getpid(), build_id, 20));
+
+    for (i = 0; i < file_cnt; i++) {
+
+      u8 name[64];
+      u32 len = sprintf((char*)name, "src/module%u/file%u.cpp", i % 37, i);
+
+      p = hdr + llcov_put_frame_hdr(hdr, LLCOV_FR_STRING, 4 + len);
+      llcov_put_u32(p, i);
+      memcpy(p + 4, name, len);
+      send_all(fd, hdr, LLCOV_FRAME_HDR_SIZE + 4 + len);
+
+    }
+
+    while (!stop_soon && sent < proc_recs) {
+
+      u32 n = MIN((u32)LLCOV_NET_BATCH, proc_recs - sent);
+      struct llcov_vstate st = { 0, 0 };
+
+      p = frame + LLCOV_FRAME_HDR_SIZE;
+
+      for (i = 0; i < n; i++) {
+
+        u32 id, line;
+
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        id   = (seed >> 8) % file_cnt;
+        line = (seed >> 32) % line_cnt;
+
+        if (use_vblocks)
+          p += llcov_put_vrec(p, &st, id, line, seed & 3);
+        else
+          p += llcov_put_rec(p, id, line, seed & 3);
+
+      }
+
+      llcov_put_frame_hdr(frame, use_vblocks ? LLCOV_FR_VBLOCKS : LLCOV_FR_BLOCKS,
+                          p - frame - LLCOV_FRAME_HDR_SIZE);
+      send_all(fd, frame, p - frame);
+      sent += n;
+
+    }
+
+    close(fd);
+
+    __atomic_fetch_add(&total_recs, sent, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_conns, 1, __ATOMIC_RELAXED);
+
+  }
+
+  ck_free(frame);
+  ck_free(hdr);
+
+  return NULL;
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] target\n\n"
+
+       "Target is either host[:port] or unix:/path/to/socket.\n\n"
+
+       "Options:\n\n"
+
+       "  -c n          - concurrent connections (default: %u)\n"
+       "  -d secs       - run time (default: %u)\n"
+       "  -f n          - file names per build (default: %u)\n"
+       "  -l n          - lines per file (default: %u)\n"
+       "  -b n          - distinct build ids (default: %u)\n"
+       "  -r n          - records per simulated process (default: %u)\n"
+       "  -V            - send varint-encoded VBLOCKS frames\n\n",
+
+       argv0, conn_cnt, duration, file_cnt, line_cnt, build_cnt, proc_recs);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  pthread_t* threads;
+  s32 opt;
+  u32 i;
+  u64 start, us;
+
+  SAYF(cCYA "llcov-loadgen " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+c:d:f:l:b:r:V")) > 0)
+
+    switch (opt) {
+
+      case 'c': conn_cnt  = atoi(optarg); break;
+      case 'd': duration  = atoi(optarg); break;
+      case 'f': file_cnt  = atoi(optarg); break;
+      case 'l': line_cnt  = atoi(optarg); break;
+      case 'b': build_cnt = atoi(optarg); break;
+      case 'r': proc_recs = atoi(optarg); break;
+      case 'V': use_vblocks = 1; break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind != argc - 1) usage((u8*)argv[0]);
+
+  if (!conn_cnt || !duration || !file_cnt || !line_cnt || !build_cnt || !proc_recs)
+    FATAL("All numeric options must be non-zero");
+
+  target  = (u8*)argv[optind];
+  threads = ck_alloc(conn_cnt * sizeof(pthread_t));
+
+  ACTF("Running %u connections against '%s' for %u seconds...", conn_cnt,
+       target, duration);
+
+  start = get_cur_time_us();
+
+  for (i = 0; i < conn_cnt; i++)
+    if (pthread_create(&threads[i], NULL, conn_main, (void*)(uintptr_t)(i + 1)))
+      FATAL("Unable to start thread");
+
+  sleep(duration);
+  stop_soon = 1;
+
+  for (i = 0; i < conn_cnt; i++) pthread_join(threads[i], NULL);
+
+  us = get_cur_time_us() - start;
+
+  OKF("Sent %llu records over %llu connections in %.2f s: %.0f records/s",
+      total_recs, total_conns, us / 1e6, total_recs * 1e6 / us);
+
+  return 0;
+
+}
@@ -0,0 +1,196 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Small, dependency-free LZ77 compressor producing the LZ4 block format
+  (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md), used to
+  compress whole chunks of frames on the writer side (LLCOV_FR_LZ).
+
+  The compressor is a greedy single-probe hash matcher, which is all LZ4
+  does at its default level too. The decompressor checks every length
+  and offset against the buffers, so it is safe on untrusted input.
+ */
+
+#ifndef _HAVE_LLCOV_LZ_H
+#define _HAVE_LLCOV_LZ_H
+
+#include <string.h>
+
+#include "types.h"
+
+#define LLCOV_LZ_HASH_BITS  12
+#define LLCOV_LZ_HASH_SIZE  (1 << LLCOV_LZ_HASH_BITS)
+
+/* Worst case output size for len bytes of input */
+
+#define LLCOV_LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+#define LLCOV_LZ_MIN_MATCH  4
+#define LLCOV_LZ_LAST_LITS  5   /* The block ends with this many literals */
+#define LLCOV_LZ_MF_LIMIT   12  /* No match may start closer to the end   */
+
+static inline u32 llcov_lz_read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline u32 llcov_lz_hash(u32 v) {
+  return (v * 2654435761U) >> (32 - LLCOV_LZ_HASH_BITS);
+}
+
+static inline u8* llcov_lz_put_len(u8* op, u32 len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+  return op;
+}
+
+/* Compress len bytes from src into dst (at least LLCOV_LZ_BOUND(len) bytes).
+   htab is scratch space of LLCOV_LZ_HASH_SIZE entries. Returns the
+   compressed size. */
+
+static inline u32 llcov_lz_compress(const u8* src, u32 len, u8* dst, u32* htab) {
+
+  const u8* ip = src;
+  const u8* anchor = src;
+  const u8* end = src + len;
+  const u8* mflimit = len > LLCOV_LZ_MF_LIMIT ? end - LLCOV_LZ_MF_LIMIT : src;
+  u8* op = dst;
+
+  memset(htab, 0, LLCOV_LZ_HASH_SIZE * sizeof(u32));
+
+  /* Positions are stored +1, so that 0 means empty */
+
+  while (ip < mflimit) {
+
+    u32 h = llcov_lz_hash(llcov_lz_read32(ip));
+    const u8* ref = htab[h] ? src + htab[h] - 1 : NULL;
+    const u8* mend;
+    u32 lits, mlen;
+    u8* token;
+
+    htab[h] = ip - src + 1;
+
+    if (!ref || ip - ref > 0xffff || llcov_lz_read32(ref) != llcov_lz_read32(ip)) {
+      ip++;
+      continue;
+    }
+
+    /* Extend backwards over pending literals, then forwards */
+
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      ip--;
+      ref--;
+    }
+
+    mend = ip + LLCOV_LZ_MIN_MATCH;
+    while (mend < end - LLCOV_LZ_LAST_LITS && *mend == ref[mend - ip]) mend++;
+
+    lits  = ip - anchor;
+    mlen  = mend - ip - LLCOV_LZ_MIN_MATCH;
+    token = op++;
+
+    *token = (lits >= 15 ? 15 : lits) << 4 | (mlen >= 15 ? 15 : mlen);
+    if (lits >= 15) op = llcov_lz_put_len(op, lits - 15);
+
+    memcpy(op, anchor, lits);
+    op += lits;
+
+    op[0] = (ip - ref) & 0xff;
+    op[1] = (ip - ref) >> 8;
+    op += 2;
+
+    if (mlen >= 15) op = llcov_lz_put_len(op, mlen - 15);
+
+    ip = anchor = mend;
+
+  }
+
+  /* Trailing literals */
+
+  {
+    u32 lits = end - anchor;
+
+    *op++ = (lits >= 15 ? 15 : lits) << 4;
+    if (lits >= 15) op = llcov_lz_put_len(op, lits - 15);
+
+    memcpy(op, anchor, lits);
+    op += lits;
+  }
+
+  return op - dst;
+
+}
+
+/* Decompress a block into dst (cap bytes). Returns the decompressed size,
+   or -1 if the input is corrupt or does not fit. */
+
+static inline s32 llcov_lz_decompress(const u8* src, u32 len, u8* dst, u32 cap) {
+
+  const u8* ip = src;
+  const u8* iend = src + len;
+  u8* op = dst;
+  u8* oend = dst + cap;
+
+  while (ip < iend) {
+
+    u32 token = *ip++;
+    u32 lits = token >> 4, mlen, off;
+
+    if (lits == 15) {
+      u8 b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        lits += b;
+      } while (b == 255);
+    }
+
+    if (lits > (u32)(iend - ip) || lits > (u32)(oend - op)) return -1;
+
+    memcpy(op, ip, lits);
+    ip += lits;
+    op += lits;
+
+    /* The last sequence has no match */
+
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    if (!off || off > (u32)(op - dst)) return -1;
+
+    mlen = token & 15;
+
+    if (mlen == 15) {
+      u8 b;
+      do {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        mlen += b;
+      } while (b == 255);
+    }
+
+    mlen += LLCOV_LZ_MIN_MATCH;
+    if (mlen > (u32)(oend - op)) return -1;
+
+    /* Overlapping copies are how runs are encoded, go byte by byte */
+
+    while (mlen--) {
+      *op = op[-(s32)off];
+      op++;
+    }
+
+  }
+
+  return op - dst;
+
+}
+
+#endif /* ! _HAVE_LLCOV_LZ_H */
@@ -0,0 +1,528 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  In-memory coverage map shared by the runtimes.
+
+  Every distinct block (keyed by file name pointer, line and relblock) gets
+  a dense site id the first time it is seen. Lookups go through a lock-free
+  open-addressing hash table, so probes never take a lock. All memory is
+  reserved with mmap() at initialization and only touched as the map
+  fills up; nothing is allocated afterwards.
+
+  The first hit of every site (since the last reset) is recorded in the
+  covered list, which is what snapshots, dumps and resets walk instead of
+  the whole map.
+ */
+
+#ifndef _HAVE_LLCOV_MAP_INL_H
+#define _HAVE_LLCOV_MAP_INL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "types.h"
+#include "llcov-proto.h"
+#include "llcov-lz.h"
+
+struct rt_site {
+    const char* filename;
+    const char* funcname;
+    u32 line;
+    u32 relblock;
+};
+
+static rt_site* rt_sites;       /* Dense site records, by site id        */
+static u64* rt_hash;            /* (tag << 32) | (site id + 1), 0 = free  */
+static u8* rt_hits;             /* Per-site hit flag or count, by site id */
+static u8* rt_site_flags;       /* Per-site runtime flags, survive resets */
+static u32* rt_covered;         /* Site id + 1 in order of first hit      */
+
+static u32 rt_map_size;         /* Maximum number of sites                */
+static u32 rt_hash_mask;
+static u32 rt_site_cnt;         /* Site ids handed out                    */
+static u32 rt_covered_cnt;      /* Entries in rt_covered                  */
+static u64 rt_map_full;         /* Probes lost because the map was full   */
+static bool rt_hitcounts;       /* Count hits instead of flagging them    */
+static bool rt_binary;          /* LLCOV_FORMAT=binary                    */
+static bool rt_compress;        /* LLCOV_COMPRESS, implies rt_binary      */
+
+/* rt_map_reset() and first hits appending to rt_covered exclude each other:
+   a first hit only goes ahead while no reset is running, and a reset waits
+   for the first hits in progress. */
+
+static u32 rt_appending;        /* First hits appending to rt_covered     */
+static u32 rt_resetting;        /* rt_map_reset() running                 */
+
+/* Site record (id + 1) this thread reserved but lost the insert race with,
+   reused for the next block it inserts */
+
+static __thread u32 rt_spare_site;
+
+/* Runtimes that write out of the map (snapshots) install their own reset
+   so pending data is not lost; see llcov_reset(). */
+
+static void (*rt_map_reset_hook)();
+
+/* Flags runtimes keep per site in rt_site_flags */
+
+#define RT_FLAG_REPORTED 1      /* Written by the dedup runtime           */
+#define RT_FLAG_SENT     2      /* Queued by the network runtime          */
+
+static void* rt_map_alloc(size_t len) {
+    void* p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Threads that were appending in the parent are gone in the child */
+
+static void rt_map_atfork_child() {
+    rt_appending = 0;
+    rt_resetting = 0;
+}
+
+static bool rt_map_init() {
+    const char* e = getenv("LLCOV_MAP_SIZE");
+    const char* fmt = getenv("LLCOV_FORMAT");
+    u32 size = 1U << LLCOV_MAP_SIZE_POW2;
+
+    rt_compress = getenv("LLCOV_COMPRESS") != NULL;
+    rt_binary = rt_compress || (fmt && !strcmp(fmt, "binary"));
+
+    /* LLCOV_MAP_SIZE=0 does without the map (and everything built on it)
+       in processes that cannot spare the memory */
+    if (e && !strcmp(e, "0")) return true;
+
+#ifdef RT_MAP_OPTIONAL
+    /* Runtimes that keep their own fixed-size state only set up the map
+       when asked to, or when the output goes through it */
+    if (!e && !rt_binary && !getenv("LLCOV_SNAPSHOT_SIGNAL") && !getenv("LLCOV_SNAPSHOT_INTERVAL"))
+        return true;
+#endif /* RT_MAP_OPTIONAL */
+
+    if (e && atoi(e) > 0) {
+        size = 1;
+        while (size < (u32)atoi(e) && size < (1U << 30)) size <<= 1;
+    }
+
+    rt_sites = (rt_site*)rt_map_alloc((size_t)size * sizeof(rt_site));
+    rt_hash = (u64*)rt_map_alloc((size_t)size * 2 * sizeof(u64));
+    rt_hits = (u8*)rt_map_alloc(size);
+    rt_covered = (u32*)rt_map_alloc((size_t)size * sizeof(u32));
+    rt_site_flags = (u8*)rt_map_alloc(size);
+
+    if (!rt_sites || !rt_hash || !rt_hits || !rt_covered || !rt_site_flags) return false;
+
+    rt_map_size = size;
+    rt_hash_mask = size * 2 - 1;
+    rt_hitcounts = getenv("LLCOV_HITCOUNTS") != NULL;
+
+    pthread_atfork(NULL, NULL, rt_map_atfork_child);
+    return true;
+}
+
+static inline u64 rt_map_hash(const char* filename, u32 line, u32 relblock) {
+    u64 h = (u64)(uintptr_t)filename * 0x9E3779B97F4A7C15ULL;
+    h ^= ((u64)line << 32 | relblock) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 29);
+}
+
+/* Return the site id for a block, creating it if needed. Returns -1 if
+   the map is full. */
+
+static inline s32 rt_map_lookup(const char* funcname, const char* filename, u32 line, u32 relblock) {
+    if (!rt_map_size) return -1;
+
+    u64 h = rt_map_hash(filename, line, relblock);
+    u32 tag = (u32)(h >> 32);
+    u32 i = (u32)h & rt_hash_mask;
+    u32 mine = 0;
+
+    for (u32 probes = 0; probes <= rt_hash_mask; probes++, i = (i + 1) & rt_hash_mask) {
+        u64 v = __atomic_load_n(&rt_hash[i], __ATOMIC_ACQUIRE);
+
+        if (!v) {
+            /* Not in the map yet. Fill a site record first, then publish
+               it by claiming the hash slot. */
+            if (!mine) {
+                u32 id = rt_spare_site - 1;
+
+                if (rt_spare_site) {
+                    rt_spare_site = 0;
+                } else if ((id = __atomic_fetch_add(&rt_site_cnt, 1, __ATOMIC_RELAXED)) >= rt_map_size) {
+                    __atomic_fetch_add(&rt_map_full, 1, __ATOMIC_RELAXED);
+                    return -1;
+                }
+                rt_sites[id].funcname = funcname;
+                rt_sites[id].line = line;
+                rt_sites[id].relblock = relblock;
+                __atomic_store_n(&rt_sites[id].filename, filename, __ATOMIC_RELEASE);
+                mine = id + 1;
+            }
+
+            u64 want = (u64)tag << 32 | mine;
+            if (__atomic_compare_exchange_n(&rt_hash[i], &v, want, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                return mine - 1;
+
+            /* Lost the race for this slot, look at what got there */
+        }
+
+        if ((u32)(v >> 32) != tag) continue;
+
+        rt_site* s = &rt_sites[(u32)v - 1];
+        if (s->filename == filename && s->line == line && s->relblock == relblock) {
+            /* Somebody else inserted the same block concurrently. Our own
+               site record (if any) is hidden again and kept for the next
+               insert of this thread. */
+            if (mine) {
+                __atomic_store_n(&rt_sites[mine - 1].filename, (const char*)NULL, __ATOMIC_RELEASE);
+                rt_spare_site = mine;
+            }
+            return (u32)v - 1;
+        }
+    }
+
+    __atomic_fetch_add(&rt_map_full, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/* First hit of a site since the last reset: flag it and append it to the
+   covered list, unless a reset is running. The hit is not counted then,
+   but the flag stays clear as well, so the next hit gets another go; the
+   probe never waits (it may be running in a signal handler that
+   interrupted the reset). */
+
+static bool rt_map_first_hit(s32 id) {
+    bool first = false;
+
+    __atomic_fetch_add(&rt_appending, 1, __ATOMIC_SEQ_CST);
+
+    if (!__atomic_load_n(&rt_resetting, __ATOMIC_SEQ_CST) &&
+        !__atomic_exchange_n(&rt_hits[id], 1, __ATOMIC_RELAXED)) {
+        u32 idx = __atomic_fetch_add(&rt_covered_cnt, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rt_covered[idx], (u32)id + 1, __ATOMIC_RELEASE);
+        first = true;
+    }
+
+    __atomic_fetch_sub(&rt_appending, 1, __ATOMIC_RELEASE);
+    return first;
+}
+
+/* Record a hit of a site returned by rt_map_lookup(). Returns true if this
+   was the first hit of the block since the last reset. Hit counts are
+   bumped without atomics; losing the odd concurrent increment does not
+   matter once counts are bucketed. */
+
+static inline bool rt_map_mark(s32 id) {
+    if (id < 0) return false;
+
+    u8 v = __atomic_load_n(&rt_hits[id], __ATOMIC_RELAXED);
+    if (v) {
+        if (rt_hitcounts && v != 255) __atomic_store_n(&rt_hits[id], v + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    return rt_map_first_hit(id);
+}
+
+static inline bool rt_map_hit(const char* funcname, const char* filename, u32 line, u32 relblock) {
+    return rt_map_mark(rt_map_lookup(funcname, filename, line, relblock));
+}
+
+/* Forget all hits, touching only the sites hit since the last reset.
+   Probes running concurrently may or may not be counted, but every site
+   flagged afterwards is on the covered list. */
+
+static void rt_map_reset() {
+    while (__atomic_exchange_n(&rt_resetting, 1, __ATOMIC_SEQ_CST)) sched_yield();
+    while (__atomic_load_n(&rt_appending, __ATOMIC_SEQ_CST)) sched_yield();
+
+    u32 cnt = __atomic_load_n(&rt_covered_cnt, __ATOMIC_ACQUIRE);
+
+    for (u32 i = 0; i < cnt; i++) {
+        u32 v = __atomic_exchange_n(&rt_covered[i], 0, __ATOMIC_RELAXED);
+        if (v) __atomic_store_n(&rt_hits[v - 1], 0, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&rt_covered_cnt, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rt_resetting, 0, __ATOMIC_RELEASE);
+}
+
+/* Record formatting sticks to what is safe in a signal handler, so the
+   crash handler can use it, and is cheaper than printf anyway. */
+
+static inline u32 rt_fmt_u32(char* out, u32 v) {
+    char tmp[10];
+    u32 n = 0, i;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    for (i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+    return n;
+}
+
+/* " line:%u relblock:%u\n", at most 41 bytes. */
+
+static inline u32 rt_fmt_tail(char* out, u32 line, u32 relblock) {
+    u32 n;
+
+    memcpy(out, " line:", 6);
+    n = 6 + rt_fmt_u32(out + 6, line);
+    memcpy(out + n, " relblock:", 10);
+    n += 10;
+    n += rt_fmt_u32(out + n, relblock);
+    out[n++] = '\n';
+    return n;
+}
+
+/* Write one record in the text format. The whole line goes out in one
+   system call, which O_APPEND makes atomic with respect to other writers
+   of the file. */
+
+static void rt_write_rec(int fd, const char* filename, uint32_t line, uint32_t relblock) {
+    char tail[48];
+    struct iovec iov[3];
+
+    iov[0].iov_base = (void*)"file:";
+    iov[0].iov_len = 5;
+    iov[1].iov_base = (void*)filename;
+    iov[1].iov_len = strlen(filename);
+    iov[2].iov_base = tail;
+    iov[2].iov_len = rt_fmt_tail(tail, line, relblock);
+
+    while (writev(fd, iov, 3) < 0 && errno == EINTR);
+}
+
+static bool rt_write_all(int fd, const char* buf, u32 len) {
+    while (len) {
+        ssize_t r = write(fd, buf, len);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+/* Binary output (llcov-proto.h). Every chunk is self-contained: a HELLO,
+   the STRING frames it needs and one VBLOCKS frame, written with a single
+   writev() so chunks of different processes sharing a file do not mix.
+
+   buf is split into a table mapping file name pointers to string ids, an
+   area for HELLO and STRING frames and one for the VBLOCKS frame. With
+   LLCOV_COMPRESS, snapshots wrap each chunk into one LZ frame instead. */
+
+struct rt_bin_ent {
+    const char* ptr;
+    u32 id;
+};
+
+struct rt_bin_chunk {
+    rt_bin_ent* tab;
+    u32 tab_size;
+    u32 nstr;
+    u8* sbuf;                   /* HELLO and STRING frames */
+    u32 slen, scap;
+    u8* rbuf;                   /* VBLOCKS frame           */
+    u32 rlen, rcap;
+    u32 nrec;
+    llcov_vstate st;
+    bool compress;
+};
+
+/* Compression scratch, only used by snapshots (under their lock) */
+
+static u32 rt_lz_htab[LLCOV_LZ_HASH_SIZE];
+static u8 rt_lz_out[LLCOV_FRAME_HDR_SIZE + 4 + LLCOV_LZ_BOUND(LLCOV_SNAP_BUF)];
+
+static void rt_bin_start(rt_bin_chunk* c) {
+    memset(c->tab, 0, c->tab_size * sizeof(rt_bin_ent));
+    c->nstr = c->nrec = 0;
+    c->slen = llcov_put_hello(c->sbuf, getpid(), NULL, 0);
+    c->rlen = LLCOV_FRAME_HDR_SIZE;
+    c->st.file_id = c->st.line = 0;
+}
+
+/* String id for a file name, adding a STRING frame if needed. Returns 0
+   if the chunk has no room for it. */
+
+static u32 rt_bin_string(rt_bin_chunk* c, const char* filename) {
+    u32 i = (u32)((uintptr_t)filename >> 3) & (c->tab_size - 1);
+
+    while (c->tab[i].ptr) {
+        if (c->tab[i].ptr == filename) return c->tab[i].id;
+        i = (i + 1) & (c->tab_size - 1);
+    }
+
+    u32 flen = strlen(filename);
+    if (c->nstr >= c->tab_size / 2 || c->slen + LLCOV_FRAME_HDR_SIZE + 4 + flen > c->scap) return 0;
+
+    c->tab[i].ptr = filename;
+    c->tab[i].id = ++c->nstr;
+
+    c->slen += llcov_put_frame_hdr(c->sbuf + c->slen, LLCOV_FR_STRING, 4 + flen);
+    llcov_put_u32(c->sbuf + c->slen, c->nstr);
+    memcpy(c->sbuf + c->slen + 4, filename, flen);
+    c->slen += 4 + flen;
+
+    return c->nstr;
+}
+
+static bool rt_bin_flush(rt_bin_chunk* c, int fd) {
+    struct iovec iov[2];
+
+    if (!c->nrec) return true;
+
+    llcov_put_frame_hdr(c->rbuf, LLCOV_FR_VBLOCKS, c->rlen - LLCOV_FRAME_HDR_SIZE);
+    iov[0].iov_base = c->sbuf;
+    iov[0].iov_len = c->slen;
+    iov[1].iov_base = c->rbuf;
+    iov[1].iov_len = c->rlen;
+
+    if (c->compress) {
+        /* Make the chunk contiguous and wrap it in a single LZ frame */
+        u32 raw = c->slen + c->rlen;
+
+        memmove(c->sbuf + c->slen, c->rbuf, c->rlen);
+
+        u32 zlen = llcov_lz_compress(c->sbuf, raw, rt_lz_out + LLCOV_FRAME_HDR_SIZE + 4, rt_lz_htab);
+
+        if (zlen + 4 < raw) {
+            llcov_put_frame_hdr(rt_lz_out, LLCOV_FR_LZ, 4 + zlen);
+            llcov_put_u32(rt_lz_out + LLCOV_FRAME_HDR_SIZE, raw);
+            iov[0].iov_base = rt_lz_out;
+            iov[0].iov_len = LLCOV_FRAME_HDR_SIZE + 4 + zlen;
+            iov[1].iov_len = 0;
+        } else {
+            iov[0].iov_len = raw;
+            iov[1].iov_len = 0;
+        }
+    }
+
+    /* Regular files take this in one piece */
+    ssize_t r;
+    while ((r = writev(fd, iov, 2)) < 0 && errno == EINTR);
+
+    rt_bin_start(c);
+    return r >= 0;
+}
+
+static s64 rt_map_write_bin(int fd, u32* pos, char* buf, u32 size, bool compress) {
+    rt_bin_chunk c;
+    s64 cnt = 0;
+
+    c.compress = compress && size <= LLCOV_SNAP_BUF;
+
+    c.tab = (rt_bin_ent*)(((uintptr_t)buf + 15) & ~(uintptr_t)15);
+    size -= (char*)c.tab - buf;
+
+    c.tab_size = 16;
+    while (c.tab_size * 2 * sizeof(rt_bin_ent) <= size / 4) c.tab_size *= 2;
+
+    c.sbuf = (u8*)(c.tab + c.tab_size);
+    c.scap = c.rcap = (size - c.tab_size * sizeof(rt_bin_ent)) / 2;
+    c.rbuf = c.sbuf + c.scap;
+
+    rt_bin_start(&c);
+
+    while (*pos < __atomic_load_n(&rt_covered_cnt, __ATOMIC_ACQUIRE)) {
+        u32 v = __atomic_load_n(&rt_covered[*pos], __ATOMIC_ACQUIRE);
+
+        /* Reserved but not filled in yet, pick it up next time */
+        if (!v) break;
+
+        rt_site* s = &rt_sites[v - 1];
+        u32 id = rt_bin_string(&c, s->filename);
+
+        if (!id || c.rlen + LLCOV_VREC_MAX > c.rcap) {
+            if (!c.nrec) {
+                /* Name too long for the buffer, cannot be written */
+                (*pos)++;
+                continue;
+            }
+
+            cnt += c.nrec;
+            if (!rt_bin_flush(&c, fd)) return -1;
+            continue;
+        }
+
+        c.rlen += llcov_put_vrec(c.rbuf + c.rlen, &c.st, id, s->line, s->relblock);
+        c.nrec++;
+        (*pos)++;
+    }
+
+    cnt += c.nrec;
+    if (!rt_bin_flush(&c, fd)) return -1;
+    return cnt;
+}
+
+/* Text version of rt_map_write(), whatever LLCOV_FORMAT says. */
+
+static s64 rt_map_write_text(int fd, u32* pos, char* buf, u32 size) {
+    u32 len = 0;
+    s64 cnt = 0;
+
+    while (*pos < __atomic_load_n(&rt_covered_cnt, __ATOMIC_ACQUIRE)) {
+        u32 v = __atomic_load_n(&rt_covered[*pos], __ATOMIC_ACQUIRE);
+
+        /* Reserved but not filled in yet, pick it up next time */
+        if (!v) break;
+
+        rt_site* s = &rt_sites[v - 1];
+        u32 avail = size - len;
+        u32 flen = strlen(s->filename);
+        u32 n = 5 + flen + 48;
+
+        if (n <= avail) {
+            memcpy(buf + len, "file:", 5);
+            memcpy(buf + len + 5, s->filename, flen);
+            n = 5 + flen + rt_fmt_tail(buf + len + 5 + flen, s->line, s->relblock);
+        }
+
+        if (n > avail) {
+            if (len) {
+                if (!rt_write_all(fd, buf, len)) return -1;
+                len = 0;
+                continue;
+            }
+            /* Does not even fit into an empty buffer */
+            rt_write_rec(fd, s->filename, s->line, s->relblock);
+        } else {
+            len += n;
+        }
+
+        (*pos)++;
+        cnt++;
+    }
+
+    if (len && !rt_write_all(fd, buf, len)) return -1;
+    return cnt;
+}
+
+/* Write the covered list from *pos onwards to fd, advancing *pos, in the
+   LLCOV_FORMAT of the output file. Records are collected in buf and
+   written in chunks of complete lines. Returns the number of records
+   written or -1 on error. Async-signal-safe unless compress is set, which
+   only the snapshot writer does. */
+
+static inline s64 rt_map_write(int fd, u32* pos, char* buf, u32 size, bool compress) {
+    if (rt_binary) return rt_map_write_bin(fd, pos, buf, size, compress && rt_compress);
+    return rt_map_write_text(fd, pos, buf, size);
+}
+
+#endif /* ! _HAVE_LLCOV_MAP_INL_H */
@@ -0,0 +1,1195 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Merges many coverage outputs ("shards") into one.
+
+  Every input is memory-mapped and may be text, binary or compressed
+  binary output, or a captured network stream. Each distinct block
+  (file, line, relblock) is interned into a dense id, so that coverage of
+  one shard is just a bitmap over these ids. Workers pull shards from a
+  shared queue, largest first, and fold the bitmap of every finished shard
+  into their own with SIMD ORs; the per-worker bitmaps are ORed together
+  at the end.
+
+  Besides the merged output, a per-shard report can be written that lists
+  how many distinct blocks each shard covered and how many of them no
+  other shard covered (its unique contribution). This is handy to prune
+  a corpus or to find out which test suites still pull their weight.
+
+  Shards of a build without LLCOV_STABLE_IDS can be translated to stable
+  block ids on the way in, using the build's instrumentation manifests
+  (LLCOV_LOGINSTFILE). Their output can then be merged with that of other
+  builds, even if the relblocks changed in between.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-proto.h"
+#include "llcov-lz.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define MERGE_X86 1
+#endif
+
+#define KSHARDS      256              /* Block table shards               */
+#define FSHARDS      64               /* File name table shards           */
+#define ID_PAGE_BITS 16               /* Ids per lazily allocated page    */
+#define ID_PAGE      (1 << ID_PAGE_BITS)
+#define ID_PAGES     (1 << 16)
+#define CACHE_SIZE   (1 << 16)        /* Per-worker key -> id cache       */
+
+/* Blocks are keyed by a packed u64: file id, line and relblock. PC
+   records (line 0, see llcov-pc-inl.h) carry a 32-bit object offset as
+   relblock, which takes the line bits as well and is flagged with KEY_PC.
+   The top bit marks used slots in the hash tables. */
+
+#define KEY_FILE_BITS 22
+#define KEY_LINE_BITS 24
+#define KEY_REL_BITS  16
+#define KEY_PC        (1ULL << (KEY_LINE_BITS + KEY_REL_BITS))
+#define KEY_FILE_SHIFT (KEY_LINE_BITS + KEY_REL_BITS + 1)
+#define KEY_USED      (1ULL << 63)
+
+#define OWNER_MULTI  0xFFFFFFFF       /* Covered by more than one shard   */
+#define XLATE_NONE   0xFFFFFFFF       /* Not in manifests, or ambiguous   */
+
+struct shard {
+  u8* path;
+  u64 size;
+  u64 recs;                           /* Records read                     */
+  u32 distinct;                       /* Distinct blocks covered          */
+  u32 unique;                         /* ... that no other shard covered  */
+  u32 bad;                            /* Malformed lines or frames        */
+  u32 untranslated;                   /* Records not found in manifests   */
+};
+
+struct key_shard {
+  pthread_mutex_t lock;
+  u64* keys;
+  u32* ids;
+  u32 size, cnt;
+};
+
+struct fname {
+  u8* name;
+  u32 len;
+  u64 hash;
+  u32 id;
+};
+
+struct fname_shard {
+  pthread_mutex_t lock;
+  struct fname** tab;
+  u32 size, cnt;
+};
+
+struct id_page {
+  u64 key[ID_PAGE];                   /* Id -> packed key                 */
+  u32 owner[ID_PAGE];                 /* 0, shard + 1 or OWNER_MULTI      */
+};
+
+struct worker {
+  pthread_t thread;
+  u64* bm;                            /* Union of all shards seen         */
+  u32  bm_words;
+  u64* sbm;                           /* Blocks of the current shard      */
+  u32  sbm_words, lo, hi;
+  u64* cache_key;
+  u32* cache_id;
+  u32* smap;                          /* Stream string id -> file id      */
+  u32  smap_alloc;
+  u8*  zbuf;
+  u32  last_file;                     /* Text: file id of the last line   */
+  const u8* last_name;
+  u32  last_len;
+};
+
+static struct shard* shards;
+static u32* order;                    /* Shard indices, largest first     */
+static u32  shard_cnt, next_shard;
+
+static struct key_shard kshards[KSHARDS];
+static struct fname_shard fshards[FSHARDS];
+static struct id_page* id_pages[ID_PAGES];
+static u32 next_id;
+
+static struct fname** files;          /* File id -> name                  */
+static u32 file_cnt, files_alloc;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct key_shard xlate;        /* Block key -> stable id (-m)      */
+
+static u8 out_binary;
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+}
+
+
+static inline u64 hash64(u64 x) {
+
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCDULL;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53ULL;
+  x ^= x >> 33;
+  return x;
+
+}
+
+
+static inline u64 hash_str(const u8* p, u32 len) {
+
+  u64 h = 0xCBF29CE484222325ULL;
+
+  while (len--) h = (h ^ *p++) * 0x100000001B3ULL;
+  return hash64(h);
+
+}
+
+
+static inline u64 pack_key(u32 file, u32 line, u32 rel) {
+
+  if (!line) return ((u64)file << KEY_FILE_SHIFT) | KEY_PC | rel;
+
+  return ((u64)file << KEY_FILE_SHIFT) | ((u64)line << KEY_REL_BITS) | rel;
+
+}
+
+
+static inline void unpack_key(u64 key, u32* line, u32* rel) {
+
+  if (key & KEY_PC) {
+    *line = 0;
+    *rel  = (u32)key;
+  } else {
+    *line = (key >> KEY_REL_BITS) & ((1 << KEY_LINE_BITS) - 1);
+    *rel  = key & ((1 << KEY_REL_BITS) - 1);
+  }
+
+}
+
+
+/* dst |= src over n words. */
+
+static void or_words_scalar(u64* dst, const u64* src, u32 n) {
+
+  u32 i;
+
+  for (i = 0; i < n; i++) dst[i] |= src[i];
+
+}
+
+#ifdef MERGE_X86
+
+__attribute__((target("sse2")))
+static void or_words_sse2(u64* dst, const u64* src, u32 n) {
+
+  u32 i = 0;
+
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(a, b));
+  }
+
+  or_words_scalar(dst + i, src + i, n - i);
+
+}
+
+
+__attribute__((target("avx2")))
+static void or_words_avx2(u64* dst, const u64* src, u32 n) {
+
+  u32 i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i a0 = _mm256_loadu_si256((__m256i*)(dst + i));
+    __m256i a1 = _mm256_loadu_si256((__m256i*)(dst + i + 4));
+    __m256i b0 = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i b1 = _mm256_loadu_si256((const __m256i*)(src + i + 4));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(a0, b0));
+    _mm256_storeu_si256((__m256i*)(dst + i + 4), _mm256_or_si256(a1, b1));
+  }
+
+  or_words_scalar(dst + i, src + i, n - i);
+
+}
+
+#endif /* MERGE_X86 */
+
+static void (*or_words)(u64* dst, const u64* src, u32 n) = or_words_scalar;
+
+
+static void pick_or_words(void) {
+
+#ifdef MERGE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) or_words = or_words_avx2;
+  else if (__builtin_cpu_supports("sse2")) or_words = or_words_sse2;
+#endif
+
+}
+
+
+/* Grow a bitmap to hold at least 'words' words, doubling. */
+
+static void grow_bm(u64** bm, u32* cur, u32 words) {
+
+  u32 n = MAX(*cur, 1024);
+
+  if (words <= *cur) return;
+  while (n < words) n *= 2;
+
+  *bm  = ck_realloc(*bm, n * sizeof(u64));
+  *cur = n;
+
+}
+
+
+static struct id_page* get_page(u32 id) {
+
+  struct id_page** slot = &id_pages[id >> ID_PAGE_BITS];
+  struct id_page* p = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  struct id_page* exp = NULL;
+
+  if (p) return p;
+
+  p = ck_alloc(sizeof(struct id_page));
+
+  if (!__atomic_compare_exchange_n(slot, &exp, p, 0, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    ck_free(p);
+    p = exp;
+  }
+
+  return p;
+
+}
+
+
+static void grow_kshard(struct key_shard* ks) {
+
+  u32 size = ks->size ? ks->size * 2 : 1024, i;
+  u64* keys = ck_alloc(size * sizeof(u64));
+  u32* ids  = ck_alloc(size * sizeof(u32));
+
+  for (i = 0; i < ks->size; i++) {
+
+    u32 pos;
+
+    if (!ks->keys[i]) continue;
+
+    pos = (hash64(ks->keys[i] & ~KEY_USED) >> 8) & (size - 1);
+    while (keys[pos]) pos = (pos + 1) & (size - 1);
+
+    keys[pos] = ks->keys[i];
+    ids[pos]  = ks->ids[i];
+
+  }
+
+  ck_free(ks->keys);
+  ck_free(ks->ids);
+
+  ks->keys = keys;
+  ks->ids  = ids;
+  ks->size = size;
+
+}
+
+
+/* Block key -> dense id, assigning a new id on first sight. */
+
+static u32 intern_key(u64 key, u64 h) {
+
+  struct key_shard* ks = &kshards[h & (KSHARDS - 1)];
+  u64 tag = key | KEY_USED;
+  u32 pos, id;
+
+  pthread_mutex_lock(&ks->lock);
+
+  if (ks->cnt * 2 >= ks->size) grow_kshard(ks);
+
+  pos = (h >> 8) & (ks->size - 1);
+
+  while (ks->keys[pos]) {
+
+    if (ks->keys[pos] == tag) {
+      id = ks->ids[pos];
+      pthread_mutex_unlock(&ks->lock);
+      return id;
+    }
+
+    pos = (pos + 1) & (ks->size - 1);
+
+  }
+
+  id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+  if (id == OWNER_MULTI) FATAL("Too many distinct blocks");
+
+  get_page(id)->key[id & (ID_PAGE - 1)] = key;
+
+  ks->keys[pos] = tag;
+  ks->ids[pos]  = id;
+  ks->cnt++;
+
+  pthread_mutex_unlock(&ks->lock);
+
+  return id;
+
+}
+
+
+/* Stable id lookup, keyed like the block table. Built before any worker
+   starts and read-only afterwards, so no locking. */
+
+static u32 find_xlate(u64 key) {
+
+  u64 tag = key | KEY_USED;
+  u32 pos = (hash64(key) >> 8) & (xlate.size - 1);
+
+  while (xlate.keys[pos]) {
+
+    if (xlate.keys[pos] == tag) return xlate.ids[pos];
+    pos = (pos + 1) & (xlate.size - 1);
+
+  }
+
+  return XLATE_NONE;
+
+}
+
+
+static void add_xlate(u64 key, u32 id) {
+
+  u64 tag = key | KEY_USED;
+  u32 pos;
+
+  if (xlate.cnt * 2 >= xlate.size) grow_kshard(&xlate);
+
+  pos = (hash64(key) >> 8) & (xlate.size - 1);
+
+  while (xlate.keys[pos]) {
+
+    /* Same block, different ids: manifests of different builds */
+
+    if (xlate.keys[pos] == tag) {
+      if (xlate.ids[pos] != id) xlate.ids[pos] = XLATE_NONE;
+      return;
+    }
+
+    pos = (pos + 1) & (xlate.size - 1);
+
+  }
+
+  xlate.keys[pos] = tag;
+  xlate.ids[pos]  = id;
+  xlate.cnt++;
+
+}
+
+
+/* File name -> file id. */
+
+static u32 intern_file(const u8* name, u32 len) {
+
+  u64 h = hash_str(name, len);
+  struct fname_shard* fs = &fshards[h & (FSHARDS - 1)];
+  struct fname* f;
+  u32 pos;
+
+  pthread_mutex_lock(&fs->lock);
+
+  if (fs->cnt * 2 >= fs->size) {
+
+    u32 size = fs->size ? fs->size * 2 : 256, i;
+    struct fname** tab = ck_alloc(size * sizeof(struct fname*));
+
+    for (i = 0; i < fs->size; i++) {
+
+      if (!fs->tab[i]) continue;
+
+      pos = (fs->tab[i]->hash >> 8) & (size - 1);
+      while (tab[pos]) pos = (pos + 1) & (size - 1);
+      tab[pos] = fs->tab[i];
+
+    }
+
+    ck_free(fs->tab);
+    fs->tab  = tab;
+    fs->size = size;
+
+  }
+
+  pos = (h >> 8) & (fs->size - 1);
+
+  while ((f = fs->tab[pos])) {
+
+    if (f->hash == h && f->len == len && !memcmp(f->name, name, len)) {
+      pthread_mutex_unlock(&fs->lock);
+      return f->id;
+    }
+
+    pos = (pos + 1) & (fs->size - 1);
+
+  }
+
+  f = ck_alloc(sizeof(struct fname));
+  f->name = ck_alloc(len + 1);
+  memcpy(f->name, name, len);
+  f->len  = len;
+  f->hash = h;
+
+  pthread_mutex_lock(&files_lock);
+
+  if (file_cnt == 1U << KEY_FILE_BITS) FATAL("Too many distinct file names");
+
+  if (file_cnt == files_alloc) {
+    files_alloc = files_alloc ? files_alloc * 2 : 1024;
+    files = ck_realloc(files, files_alloc * sizeof(struct fname*));
+  }
+
+  f->id = file_cnt;
+  files[file_cnt++] = f;
+
+  pthread_mutex_unlock(&files_lock);
+
+  fs->tab[pos] = f;
+  fs->cnt++;
+
+  pthread_mutex_unlock(&fs->lock);
+
+  return f->id;
+
+}
+
+
+/* One record of shard 'sidx'. Blocks are counted once per shard; the
+   first time a shard covers a block, the block's owner moves from "none"
+   to this shard, or from another shard to OWNER_MULTI. */
+
+static void add_rec(struct worker* w, u32 sidx, u32 file, u32 line, u32 rel) {
+
+  struct shard* s = &shards[sidx];
+  u64 key, h, bit;
+  u32 id, slot, word, *owner, cur;
+
+  s->recs++;
+
+  if (line >> KEY_LINE_BITS || (line && rel >> KEY_REL_BITS)) {
+    s->bad++;
+    return;
+  }
+
+  key  = pack_key(file, line, rel);
+
+  /* Relblock -> stable id, records that already carry one are kept. PC
+     records are not in any manifest. */
+
+  if (xlate.cnt && line && rel < LLCOV_ID_BASE) {
+
+    u32 sid = find_xlate(key);
+
+    if (sid != XLATE_NONE) key = (key & ~((1ULL << KEY_REL_BITS) - 1)) | sid;
+    else s->untranslated++;
+
+  }
+
+  h    = hash64(key);
+  slot = (h >> 32) & (CACHE_SIZE - 1);
+
+  if (w->cache_key[slot] == (key | KEY_USED)) {
+
+    id = w->cache_id[slot];
+
+  } else {
+
+    id = intern_key(key, h);
+    w->cache_key[slot] = key | KEY_USED;
+    w->cache_id[slot]  = id;
+
+  }
+
+  word = id >> 6;
+  bit  = 1ULL << (id & 63);
+
+  grow_bm(&w->sbm, &w->sbm_words, word + 1);
+
+  if (w->sbm[word] & bit) return;
+
+  w->sbm[word] |= bit;
+  w->lo = MIN(w->lo, word);
+  w->hi = MAX(w->hi, word);
+  s->distinct++;
+
+  owner = &get_page(id)->owner[id & (ID_PAGE - 1)];
+  cur   = __atomic_load_n(owner, __ATOMIC_RELAXED);
+
+  while (cur != OWNER_MULTI &&
+         !__atomic_compare_exchange_n(owner, &cur, cur ? OWNER_MULTI : sidx + 1,
+                                      0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+}
+
+
+/* Strict decimal, no sign, no spaces. */
+
+static u8 get_num(const u8* p, const u8* end, u32* out) {
+
+  u64 v = 0;
+
+  if (p == end) return 0;
+
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9') return 0;
+    v = v * 10 + (*p - '0');
+    if (v > 0xFFFFFFFF) return 0;
+  }
+
+  *out = v;
+  return 1;
+
+}
+
+
+/* file:<name> line:<line> relblock:<relblock>, parsed from the end so
+   that file names may contain spaces. */
+
+static void parse_line(struct worker* w, u32 sidx, const u8* p, const u8* end) {
+
+  const u8 *r, *l;
+  u32 line, rel;
+
+  if (end > p && end[-1] == '\r') end--;
+  if (end == p) return;
+
+  if (end - p < 5 || memcmp(p, "file:", 5)) goto bad;
+
+  r = memrchr(p, ' ', end - p);
+  if (!r || end - r < 10 || memcmp(r, " relblock:", 10) ||
+      !get_num(r + 10, end, &rel)) goto bad;
+
+  l = memrchr(p, ' ', r - p);
+  if (!l || l < p + 5 || r - l < 6 || memcmp(l, " line:", 6) ||
+      !get_num(l + 6, r, &line)) goto bad;
+
+  p += 5;
+
+  if (!w->last_name || w->last_len != l - p || memcmp(w->last_name, p, l - p)) {
+    w->last_file = intern_file(p, l - p);
+    w->last_name = p;
+    w->last_len  = l - p;
+  }
+
+  add_rec(w, sidx, w->last_file, line, rel);
+  return;
+
+bad:
+
+  shards[sidx].bad++;
+
+}
+
+
+/* Manifest line: file:<name> func:<func> line:<line> relblock:<relblock>
+   id:<id>. Returns 0 for lines without an id (older passes). */
+
+static u8 parse_manifest_line(const u8* p, const u8* end) {
+
+  const u8 *i, *r, *l, *f;
+  u32 line, rel, id;
+
+  if (end > p && end[-1] == '\r') end--;
+  if (end - p < 5 || memcmp(p, "file:", 5)) return 0;
+
+  i = memrchr(p, ' ', end - p);
+  if (!i || end - i < 4 || memcmp(i, " id:", 4) ||
+      !get_num(i + 4, end, &id)) return 0;
+
+  r = memrchr(p, ' ', i - p);
+  if (!r || i - r < 10 || memcmp(r, " relblock:", 10) ||
+      !get_num(r + 10, i, &rel)) return 0;
+
+  l = memrchr(p, ' ', r - p);
+  if (!l || r - l < 6 || memcmp(l, " line:", 6) ||
+      !get_num(l + 6, r, &line)) return 0;
+
+  f = memrchr(p, ' ', l - p);
+  if (!f || f < p + 5 || l - f < 6 || memcmp(f, " func:", 6)) return 0;
+
+  if (!line || line >> KEY_LINE_BITS || rel >> KEY_REL_BITS ||
+      id >> KEY_REL_BITS) return 0;
+
+  add_xlate(pack_key(intern_file(p + 5, f - p - 5), line, rel), id);
+
+  return 1;
+
+}
+
+
+static void load_manifest(u8* path) {
+
+  FILE* f = fopen((char*)path, "r");
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+  u32 ok = 0, skipped = 0;
+
+  if (!f) PFATAL("Unable to open '%s'", path);
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    if (buf[len - 1] == '\n') len--;
+    if (!len) continue;
+
+    if (parse_manifest_line((u8*)buf, (u8*)buf + len)) ok++;
+    else skipped++;
+
+  }
+
+  free(buf);
+  fclose(f);
+
+  if (!ok) FATAL("No block ids in '%s' (manifest of an older pass?)", path);
+
+  if (skipped)
+    WARNF("Skipped %u lines without a block id in '%s'", skipped, path);
+
+}
+
+
+static void parse_text(struct worker* w, u32 sidx, const u8* p, const u8* end) {
+
+  w->last_name = NULL;
+
+  while (p < end) {
+
+    const u8* nl = memchr(p, '\n', end - p);
+
+    if (!nl) nl = end;
+    parse_line(w, sidx, p, nl);
+    p = nl + 1;
+
+  }
+
+}
+
+
+static void map_string(struct worker* w, u32 id, const u8* p, u32 len) {
+
+  if (id >= w->smap_alloc) {
+
+    u32 n = MAX(id + 1, w->smap_alloc * 2);
+
+    w->smap = ck_realloc(w->smap, n * sizeof(u32));
+    memset(w->smap + w->smap_alloc, 0xFF, (n - w->smap_alloc) * sizeof(u32));
+    w->smap_alloc = n;
+
+  }
+
+  w->smap[id] = intern_file(p, len);
+
+}
+
+
+static inline u8 bin_rec(struct worker* w, u32 sidx, u32 id, u32 line, u32 rel) {
+
+  if (id >= w->smap_alloc || w->smap[id] == 0xFFFFFFFF) return 0;
+
+  add_rec(w, sidx, w->smap[id], line, rel);
+  return 1;
+
+}
+
+
+/* Returns 0 if the frame is malformed. */
+
+static u8 handle_frame(struct worker* w, u32 sidx, u8 type, const u8* p, u32 len) {
+
+  const u8* end = p + len;
+
+  switch (type) {
+
+    case LLCOV_FR_HELLO:
+
+      if (len < 12 || llcov_get_u32(p) != LLCOV_PROTO_MAGIC) return 0;
+      if (w->smap) memset(w->smap, 0xFF, w->smap_alloc * sizeof(u32));
+      break;
+
+    case LLCOV_FR_STRING:
+
+      if (len < 4 || llcov_get_u32(p) >= LLCOV_MAX_STRING_ID) return 0;
+      map_string(w, llcov_get_u32(p), p + 4, len - 4);
+      break;
+
+    case LLCOV_FR_BLOCKS:
+
+      if (len % LLCOV_REC_SIZE) return 0;
+
+      for (; p < end; p += LLCOV_REC_SIZE)
+        if (!bin_rec(w, sidx, llcov_get_u32(p), llcov_get_u32(p + 4),
+                     llcov_get_u32(p + 8))) return 0;
+
+      break;
+
+    case LLCOV_FR_VBLOCKS: {
+
+      struct llcov_vstate st = { 0, 0 };
+
+      while (p < end) {
+
+        u32 id, line, rel, n = llcov_get_vrec(p, end, &st, &id, &line, &rel);
+
+        if (!n || !bin_rec(w, sidx, id, line, rel)) return 0;
+        p += n;
+
+      }
+
+      break;
+
+    }
+
+    case LLCOV_FR_LZ: {
+
+      u32 raw, off = 0;
+
+      if (len < 4 || (raw = llcov_get_u32(p)) > LLCOV_MAX_FRAME) return 0;
+
+      if (!w->zbuf) w->zbuf = ck_alloc_nozero(LLCOV_MAX_FRAME);
+
+      if (llcov_lz_decompress(p + 4, len - 4, w->zbuf, raw) != (s32)raw)
+        return 0;
+
+      while (off < raw) {
+
+        s64 flen = llcov_frame_len(w->zbuf + off, raw - off);
+
+        if (flen <= 0 || w->zbuf[off] == LLCOV_FR_LZ ||
+            !handle_frame(w, sidx, w->zbuf[off], w->zbuf + off + LLCOV_FRAME_HDR_SIZE,
+                          flen - LLCOV_FRAME_HDR_SIZE)) return 0;
+
+        off += flen;
+
+      }
+
+      break;
+
+    }
+
+  }
+
+  return 1;
+
+}
+
+
+static void parse_binary(struct worker* w, u32 sidx, const u8* p, const u8* end) {
+
+  if (w->smap) memset(w->smap, 0xFF, w->smap_alloc * sizeof(u32));
+
+  while (p < end) {
+
+    s64 flen = llcov_frame_len(p, end - p);
+
+    if (flen <= 0 || !handle_frame(w, sidx, p[0], p + LLCOV_FRAME_HDR_SIZE,
+                                   flen - LLCOV_FRAME_HDR_SIZE)) {
+      shards[sidx].bad++;
+      return;
+    }
+
+    p += flen;
+
+  }
+
+}
+
+
+static void merge_shard(struct worker* w, u32 sidx) {
+
+  struct shard* s = &shards[sidx];
+  s32 fd = open((char*)s->path, O_RDONLY);
+  u8* mem;
+
+  if (fd < 0) PFATAL("Unable to open '%s'", s->path);
+
+  if (s->size) {
+
+    mem = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED) PFATAL("Unable to mmap '%s'", s->path);
+
+    madvise(mem, s->size, MADV_SEQUENTIAL);
+
+    if (mem[0] == LLCOV_FR_HELLO || mem[0] == LLCOV_FR_LZ)
+      parse_binary(w, sidx, mem, mem + s->size);
+    else
+      parse_text(w, sidx, mem, mem + s->size);
+
+    munmap(mem, s->size);
+
+  }
+
+  close(fd);
+
+  /* Fold the shard into the worker's union and clear what was touched */
+
+  if (w->lo <= w->hi) {
+
+    grow_bm(&w->bm, &w->bm_words, w->hi + 1);
+    or_words(w->bm + w->lo, w->sbm + w->lo, w->hi - w->lo + 1);
+    memset(w->sbm + w->lo, 0, (w->hi - w->lo + 1) * sizeof(u64));
+
+  }
+
+  w->lo = 0xFFFFFFFF;
+  w->hi = 0;
+
+}
+
+
+static void* worker_main(void* arg) {
+
+  struct worker* w = arg;
+
+  w->cache_key = ck_alloc(CACHE_SIZE * sizeof(u64));
+  w->cache_id  = ck_alloc(CACHE_SIZE * sizeof(u32));
+  w->lo = 0xFFFFFFFF;
+
+  for (;;) {
+
+    u32 i = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+
+    if (i >= shard_cnt) break;
+    merge_shard(w, order[i]);
+
+  }
+
+  ck_free(w->cache_key);
+  ck_free(w->cache_id);
+  ck_free(w->sbm);
+  ck_free(w->smap);
+  ck_free(w->zbuf);
+
+  return NULL;
+
+}
+
+
+static int cmp_size(const void* a, const void* b) {
+
+  u64 sa = shards[*(u32*)a].size, sb = shards[*(u32*)b].size;
+
+  return sa < sb ? 1 : sa > sb ? -1 : 0;
+
+}
+
+
+static int cmp_file(const void* a, const void* b) {
+
+  return strcmp((char*)(*(struct fname**)a)->name,
+                (char*)(*(struct fname**)b)->name);
+
+}
+
+
+static int cmp_u64(const void* a, const void* b) {
+
+  u64 x = *(u64*)a, y = *(u64*)b;
+
+  return x < y ? -1 : x > y;
+
+}
+
+
+/* Writes the blocks set in 'bm', sorted by file name, line and relblock. */
+
+static u64 write_output(FILE* f, u64* bm, u32 words) {
+
+  struct fname** sorted = ck_alloc(MAX(file_cnt, 1) * sizeof(struct fname*));
+  u32* rank = ck_alloc(MAX(file_cnt, 1) * sizeof(u32));
+  u64 *keys, cnt = 0, i;
+  u32 w;
+
+  memcpy(sorted, files, file_cnt * sizeof(struct fname*));
+  qsort(sorted, file_cnt, sizeof(struct fname*), cmp_file);
+
+  for (i = 0; i < file_cnt; i++) rank[sorted[i]->id] = i;
+
+  for (w = 0; w < words; w++) cnt += __builtin_popcountll(bm[w]);
+
+  if (cnt * sizeof(u64) > MAX_ALLOC) FATAL("Too many blocks to sort");
+  keys = ck_alloc_nozero(MAX(cnt, 1) * sizeof(u64));
+  cnt  = 0;
+
+  /* Re-key by file name rank so that a plain sort gives the final order */
+
+  for (w = 0; w < words; w++) {
+
+    u64 v = bm[w];
+
+    while (v) {
+
+      u32 id = (w << 6) | __builtin_ctzll(v);
+      u64 key = get_page(id)->key[id & (ID_PAGE - 1)];
+      u32 file = key >> KEY_FILE_SHIFT;
+
+      keys[cnt++] = ((u64)rank[file] << KEY_FILE_SHIFT) |
+                    (key & ((1ULL << KEY_FILE_SHIFT) - 1));
+      v &= v - 1;
+
+    }
+
+  }
+
+  qsort(keys, cnt, sizeof(u64), cmp_u64);
+
+  if (!out_binary) {
+
+    for (i = 0; i < cnt; i++) {
+
+      u32 line, rel;
+
+      unpack_key(keys[i], &line, &rel);
+      fprintf(f, "file:%s line:%u relblock:%u\n",
+              sorted[keys[i] >> KEY_FILE_SHIFT]->name, line, rel);
+
+    }
+
+  } else {
+
+    /* One chunk: HELLO, the file names (id = rank), then VBLOCKS frames */
+
+    u8* buf = ck_alloc(LLCOV_FRAME_HDR_SIZE + LLCOV_MAX_FRAME);
+    u8* p;
+
+    fwrite(buf, 1, llcov_put_hello(buf, 0, NULL, 0), f);
+
+    for (i = 0; i < file_cnt; i++) {
+
+      p = buf + llcov_put_frame_hdr(buf, LLCOV_FR_STRING, 4 + sorted[i]->len);
+      llcov_put_u32(p, i);
+      memcpy(p + 4, sorted[i]->name, sorted[i]->len);
+      fwrite(buf, 1, p + 4 + sorted[i]->len - buf, f);
+
+    }
+
+    for (i = 0; i < cnt; ) {
+
+      struct llcov_vstate st = { 0, 0 };
+
+      p = buf + LLCOV_FRAME_HDR_SIZE;
+
+      for (; i < cnt && p - buf + LLCOV_VREC_MAX <= LLCOV_FRAME_HDR_SIZE +
+             LLCOV_MAX_FRAME; i++) {
+
+        u32 line, rel;
+
+        unpack_key(keys[i], &line, &rel);
+        p += llcov_put_vrec(p, &st, keys[i] >> KEY_FILE_SHIFT, line, rel);
+
+      }
+
+      llcov_put_frame_hdr(buf, LLCOV_FR_VBLOCKS, p - buf - LLCOV_FRAME_HDR_SIZE);
+      fwrite(buf, 1, p - buf, f);
+
+    }
+
+    ck_free(buf);
+
+  }
+
+  ck_free(keys);
+  ck_free(rank);
+  ck_free(sorted);
+
+  return cnt;
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] shard ...\n\n"
+
+       "Shards may be text, binary or compressed binary coverage output.\n\n"
+
+       "Options:\n\n"
+
+       "  -o file       - write merged coverage to file (default: stdout)\n"
+       "  -b            - write the merged coverage in binary format\n"
+       "  -u file       - write per-shard distinct/unique block counts\n"
+       "  -m file       - translate relblocks to stable block ids using this\n"
+       "                  instrumentation manifest (may be repeated)\n"
+       "  -j n          - worker threads (default: all cores)\n\n", argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  struct worker* workers;
+  u8 *out_fn = NULL, *report_fn = NULL, **manifests = NULL;
+  FILE* out;
+  u32 thread_cnt = sysconf(_SC_NPROCESSORS_ONLN), words = 0, manifest_cnt = 0, i;
+  u64 start, total_recs = 0, merged;
+  u64* bm;
+  s32 opt;
+
+  SAYF(cCYA "llcov-merge " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+o:bu:m:j:")) > 0)
+
+    switch (opt) {
+
+      case 'o': out_fn = (u8*)optarg; break;
+      case 'b': out_binary = 1; break;
+      case 'u': report_fn = (u8*)optarg; break;
+
+      case 'm':
+        manifests = ck_realloc(manifests, (manifest_cnt + 1) * sizeof(u8*));
+        manifests[manifest_cnt++] = (u8*)optarg;
+        break;
+
+      case 'j': thread_cnt = atoi(optarg); break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind == argc) usage((u8*)argv[0]);
+  if (!thread_cnt) FATAL("Thread count must be non-zero");
+
+  shard_cnt = argc - optind;
+  shards = ck_alloc(shard_cnt * sizeof(struct shard));
+  order  = ck_alloc(shard_cnt * sizeof(u32));
+
+  for (i = 0; i < shard_cnt; i++) {
+
+    struct stat st;
+
+    shards[i].path = (u8*)argv[optind + i];
+    if (stat((char*)shards[i].path, &st)) PFATAL("Unable to stat '%s'", shards[i].path);
+
+    shards[i].size = st.st_size;
+    order[i] = i;
+
+  }
+
+  /* Big shards first, so that no worker starts a huge one at the end */
+
+  qsort(order, shard_cnt, sizeof(u32), cmp_size);
+
+  for (i = 0; i < KSHARDS; i++) pthread_mutex_init(&kshards[i].lock, NULL);
+  for (i = 0; i < FSHARDS; i++) pthread_mutex_init(&fshards[i].lock, NULL);
+
+  pick_or_words();
+
+  for (i = 0; i < manifest_cnt; i++) load_manifest(manifests[i]);
+
+  if (manifest_cnt)
+    OKF("Loaded %u block ids from %u manifests.", xlate.cnt, manifest_cnt);
+
+  thread_cnt = MIN(thread_cnt, shard_cnt);
+  workers = ck_alloc(thread_cnt * sizeof(struct worker));
+
+  ACTF("Merging %u shards with %u threads...", shard_cnt, thread_cnt);
+
+  start = get_cur_time_us();
+
+  for (i = 0; i < thread_cnt; i++)
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+      FATAL("Unable to start thread");
+
+  for (i = 0; i < thread_cnt; i++) {
+    pthread_join(workers[i].thread, NULL);
+    words = MAX(words, workers[i].bm_words);
+  }
+
+  /* OR the per-worker unions together */
+
+  bm = ck_alloc(MAX(words, 1) * sizeof(u64));
+
+  for (i = 0; i < thread_cnt; i++) {
+    if (workers[i].bm) or_words(bm, workers[i].bm, workers[i].bm_words);
+    ck_free(workers[i].bm);
+  }
+
+  /* Unique contributions */
+
+  for (i = 0; i < next_id; i++) {
+
+    u32 o = get_page(i)->owner[i & (ID_PAGE - 1)];
+
+    if (o && o != OWNER_MULTI) shards[o - 1].unique++;
+
+  }
+
+  for (i = 0; i < shard_cnt; i++) {
+
+    total_recs += shards[i].recs;
+
+    if (shards[i].bad)
+      WARNF("%u malformed lines or frames in '%s'", shards[i].bad, shards[i].path);
+
+    if (shards[i].untranslated)
+      WARNF("%u records of '%s' not in the manifests, kept as they are",
+            shards[i].untranslated, shards[i].path);
+
+  }
+
+  if (out_fn) {
+    out = fopen((char*)out_fn, "w");
+    if (!out) PFATAL("Unable to create '%s'", out_fn);
+  } else out = stdout;
+
+  merged = write_output(out, bm, words);
+
+  if (fclose(out)) PFATAL("Unable to write output");
+
+  if (report_fn) {
+
+    FILE* f = fopen((char*)report_fn, "w");
+
+    if (!f) PFATAL("Unable to create '%s'", report_fn);
+
+    fprintf(f, "# distinct\tunique\tshard\n");
+
+    for (i = 0; i < shard_cnt; i++)
+      fprintf(f, "%u\t%u\t%s\n", shards[i].distinct, shards[i].unique,
+              shards[i].path);
+
+    if (fclose(f)) PFATAL("Unable to write '%s'", report_fn);
+
+  }
+
+  OKF("Merged %llu records into %llu blocks in %.2f s.", total_recs, merged,
+      (get_cur_time_us() - start) / 1e6);
+
+  return 0;
+
+}
@@ -0,0 +1,29 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  File name matching shared by the tools that reason about lists and
+  manifests the way the pass does.
+
+  A list entry names a file by any suffix of the path the compiler saw,
+  since that may be absolute or relative to wherever the build ran. This
+  is the rule of the pass (LLCovListEntry::matchFileName); like there,
+  there is no '/' boundary, so "file.c" matches "dir/myfile.c" as well.
+ */
+
+#ifndef _HAVE_LLCOV_PATH_H
+#define _HAVE_LLCOV_PATH_H
+
+#include <string.h>
+
+#include "types.h"
+
+static inline u8 llcov_suffix_match(const u8* path, const u8* entry) {
+
+  u32 pl = strlen((char*)path), el = strlen((char*)entry);
+
+  return pl >= el && !strcmp((char*)path + pl - el, (char*)entry);
+
+}
+
+#endif /* ! _HAVE_LLCOV_PATH_H */
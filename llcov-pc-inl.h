@@ -0,0 +1,198 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  PC probes. With LLCOV_PC set at compile time, the pass emits a call of
+  llvm_llcov_pc_call() without any arguments instead of passing function
+  and file name strings, and the probe's return address identifies the
+  block. The runtime turns it into the object file it belongs to and the
+  offset from that object's load address, and records it like any other
+  block, as
+
+    file:<object path> line:0 relblock:<offset>
+
+  so that every runtime, output format and tool handles it unchanged.
+  llcov-symbolize turns these records into source locations offline.
+
+  Objects are found in a table of executable segments, built with
+  dl_iterate_phdr() on the first probe and rebuilt whenever a PC is not
+  in it (i.e. after dlopen()). Object paths keep their address across
+  rebuilds, since the map keys sites by it.
+
+  Included by llcov-api-inl.h, i.e. part of every runtime.
+ */
+
+#ifndef _HAVE_LLCOV_PC_INL_H
+#define _HAVE_LLCOV_PC_INL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "types.h"
+
+struct rt_pc_module {
+    uintptr_t start, end;       /* Executable segment                    */
+    uintptr_t base;             /* Load address, offsets are from here   */
+    const char* path;
+};
+
+struct rt_pc_table {
+    rt_pc_module* mods;
+    u32 cnt;
+};
+
+static rt_pc_table* rt_pc_mods;
+static pthread_mutex_t rt_pc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock);
+
+static const rt_pc_module* rt_pc_find(const rt_pc_table* t, uintptr_t pc) {
+    u32 lo = 0, hi = t->cnt;
+
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (pc < t->mods[mid].start)
+            hi = mid;
+        else if (pc >= t->mods[mid].end)
+            lo = mid + 1;
+        else
+            return &t->mods[mid];
+    }
+
+    return NULL;
+}
+
+static int rt_pc_count_cb(struct dl_phdr_info* info, size_t, void* data) {
+    for (u32 i = 0; i < info->dlpi_phnum; i++)
+        if (info->dlpi_phdr[i].p_type == PT_LOAD && (info->dlpi_phdr[i].p_flags & PF_X)) (*(u32*)data)++;
+    return 0;
+}
+
+struct rt_pc_scan {
+    rt_pc_table* t;
+    const rt_pc_table* old;
+    u32 max;
+};
+
+/* The main program has no name in the list */
+
+static const char* rt_pc_exe() {
+    static const char* exe;
+    char buf[PATH_MAX];
+    ssize_t len;
+
+    if (exe) return exe;
+
+    len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    buf[len > 0 ? len : 0] = 0;
+    exe = strdup(len > 0 ? buf : "<main>");
+    return exe;
+}
+
+static int rt_pc_fill_cb(struct dl_phdr_info* info, size_t, void* data) {
+    rt_pc_scan* s = (rt_pc_scan*)data;
+    const char* path = info->dlpi_name && *info->dlpi_name ? info->dlpi_name : rt_pc_exe();
+
+    for (u32 i = 0; i < info->dlpi_phnum && s->t->cnt < s->max; i++) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        rt_pc_module* m = &s->t->mods[s->t->cnt];
+
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X)) continue;
+
+        m->start = info->dlpi_addr + ph->p_vaddr;
+        m->end = m->start + ph->p_memsz;
+        m->base = info->dlpi_addr;
+        m->path = NULL;
+
+        /* Same object as before: same string */
+        const rt_pc_module* prev = s->old ? rt_pc_find(s->old, m->start) : NULL;
+        if (prev && prev->base == m->base && !strcmp(prev->path, path)) m->path = prev->path;
+        if (!m->path) m->path = path == rt_pc_exe() ? path : strdup(path);
+        if (m->path) s->t->cnt++;
+    }
+
+    return 0;
+}
+
+static int rt_pc_cmp(const void* a, const void* b) {
+    uintptr_t x = ((const rt_pc_module*)a)->start, y = ((const rt_pc_module*)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+/* Called with rt_pc_lock held. The old table stays around, probes may
+   still be looking at it. */
+
+static void rt_pc_rescan() {
+    rt_pc_scan s;
+    u32 cnt = 0;
+
+    dl_iterate_phdr(rt_pc_count_cb, &cnt);
+
+    /* Room for a few objects loaded in the meantime */
+    s.max = cnt + 16;
+    s.old = rt_pc_mods;
+    s.t = (rt_pc_table*)malloc(sizeof(rt_pc_table));
+    if (!s.t) return;
+
+    s.t->mods = (rt_pc_module*)malloc(s.max * sizeof(rt_pc_module));
+    s.t->cnt = 0;
+    if (!s.t->mods) {
+        free(s.t);
+        return;
+    }
+
+    dl_iterate_phdr(rt_pc_fill_cb, &s);
+    qsort(s.t->mods, s.t->cnt, sizeof(rt_pc_module), rt_pc_cmp);
+
+    __atomic_store_n(&rt_pc_mods, s.t, __ATOMIC_RELEASE);
+}
+
+static bool rt_pc_resolve(uintptr_t pc, const char** path, u32* offset) {
+    const rt_pc_table* t = __atomic_load_n(&rt_pc_mods, __ATOMIC_ACQUIRE);
+    const rt_pc_module* m = t ? rt_pc_find(t, pc) : NULL;
+
+    if (__builtin_expect(!m, 0)) {
+        pthread_mutex_lock(&rt_pc_lock);
+
+        t = rt_pc_mods;
+        if (!t || !(m = rt_pc_find(t, pc))) {
+            rt_pc_rescan();
+            t = rt_pc_mods;
+            m = t ? rt_pc_find(t, pc) : NULL;
+        }
+
+        pthread_mutex_unlock(&rt_pc_lock);
+        if (!m) return false;
+    }
+
+    *path = m->path;
+    *offset = (u32)(pc - m->base);
+    return true;
+}
+
+static inline void rt_pc_hit(const void* pc) {
+    const char* path;
+    u32 offset;
+
+    if (rt_pc_resolve((uintptr_t)pc, &path, &offset)) llvm_llcov_block_call("?", path, 0, offset);
+}
+
+extern "C" void llvm_llcov_pc_call() __attribute__((visibility("default"), noinline));
+
+extern "C" void llvm_llcov_pc_call() {
+    rt_pc_hit(__builtin_return_address(0));
+}
+
+/* For the static stub (llcov-rt-stub.cc), which passes its own caller */
+
+#ifdef LLCOV_SHARED
+LLCOV_API void llcov_rt_pc_hit(const void* pc) {
+    rt_pc_hit(pc);
+}
+#endif /* LLCOV_SHARED */
+
+#endif /* ! _HAVE_LLCOV_PC_INL_H */
@@ -0,0 +1,209 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Framed record format used to stream coverage off-process. The network
+  runtime writes these frames to its socket, the collector decodes them.
+  The file runtimes write the same frames with LLCOV_FORMAT=binary, and
+  llcov-decode turns them back into text.
+
+  A stream starts with a HELLO frame identifying the sending process and
+  the binary it runs. STRING frames bind a numeric id to a file name and
+  must precede any BLOCKS or VBLOCKS frame referring to that id. Ids are
+  only valid until the next HELLO (i.e. for one connection, or one chunk
+  of a file).
+
+  An LZ frame wraps a compressed sequence of other frames, which are
+  processed as if they appeared in the stream in its place.
+
+  All integers are little-endian.
+ */
+
+#ifndef _HAVE_LLCOV_PROTO_H
+#define _HAVE_LLCOV_PROTO_H
+
+#include <string.h>
+
+#include "types.h"
+
+#define LLCOV_PROTO_MAGIC    0x56434c4c /* "LLCV" */
+#define LLCOV_PROTO_VERSION  3  /* 2: LLCOV_FR_VBLOCKS, 3: LLCOV_FR_LZ */
+
+/* Frame types */
+
+#define LLCOV_FR_HELLO       1  /* u32 magic, u16 version, u16 id_len,
+                                   u32 pid, u8 build_id[id_len]        */
+#define LLCOV_FR_STRING      2  /* u32 id, u8 str[len - 4]             */
+#define LLCOV_FR_BLOCKS      3  /* llcov_rec[len / LLCOV_REC_SIZE]     */
+#define LLCOV_FR_STATS       4  /* u64 dropped, u64 sent               */
+#define LLCOV_FR_VBLOCKS     5  /* Varint records, see llcov_put_vrec() */
+#define LLCOV_FR_LZ          6  /* u32 raw_len, LZ4 block (llcov-lz.h)
+                                   holding complete frames             */
+
+/* Every frame starts with this header, followed by 'len' payload bytes */
+
+#define LLCOV_FRAME_HDR_SIZE 8
+
+/* Upper bound for a single frame, anything larger is a broken stream */
+
+#define LLCOV_MAX_FRAME      (1 << 20)
+
+/* Fixed-size block record as carried in LLCOV_FR_BLOCKS */
+
+#define LLCOV_REC_SIZE       12
+
+/* Upper bound for one record in LLCOV_FR_VBLOCKS */
+
+#define LLCOV_VREC_MAX       15
+
+/* Size of a HELLO frame carrying a build id of id_len bytes */
+
+#define LLCOV_HELLO_SIZE(id_len) (LLCOV_FRAME_HDR_SIZE + 12 + (id_len))
+
+/* Maximum length of a build id we are willing to carry */
+
+#define LLCOV_MAX_BUILD_ID   64
+
+/* String ids are handed out densely from zero, so anything at or above
+   this (16M distinct file names) is a broken stream */
+
+#define LLCOV_MAX_STRING_ID  (1 << 24)
+
+static inline void llcov_put_u16(u8* p, u16 v) {
+  p[0] = v; p[1] = v >> 8;
+}
+
+static inline void llcov_put_u32(u8* p, u32 v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void llcov_put_u64(u8* p, u64 v) {
+  llcov_put_u32(p, (u32)v); llcov_put_u32(p + 4, (u32)(v >> 32));
+}
+
+static inline u16 llcov_get_u16(const u8* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline u32 llcov_get_u32(const u8* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u64 llcov_get_u64(const u8* p) {
+  return llcov_get_u32(p) | ((u64)llcov_get_u32(p + 4) << 32);
+}
+
+/* Write a frame header to p, returns the number of bytes used. */
+
+static inline u32 llcov_put_frame_hdr(u8* p, u8 type, u32 len) {
+  p[0] = type; p[1] = 0; p[2] = 0; p[3] = 0;
+  llcov_put_u32(p + 4, len);
+  return LLCOV_FRAME_HDR_SIZE;
+}
+
+/* Look at the frame at the start of buf. Returns the total size of the
+   frame if it is complete, 0 if more data is needed and -1 if this cannot
+   be a valid frame (i.e. the stream is broken). */
+
+static inline s64 llcov_frame_len(const u8* buf, u32 avail) {
+  u32 len;
+  if (avail < LLCOV_FRAME_HDR_SIZE) return 0;
+  len = llcov_get_u32(buf + 4);
+  if (!buf[0] || len > LLCOV_MAX_FRAME) return -1;
+  if (avail < LLCOV_FRAME_HDR_SIZE + len) return 0;
+  return LLCOV_FRAME_HDR_SIZE + len;
+}
+
+/* Encode one block record, returns the number of bytes used. */
+
+static inline u32 llcov_put_rec(u8* p, u32 file_id, u32 line, u32 relblock) {
+  llcov_put_u32(p, file_id);
+  llcov_put_u32(p + 4, line);
+  llcov_put_u32(p + 8, relblock);
+  return LLCOV_REC_SIZE;
+}
+
+/* Write a complete HELLO frame, returns the number of bytes used. */
+
+static inline u32 llcov_put_hello(u8* p, u32 pid, const u8* build_id, u16 id_len) {
+  p += llcov_put_frame_hdr(p, LLCOV_FR_HELLO, 12 + id_len);
+  llcov_put_u32(p, LLCOV_PROTO_MAGIC);
+  llcov_put_u16(p + 4, LLCOV_PROTO_VERSION);
+  llcov_put_u16(p + 6, id_len);
+  llcov_put_u32(p + 8, pid);
+  if (id_len) memcpy(p + 12, build_id, id_len);
+  return LLCOV_HELLO_SIZE(id_len);
+}
+
+/* LEB128 varints: 7 bits per byte, high bit set on all but the last. */
+
+static inline u32 llcov_put_varint(u8* p, u32 v) {
+  u32 n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+/* Returns the number of bytes used, 0 if the varint is truncated or
+   overlong. */
+
+static inline u32 llcov_get_varint(const u8* p, const u8* end, u32* v) {
+  u32 n = 0, r = 0;
+  while (p + n < end && n < 5) {
+    r |= (u32)(p[n] & 0x7f) << (7 * n);
+    if (!(p[n++] & 0x80)) {
+      *v = r;
+      return n;
+    }
+  }
+  return 0;
+}
+
+/* VBLOCKS records are (file id, line) deltas against the previous record
+   in the same frame, zigzag-encoded, followed by the relblock. Runs of
+   blocks from the same file take three bytes per record, typically. */
+
+struct llcov_vstate {
+  u32 file_id;
+  u32 line;
+};
+
+static inline u32 llcov_zigzag(u32 delta) {
+  return (delta << 1) ^ (u32)((s32)delta >> 31);
+}
+
+static inline u32 llcov_unzigzag(u32 v) {
+  return (v >> 1) ^ -(v & 1);
+}
+
+static inline u32 llcov_put_vrec(u8* p, struct llcov_vstate* st, u32 file_id,
+                                 u32 line, u32 relblock) {
+  u32 n = llcov_put_varint(p, llcov_zigzag(file_id - st->file_id));
+  n += llcov_put_varint(p + n, llcov_zigzag(line - st->line));
+  n += llcov_put_varint(p + n, relblock);
+  st->file_id = file_id;
+  st->line = line;
+  return n;
+}
+
+/* Decode one record, returns the number of bytes used or 0 on error. */
+
+static inline u32 llcov_get_vrec(const u8* p, const u8* end, struct llcov_vstate* st,
+                                 u32* file_id, u32* line, u32* relblock) {
+  u32 a, b, n, v;
+
+  if (!(a = llcov_get_varint(p, end, &v))) return 0;
+  st->file_id += llcov_unzigzag(v);
+  if (!(b = llcov_get_varint(p + a, end, &v))) return 0;
+  st->line += llcov_unzigzag(v);
+  if (!(n = llcov_get_varint(p + a + b, end, relblock))) return 0;
+
+  *file_id = st->file_id;
+  *line = st->line;
+  return a + b + n;
+}
+
+#endif /* ! _HAVE_LLCOV_PROTO_H */
@@ -0,0 +1,376 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Output handling shared by the file-based runtimes.
+
+  Records are written with a single writev(2) to a descriptor opened with
+  O_APPEND, so concurrent writers (threads, or forked processes sharing the
+  same file) never interleave partial lines and need no lock.
+
+  If LLCOV_FILE contains "%p", it is replaced by the process id, giving
+  every process its own output segment. Forked children switch to a
+  segment of their own automatically.
+
+  With LLCOV_SNAPSHOT_SIGNAL and/or LLCOV_SNAPSHOT_INTERVAL, probes only
+  update the in-memory map (llcov-map-inl.h) and a background thread
+  appends the blocks covered since the previous snapshot whenever the
+  signal arrives or the interval expires, and once more at exit.
+
+  Coverage not written yet would be lost if the program crashes. With
+  LLCOV_CRASH_FLUSH set, fatal signals (and sanitizer reports) write it
+  out first, using nothing but write(2) on memory set aside at startup,
+  and then pass the signal on to whatever handler was there before.
+ */
+
+#ifndef _HAVE_LLCOV_RT_INL_H
+#define _HAVE_LLCOV_RT_INL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "types.h"
+#include "llcov-map-inl.h"
+#include "llcov-crash-inl.h"
+
+#define RT_UNINIT 0
+#define RT_OFF    1
+#define RT_FILE   2     /* Write records as they happen         */
+#define RT_MAP    3     /* Only record in the map (+ snapshots) */
+#define RT_STDERR 4
+#define RT_ABORT  5
+
+static int rt_mode = RT_UNINIT;
+static pthread_once_t rt_init_once = PTHREAD_ONCE_INIT;
+static int rt_restart;
+
+static int rt_outfd = -1;
+static bool rt_per_pid;
+static pthread_mutex_t rt_out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool rt_snap_enabled;
+static u32 rt_snap_pos;         /* Covered list entries already written */
+static u32 rt_snap_interval;    /* Seconds between snapshots, 0 = off   */
+static int rt_snap_signo;       /* Snapshot signal, 0 = none            */
+static int rt_snap_pipe[2] = { -1, -1 };
+static pthread_mutex_t rt_snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int rt_crash_flushed;
+
+/* Called in the child after fork(). The argument tells whether the child
+   writes to a new segment, in which case runtimes that only report
+   blocks once must forget what the parent has seen. */
+
+static void (*rt_child_hook)(bool new_segment);
+
+static void rt_snap_pipe_open() {
+    if (rt_snap_pipe[0] >= 0) {
+        close(rt_snap_pipe[0]);
+        close(rt_snap_pipe[1]);
+    }
+    if (pipe2(rt_snap_pipe, O_NONBLOCK | O_CLOEXEC)) rt_snap_pipe[0] = rt_snap_pipe[1] = -1;
+}
+
+static void rt_atfork_prepare() {
+    pthread_mutex_lock(&rt_snap_lock);
+    pthread_mutex_lock(&rt_out_lock);
+}
+
+static void rt_atfork_parent() {
+    pthread_mutex_unlock(&rt_out_lock);
+    pthread_mutex_unlock(&rt_snap_lock);
+}
+
+static void rt_atfork_child() {
+    pthread_mutex_init(&rt_out_lock, NULL);
+    pthread_mutex_init(&rt_snap_lock, NULL);
+
+    if (rt_per_pid && rt_outfd >= 0) {
+        close(rt_outfd);
+        rt_outfd = -1;
+    }
+
+    if (rt_snap_enabled) {
+        /* A new segment starts from scratch. In a shared file, whatever the
+           parent has not written yet is the parent's business. */
+        if (rt_per_pid) {
+            rt_map_reset();
+            rt_snap_pos = 0;
+        } else {
+            rt_snap_pos = rt_covered_cnt;
+        }
+
+        /* The snapshot thread is gone, the next probe starts a new one */
+        rt_snap_pipe_open();
+        rt_crash_flushed = 0;
+        rt_restart = 1;
+        __atomic_store_n(&rt_mode, RT_UNINIT, __ATOMIC_RELEASE);
+    }
+
+    if (rt_child_hook) rt_child_hook(rt_per_pid);
+}
+
+/* Expand "%p" in the LLCOV_FILE pattern to the current pid. */
+
+static bool rt_expand_path(const char* pattern, char* out, u32 size) {
+    u32 len = 0;
+
+    for (const char* p = pattern; *p; p++) {
+        char pid[16];
+        const char* s = p;
+        u32 n = 1;
+
+        if (p[0] == '%' && p[1] == 'p') {
+            n = snprintf(pid, sizeof(pid), "%d", (int)getpid());
+            s = pid;
+            p++;
+        }
+
+        if (len + n >= size) return false;
+        memcpy(out + len, s, n);
+        len += n;
+    }
+
+    out[len] = 0;
+    return true;
+}
+
+/* Open the output file named by LLCOV_FILE if that has not happened yet
+   in this process. Returns the descriptor or -1. */
+
+static int rt_open_output() {
+    static bool atfork_done;
+    int fd = __atomic_load_n(&rt_outfd, __ATOMIC_ACQUIRE);
+
+    if (fd >= 0) return fd;
+
+    const char* pattern = getenv("LLCOV_FILE");
+    if (!pattern) return -1;
+
+    pthread_mutex_lock(&rt_out_lock);
+
+    if (rt_outfd < 0) {
+        char path[PATH_MAX];
+
+        rt_per_pid = strstr(pattern, "%p") != NULL;
+
+        if (!rt_expand_path(pattern, path, sizeof(path))) {
+            fprintf(stderr, "LLCov: LLCOV_FILE too long\n");
+        } else {
+            fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0)
+                perror("LLCov: open");
+            else
+                __atomic_store_n(&rt_outfd, fd, __ATOMIC_RELEASE);
+        }
+
+        if (!atfork_done) {
+            pthread_atfork(rt_atfork_prepare, rt_atfork_parent, rt_atfork_child);
+            atfork_done = true;
+        }
+    }
+
+    fd = rt_outfd;
+    pthread_mutex_unlock(&rt_out_lock);
+
+    return fd;
+}
+
+/* Append everything covered since the last snapshot. */
+
+static void rt_snapshot_locked() {
+    static char buf[LLCOV_SNAP_BUF];
+    int fd = rt_open_output();
+
+    if (fd >= 0) rt_map_write(fd, &rt_snap_pos, buf, sizeof(buf), true);
+}
+
+static void rt_snapshot() {
+    pthread_mutex_lock(&rt_snap_lock);
+    rt_snapshot_locked();
+    pthread_mutex_unlock(&rt_snap_lock);
+}
+
+/* llcov_reset() with snapshots active: get the pending delta out first,
+   the next snapshot then starts over with what is covered after the
+   reset. */
+
+static void rt_snap_reset() {
+    pthread_mutex_lock(&rt_snap_lock);
+    rt_snapshot_locked();
+    rt_map_reset();
+    rt_snap_pos = 0;
+    pthread_mutex_unlock(&rt_snap_lock);
+}
+
+/* Only wakes up the snapshot thread, which does the actual work. */
+
+static void rt_snap_signal(int) {
+    int saved = errno;
+    if (rt_snap_pipe[1] >= 0) (void)!write(rt_snap_pipe[1], "", 1);
+    errno = saved;
+}
+
+static void* rt_snap_thread(void*) {
+    for (;;) {
+        struct pollfd p;
+        char junk[64];
+
+        p.fd = rt_snap_pipe[0];
+        p.events = POLLIN;
+        p.revents = 0;
+
+        if (poll(&p, 1, rt_snap_interval ? (int)rt_snap_interval * 1000 : -1) < 0) {
+            if (errno == EINTR) continue;
+            sleep(1);
+        }
+
+        while (read(rt_snap_pipe[0], junk, sizeof(junk)) > 0);
+
+        rt_snapshot();
+    }
+
+    return NULL;
+}
+
+static bool rt_snap_start() {
+    pthread_t t;
+    pthread_attr_t attr;
+    bool ok;
+
+    /* Binary output without snapshots is only written at exit */
+    if (!rt_snap_signo && !rt_snap_interval) return true;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    ok = !pthread_create(&t, &attr, rt_snap_thread, NULL);
+    if (!ok) perror("LLCov: pthread_create");
+
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+static int rt_parse_signal(const char* name) {
+    if (!strncmp(name, "SIG", 3)) name += 3;
+    if (!strcmp(name, "USR1")) return SIGUSR1;
+    if (!strcmp(name, "USR2")) return SIGUSR2;
+    if (!strcmp(name, "HUP")) return SIGHUP;
+    return atoi(name);
+}
+
+/* Crash flush (see llcov-crash-inl.h). Everything here has to be
+   async-signal-safe. */
+
+static char rt_crash_buf[16384];
+
+/* Write what the snapshot thread has not written yet. Does not take the
+   snapshot lock, a snapshot in progress may duplicate some records. */
+
+static void rt_crash_flush() {
+    int fd = __atomic_load_n(&rt_outfd, __ATOMIC_ACQUIRE);
+    u32 pos = __atomic_load_n(&rt_snap_pos, __ATOMIC_RELAXED);
+
+    if (fd < 0 || __atomic_exchange_n(&rt_crash_flushed, 1, __ATOMIC_ACQ_REL)) return;
+
+    rt_map_write(fd, &pos, rt_crash_buf, sizeof(rt_crash_buf), false);
+}
+
+/* Set up snapshots if requested. Returns false if snapshots are not
+   requested or cannot be set up, the runtime then writes through. Binary
+   output always goes through the map. */
+
+static bool rt_snap_init() {
+    const char* sig = getenv("LLCOV_SNAPSHOT_SIGNAL");
+    const char* interval = getenv("LLCOV_SNAPSHOT_INTERVAL");
+    int signo = sig ? rt_parse_signal(sig) : 0;
+
+    rt_snap_interval = interval ? atoi(interval) : 0;
+    rt_snap_signo = signo;
+
+    if (!signo && !rt_snap_interval && !rt_binary) return false;
+
+    if (!rt_map_size) return false;
+
+    rt_snap_pipe_open();
+    if (rt_snap_pipe[0] < 0 || !rt_snap_start()) return false;
+
+    if (signo > 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = rt_snap_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(signo, &sa, NULL);
+    }
+
+    atexit(rt_snapshot);
+    rt_map_reset_hook = rt_snap_reset;
+    rt_snap_enabled = true;
+
+    if (getenv("LLCOV_CRASH_FLUSH")) rt_crash_init(rt_crash_flush);
+    return true;
+}
+
+/* Every mode except LLCOV_ABORT keeps the in-memory map up to date, so the
+   control API (llcov.h) works no matter how coverage is written. Without
+   any output configured, the map is all there is, and probes only start
+   filling it once the program uses llcov.h (see rt_map_demand()), or from
+   the start with LLCOV_MAP_SIZE. */
+
+static void rt_init() {
+    int m = RT_OFF;
+
+    if (getenv("LLCOV_ABORT")) {
+        m = RT_ABORT;
+    } else {
+        if (!rt_map_init()) perror("LLCov: unable to allocate coverage map");
+
+        if (getenv("LLCOV_STDERR")) {
+            m = RT_STDERR;
+        } else if (rt_open_output() >= 0) {
+            m = rt_snap_init() ? RT_MAP : RT_FILE;
+        } else if (rt_map_size && getenv("LLCOV_MAP_SIZE")) {
+            m = RT_MAP;
+        }
+    }
+
+    __atomic_store_n(&rt_mode, m, __ATOMIC_RELEASE);
+}
+
+static inline int rt_get_mode() {
+    int m = __atomic_load_n(&rt_mode, __ATOMIC_ACQUIRE);
+    if (m != RT_UNINIT) return m;
+
+    if (__atomic_exchange_n(&rt_restart, 0, __ATOMIC_ACQ_REL)) {
+        /* First probe in a forked child */
+        if (rt_snap_start()) __atomic_store_n(&rt_mode, RT_MAP, __ATOMIC_RELEASE);
+    } else {
+        pthread_once(&rt_init_once, rt_init);
+    }
+
+    return __atomic_load_n(&rt_mode, __ATOMIC_ACQUIRE);
+}
+
+/* Called by the control API: a program without output that asks for its
+   coverage gets the map from here on. */
+
+static void rt_map_demand() {
+    int m = RT_OFF;
+
+    if (rt_map_size)
+        __atomic_compare_exchange_n(&rt_mode, &m, RT_MAP, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#endif /* ! _HAVE_LLCOV_RT_INL_H */
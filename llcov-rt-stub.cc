@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <dlfcn.h>
+
+/*
+ * Static stub for the shared runtimes: linked into the program instead of
+ * a runtime object when LLCOV_RUNTIME=shared. Probes call into the stub,
+ * which forwards them to whichever libllcov-rt*.so provides
+ * llcov_rt_block_call first in symbol lookup order. The program is linked
+ * against libllcov-rt.so, so that is the default; another back end is
+ * picked at launch, without relinking, e.g.
+ *
+ *   LD_PRELOAD=libllcov-rt-dedup.so ./program
+ *
+ * The target is looked up once with dlsym() and then called through a
+ * cached pointer, so a probe costs one direct and one indirect call and
+ * never goes through the PLT. If no shared runtime is loaded at all,
+ * probes do nothing.
+ *
+ * Module registration (llvm_llcov_register_module(), for the live
+ * statistics) is forwarded the same way, but only runs once per module.
+ * PC probes (llvm_llcov_pc_call()) pass on their own return address.
+ *
+ * The stub is weak, so a runtime linked in statically takes precedence.
+ */
+
+typedef void (*stub_probe_fn)(const char* funcname, const char* filename, uint32_t line, uint32_t relblock);
+
+static stub_probe_fn stub_target;
+
+static void stub_noop(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
+}
+
+/* Racing threads resolve the same pointer, which is harmless. */
+
+static stub_probe_fn stub_resolve() {
+    stub_probe_fn fn = (stub_probe_fn)dlsym(RTLD_DEFAULT, "llcov_rt_block_call");
+
+    if (!fn) fn = stub_noop;
+    __atomic_store_n(&stub_target, fn, __ATOMIC_RELEASE);
+    return fn;
+}
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) 
+	__attribute__((weak, visibility("default")));
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
+    stub_probe_fn fn = __atomic_load_n(&stub_target, __ATOMIC_ACQUIRE);
+
+    if (__builtin_expect(!fn, 0)) fn = stub_resolve();
+    fn(funcname, filename, line, relblock);
+}
+
+typedef void (*stub_pc_fn)(const void* pc);
+
+static stub_pc_fn stub_pc_target;
+
+static void stub_pc_noop(const void* pc) {
+}
+
+extern "C" void llvm_llcov_pc_call() __attribute__((weak, visibility("default"), noinline));
+
+extern "C" void llvm_llcov_pc_call() {
+    stub_pc_fn fn = __atomic_load_n(&stub_pc_target, __ATOMIC_ACQUIRE);
+
+    if (__builtin_expect(!fn, 0)) {
+        fn = (stub_pc_fn)dlsym(RTLD_DEFAULT, "llcov_rt_pc_hit");
+        if (!fn) fn = stub_pc_noop;
+        __atomic_store_n(&stub_pc_target, fn, __ATOMIC_RELEASE);
+    }
+
+    fn(__builtin_return_address(0));
+}
+
+typedef void (*stub_register_fn)(void* module);
+
+extern "C" void llvm_llcov_register_module(void* module) __attribute__((weak, visibility("default")));
+
+extern "C" void llvm_llcov_register_module(void* module) {
+    stub_register_fn fn = (stub_register_fn)dlsym(RTLD_DEFAULT, "llcov_rt_register_module");
+
+    if (fn) fn(module);
+}
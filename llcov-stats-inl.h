@@ -0,0 +1,495 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Live coverage statistics, served on a Unix domain socket.
+
+  Every instrumented module registers itself from a constructor with the
+  number of blocks the pass instrumented in each of its files (see
+  llvm_llcov_register_module() below). With LLCOV_STATS_SOCKET set, the
+  first registration starts a thread that listens on that path and
+  answers one-line requests with text responses, each terminated by an
+  empty line:
+
+    summary  - covered, seen and total blocks, new blocks per second over
+               the last 1, 10 and 60 seconds, and lost records
+    files    - file:<name> covered:<n> seen:<n> total:<n>, one per file
+    modules  - module:<name> covered:<n> seen:<n> total:<n>, one per module
+
+  "covered" counts blocks hit since the last llcov_reset(), "seen" every
+  block ever executed, "total" what the pass instrumented. The thread only
+  reads the map, probes are neither locked nor slowed down; numbers may
+  be a little behind probes running at the same time.
+
+  Included by llcov-api-inl.h, i.e. part of every runtime.
+ */
+
+#ifndef _HAVE_LLCOV_STATS_INL_H
+#define _HAVE_LLCOV_STATS_INL_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "types.h"
+
+/* Layout shared with the pass, which emits one of these per module */
+
+struct llcov_module_file {
+    const char* filename;       /* Same pointer the probes pass          */
+    u32 blocks;
+};
+
+struct llcov_module {
+    const char* name;
+    const llcov_module_file* files;
+    u32 nfiles;
+    u32 blocks;
+    llcov_module* next;         /* Filled in at registration             */
+};
+
+#define RT_STATS_CLIENTS 16
+#define RT_STATS_SAMPLES 64     /* One per second                        */
+
+static llcov_module* rt_modules;
+static pthread_once_t rt_stats_once = PTHREAD_ONCE_INIT;
+
+/* Records a runtime had to throw away, besides a full map (e.g. the
+   network runtime's ring running over). Set by the runtime. */
+
+static u64* rt_stats_dropped;
+
+static u64 rt_stats_times[RT_STATS_SAMPLES];
+static u32 rt_stats_seen[RT_STATS_SAMPLES];
+static u32 rt_stats_nsamples;
+
+struct rt_stats_buf {
+    char* data;
+    u32 len, cap;
+};
+
+static void rt_stats_printf(rt_stats_buf* b, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void rt_stats_printf(rt_stats_buf* b, const char* fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0) return;
+        if (b->len + n < b->cap) break;
+
+        u32 cap = (b->len + n + 1) * 2;
+        char* data = (char*)realloc(b->data, cap);
+        if (!data) return;
+        b->data = data;
+        b->cap = cap;
+    }
+
+    b->len += n;
+}
+
+static u64 rt_stats_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void rt_stats_sample() {
+    u32 i = rt_stats_nsamples++ % RT_STATS_SAMPLES;
+
+    rt_stats_times[i] = rt_stats_now_ms();
+    rt_stats_seen[i] = rt_api_sites();
+}
+
+/* New blocks per second over roughly the last secs seconds. */
+
+static double rt_stats_rate(u32 secs) {
+    u32 n = rt_stats_nsamples, back;
+
+    if (n < 2) return 0;
+
+    back = secs < n - 1 ? secs : n - 1;
+    if (back > RT_STATS_SAMPLES - 1) back = RT_STATS_SAMPLES - 1;
+
+    u32 now = (n - 1) % RT_STATS_SAMPLES, then = (n - 1 - back) % RT_STATS_SAMPLES;
+    u64 ms = rt_stats_times[now] - rt_stats_times[then];
+
+    return ms ? (rt_stats_seen[now] - rt_stats_seen[then]) * 1000.0 / ms : 0;
+}
+
+/* Per-name counters, in a hash table built for one request */
+
+struct rt_stats_ent {
+    const char* name;
+    u64 covered, seen, total;
+};
+
+struct rt_stats_tab {
+    rt_stats_ent* ents;
+    u32 mask, cnt;
+};
+
+static u32 rt_stats_hash_str(const char* s) {
+    u32 h = 2166136261U;
+    while (*s) h = (h ^ (u8)*s++) * 16777619U;
+    return h;
+}
+
+static rt_stats_ent* rt_stats_get(rt_stats_tab* t, const char* name) {
+    u32 i = rt_stats_hash_str(name) & t->mask;
+
+    while (t->ents[i].name) {
+        if (!strcmp(t->ents[i].name, name)) return &t->ents[i];
+        i = (i + 1) & t->mask;
+    }
+
+    /* Sized for every file of every module plus every site, cannot fill */
+    t->ents[i].name = name;
+    t->cnt++;
+    return &t->ents[i];
+}
+
+static bool rt_stats_tab_init(rt_stats_tab* t, u64 max) {
+    u64 size = 64;
+
+    while (size < max * 2) size <<= 1;
+
+    t->ents = (rt_stats_ent*)calloc(size, sizeof(rt_stats_ent));
+    t->mask = size - 1;
+    t->cnt = 0;
+    return t->ents != NULL;
+}
+
+/* Maps file name pointers (as registered) to their module */
+
+struct rt_stats_owner {
+    const char* ptr;
+    u32 idx;                    /* Index into the module table */
+};
+
+static void rt_stats_modules(rt_stats_buf* b) {
+    llcov_module* m;
+    u32 nmods = 0, nfiles = 0, sites = rt_api_sites();
+
+    for (m = __atomic_load_n(&rt_modules, __ATOMIC_ACQUIRE); m; m = m->next) {
+        nmods++;
+        nfiles += m->nfiles;
+    }
+
+    u32 size = 64;
+    while (size < nfiles * 2) size <<= 1;
+
+    rt_stats_owner* own = (rt_stats_owner*)calloc(size, sizeof(rt_stats_owner));
+    u64* cnt = (u64*)calloc(nmods * 2 + 1, sizeof(u64));
+    llcov_module** mods = (llcov_module**)calloc(nmods + 1, sizeof(llcov_module*));
+
+    if (!own || !cnt || !mods) goto out;
+
+    nmods = 0;
+    for (m = __atomic_load_n(&rt_modules, __ATOMIC_ACQUIRE); m; m = m->next) {
+        for (u32 f = 0; f < m->nfiles; f++) {
+            u32 i = (u32)((uintptr_t)m->files[f].filename >> 3) & (size - 1);
+            while (own[i].ptr && own[i].ptr != m->files[f].filename) i = (i + 1) & (size - 1);
+
+            /* Merged strings belong to the first module that has them */
+            if (own[i].ptr) continue;
+            own[i].ptr = m->files[f].filename;
+            own[i].idx = nmods;
+        }
+        mods[nmods++] = m;
+    }
+
+    for (u32 id = 0; id < sites; id++) {
+        const char* fn = __atomic_load_n(&rt_sites[id].filename, __ATOMIC_ACQUIRE);
+        if (!fn) continue;
+
+        u32 i = (u32)((uintptr_t)fn >> 3) & (size - 1);
+        while (own[i].ptr && own[i].ptr != fn) i = (i + 1) & (size - 1);
+        if (!own[i].ptr) continue;
+
+        cnt[own[i].idx * 2]++;
+        if (__atomic_load_n(&rt_hits[id], __ATOMIC_RELAXED)) cnt[own[i].idx * 2 + 1]++;
+    }
+
+    for (u32 i = 0; i < nmods; i++)
+        rt_stats_printf(b, "module:%s covered:%llu seen:%llu total:%u\n", mods[i]->name,
+                        (unsigned long long)cnt[i * 2 + 1], (unsigned long long)cnt[i * 2],
+                        mods[i]->blocks);
+
+out:
+    free(own);
+    free(cnt);
+    free(mods);
+}
+
+/* Fills t with one entry per file name: registered totals plus what the
+   map has seen. Returns false if out of memory. */
+
+static bool rt_stats_files(rt_stats_tab* t) {
+    u32 sites = rt_api_sites();
+    u64 nfiles = 0;
+    llcov_module* m;
+
+    for (m = __atomic_load_n(&rt_modules, __ATOMIC_ACQUIRE); m; m = m->next) nfiles += m->nfiles;
+
+    if (!rt_stats_tab_init(t, nfiles + sites)) return false;
+
+    for (m = __atomic_load_n(&rt_modules, __ATOMIC_ACQUIRE); m; m = m->next)
+        for (u32 f = 0; f < m->nfiles; f++)
+            rt_stats_get(t, m->files[f].filename)->total += m->files[f].blocks;
+
+    const char* last_fn = NULL;
+    rt_stats_ent* last = NULL;
+
+    for (u32 id = 0; id < sites; id++) {
+        const char* fn = __atomic_load_n(&rt_sites[id].filename, __ATOMIC_ACQUIRE);
+        if (!fn) continue;
+
+        /* Sites of one file tend to come in runs */
+        if (fn != last_fn) {
+            last = rt_stats_get(t, fn);
+            last_fn = fn;
+        }
+
+        last->seen++;
+        if (__atomic_load_n(&rt_hits[id], __ATOMIC_RELAXED)) last->covered++;
+    }
+
+    return true;
+}
+
+static void rt_stats_respond(rt_stats_buf* b, const char* req) {
+    rt_stats_tab t;
+
+    if (!strcmp(req, "summary")) {
+        u64 covered = 0, seen = 0, total = 0, files = 0, mods = 0;
+        u64* dropped = __atomic_load_n(&rt_stats_dropped, __ATOMIC_ACQUIRE);
+
+        for (llcov_module* m = __atomic_load_n(&rt_modules, __ATOMIC_ACQUIRE); m; m = m->next) mods++;
+
+        if (rt_stats_files(&t)) {
+            for (u32 i = 0; i <= t.mask; i++) {
+                if (!t.ents[i].name) continue;
+                covered += t.ents[i].covered;
+                seen += t.ents[i].seen;
+                total += t.ents[i].total;
+            }
+            files = t.cnt;
+            free(t.ents);
+        }
+
+        rt_stats_printf(b, "covered %llu\nseen %llu\ntotal %llu\nfiles %llu\nmodules %llu\n"
+                           "new_per_s_1 %.1f\nnew_per_s_10 %.1f\nnew_per_s_60 %.1f\n"
+                           "map_full %llu\ndropped %llu\n",
+                        (unsigned long long)covered, (unsigned long long)seen,
+                        (unsigned long long)total, (unsigned long long)files,
+                        (unsigned long long)mods, rt_stats_rate(1), rt_stats_rate(10),
+                        rt_stats_rate(60),
+                        (unsigned long long)__atomic_load_n(&rt_map_full, __ATOMIC_RELAXED),
+                        (unsigned long long)(dropped ? __atomic_load_n(dropped, __ATOMIC_RELAXED) : 0));
+
+    } else if (!strcmp(req, "files")) {
+        if (rt_stats_files(&t)) {
+            for (u32 i = 0; i <= t.mask; i++) {
+                rt_stats_ent* e = &t.ents[i];
+                if (!e->name) continue;
+                rt_stats_printf(b, "file:%s covered:%llu seen:%llu total:%llu\n", e->name,
+                                (unsigned long long)e->covered, (unsigned long long)e->seen,
+                                (unsigned long long)e->total);
+            }
+            free(t.ents);
+        }
+
+    } else if (!strcmp(req, "modules")) {
+        rt_stats_modules(b);
+
+    } else {
+        rt_stats_printf(b, "error unknown request '%s' (summary, files, modules)\n", req);
+    }
+
+    rt_stats_printf(b, "\n");
+}
+
+struct rt_stats_client {
+    int fd;
+    char req[256];
+    u32 len;
+};
+
+/* Handles what arrived from a client. Returns false to drop it. */
+
+static bool rt_stats_serve(rt_stats_client* c) {
+    ssize_t n = read(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len);
+    char* nl;
+
+    if (n <= 0) return n < 0 && errno == EINTR;
+    c->len += n;
+    c->req[c->len] = 0;
+
+    while ((nl = strchr(c->req, '\n'))) {
+        rt_stats_buf b = { NULL, 0, 0 };
+        u32 rest;
+
+        *nl = 0;
+        if (nl > c->req && nl[-1] == '\r') nl[-1] = 0;
+
+        rt_stats_respond(&b, c->req);
+
+        for (u32 off = 0; off < b.len; ) {
+            ssize_t w = write(c->fd, b.data + off, b.len - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                free(b.data);
+                return false;
+            }
+            off += w;
+        }
+
+        free(b.data);
+
+        rest = c->len - (nl + 1 - c->req);
+        memmove(c->req, nl + 1, rest + 1);
+        c->len = rest;
+    }
+
+    /* A request that does not even fit is not one we know */
+    return c->len < sizeof(c->req) - 1;
+}
+
+static void* rt_stats_thread(void* arg) {
+    int lfd = (int)(intptr_t)arg;
+    rt_stats_client clients[RT_STATS_CLIENTS];
+    u32 nclients = 0;
+    u64 next_sample = 0;
+
+    /* Makes sure the map is set up before it is read from here */
+    rt_api_init();
+
+    for (;;) {
+        struct pollfd p[RT_STATS_CLIENTS + 1];
+        u64 now = rt_stats_now_ms();
+
+        if (now >= next_sample) {
+            rt_stats_sample();
+            next_sample = now + 1000;
+        }
+
+        p[0].fd = lfd;
+        p[0].events = POLLIN;
+        for (u32 i = 0; i < nclients; i++) {
+            p[i + 1].fd = clients[i].fd;
+            p[i + 1].events = POLLIN;
+        }
+
+        if (poll(p, nclients + 1, (int)(next_sample - now)) <= 0) continue;
+
+        for (u32 i = nclients; i > 0; i--) {
+            if (!p[i].revents || rt_stats_serve(&clients[i - 1])) continue;
+            close(clients[i - 1].fd);
+            clients[i - 1] = clients[--nclients];
+        }
+
+        if (p[0].revents & POLLIN) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+
+            if (nclients == RT_STATS_CLIENTS) {
+                close(fd);
+                continue;
+            }
+
+            /* Do not get stuck on a client that does not read */
+            struct timeval tv = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+            clients[nclients].fd = fd;
+            clients[nclients].len = 0;
+            nclients++;
+        }
+    }
+
+    return NULL;
+}
+
+/* LLCOV_STATS_SOCKET=path, "%p" in it is replaced by the process id. */
+
+static void rt_stats_start() {
+    const char* path = getenv("LLCOV_STATS_SOCKET");
+    struct sockaddr_un sun;
+    const char* p;
+    u32 len = 0;
+
+    if (!path || !*path) return;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+
+    for (p = path; *p && len < sizeof(sun.sun_path) - 1; p++) {
+        if (p[0] == '%' && p[1] == 'p') {
+            len += snprintf(sun.sun_path + len, sizeof(sun.sun_path) - len, "%d", (int)getpid());
+            p++;
+        } else {
+            sun.sun_path[len++] = *p;
+        }
+    }
+
+    if (*p || len >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "LLCov: LLCOV_STATS_SOCKET too long\n");
+        return;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("LLCov: stats socket");
+        return;
+    }
+
+    unlink(sun.sun_path);
+
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) || listen(fd, 16)) {
+        perror("LLCov: stats socket");
+        close(fd);
+        return;
+    }
+
+    pthread_t t;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&t, &attr, rt_stats_thread, (void*)(intptr_t)fd)) {
+        perror("LLCov: pthread_create");
+        close(fd);
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/* Called from a constructor the pass adds to every instrumented module.
+   The module record lives in the module's data, nothing is copied. */
+
+LLCOV_API void llvm_llcov_register_module(llcov_module* m) {
+    llcov_module* head = __atomic_load_n(&rt_modules, __ATOMIC_RELAXED);
+
+    do {
+        m->next = head;
+    } while (!__atomic_compare_exchange_n(&rt_modules, &head, m, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    pthread_once(&rt_stats_once, rt_stats_start);
+}
+
+#endif /* ! _HAVE_LLCOV_STATS_INL_H */
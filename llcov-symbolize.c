@@ -0,0 +1,912 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Turns the raw PC records of a build with LLCOV_PC=1 back into source
+  locations. The runtime records a PC probe as
+
+    file:<object path> line:0 relblock:<offset>
+
+  and this tool looks every distinct offset up in the debug information
+  of the object with addr2line (or any tool with the same interface,
+  e.g. llvm-addr2line), and writes regular file/line/relblock records.
+  All other records are passed through unchanged.
+
+  The pass gives every probe call the location of its block, with the
+  relblock + 1 as DWARF discriminator, so the line table has everything.
+  For objects built without discriminators, blocks on the same line are
+  numbered in address order instead, which is usually but not always
+  what the pass counted.
+
+  With the instrumentation manifest of the build (LLCOV_LOGINSTFILE),
+  file names are written the way the pass saw them instead of the way
+  the line table has them (usually with the compilation directory in
+  front), and the relblocks of the manifest are used for numbering.
+
+  Lookups run in parallel, one symbolizer process per chunk of offsets,
+  and results can be kept in a cache file for the next run; entries are
+  only reused for the object they came from (same size and mtime).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "llcov-path.h"
+
+struct obj {
+  u8* path;
+  u64 size, mtime;                    /* 0, 0 if it cannot be found       */
+};
+
+struct pc {
+  u32 obj, off;
+  s32 file;                           /* Line table name, -1 = unknown    */
+  u32 line, disc;
+  u8  done;                           /* Looked up (or from the cache)    */
+};
+
+struct mblk {
+  u32 file, line, relblock;
+};
+
+static struct obj* objs;
+static u32 obj_cnt;
+
+static struct pc* pcs;
+static u32 pc_cnt, pc_alloc;
+static u32* pc_tab;                   /* Hash table of pc indices + 1     */
+static u32  pc_tab_size;
+
+static u8** files;                    /* File id -> name                  */
+static u32* file_tab;                 /* Hash table of file ids + 1       */
+static u32  file_cnt, file_tab_size;
+
+static struct mblk* mblks;            /* Manifest blocks, sorted          */
+static u32 mblk_cnt, mblk_alloc;
+static u32* mfiles;                   /* Ids of the files in the manifest */
+static u32 mfile_cnt;
+static s32* name_map;                 /* Line table id -> manifest id + 1 */
+static u32 name_map_size;
+
+static u8* tool = (u8*)"addr2line";   /* Symbolizer (-s)                  */
+
+static u64 total_passed, total_cached, total_looked_up, total_unknown,
+           total_not_in_manifest;
+
+
+static u32 hash_str(const u8* s) {
+
+  u32 h = 2166136261U;
+
+  while (*s) h = (h ^ *s++) * 16777619U;
+  return h;
+
+}
+
+
+static u32 hash_pc(u32 obj, u32 off) {
+
+  u64 h = ((u64)obj << 32) ^ off;
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return h;
+
+}
+
+
+/* Returns the id of a file name, adding it if needed. */
+
+static u32 find_file(const u8* name) {
+
+  u32 pos;
+
+  if (file_cnt * 2 >= file_tab_size) {
+
+    u32 size = file_tab_size ? file_tab_size * 2 : 1024, i;
+
+    ck_free(file_tab);
+    file_tab = ck_alloc(size * sizeof(u32));
+    file_tab_size = size;
+
+    for (i = 0; i < file_cnt; i++) {
+      pos = hash_str(files[i]) & (size - 1);
+      while (file_tab[pos]) pos = (pos + 1) & (size - 1);
+      file_tab[pos] = i + 1;
+    }
+
+    files = ck_realloc(files, size * sizeof(u8*));
+
+  }
+
+  pos = hash_str(name) & (file_tab_size - 1);
+
+  while (file_tab[pos]) {
+    if (!strcmp((char*)files[file_tab[pos] - 1], (char*)name)) return file_tab[pos] - 1;
+    pos = (pos + 1) & (file_tab_size - 1);
+  }
+
+  files[file_cnt] = (u8*)ck_strdup((u8*)name);
+  file_tab[pos] = ++file_cnt;
+
+  return file_cnt - 1;
+
+}
+
+
+/* There are only ever a few objects. */
+
+static u32 find_obj(const u8* path) {
+
+  static u32 last;
+  struct stat st;
+
+  if (obj_cnt && !strcmp((char*)objs[last].path, (char*)path)) return last;
+
+  for (last = 0; last < obj_cnt; last++)
+    if (!strcmp((char*)objs[last].path, (char*)path)) return last;
+
+  objs = ck_realloc(objs, (obj_cnt + 1) * sizeof(struct obj));
+  objs[obj_cnt].path = (u8*)ck_strdup((u8*)path);
+
+  if (!stat((char*)path, &st)) {
+    objs[obj_cnt].size  = st.st_size;
+    objs[obj_cnt].mtime = st.st_mtime;
+  }
+
+  return obj_cnt++;
+
+}
+
+
+static struct pc* find_pc(u32 obj, u32 off) {
+
+  u32 pos;
+
+  if (pc_cnt * 2 >= pc_tab_size) {
+
+    u32 size = pc_tab_size ? pc_tab_size * 2 : 65536, i;
+
+    ck_free(pc_tab);
+    pc_tab = ck_alloc(size * sizeof(u32));
+    pc_tab_size = size;
+
+    for (i = 0; i < pc_cnt; i++) {
+      pos = hash_pc(pcs[i].obj, pcs[i].off) & (size - 1);
+      while (pc_tab[pos]) pos = (pos + 1) & (size - 1);
+      pc_tab[pos] = i + 1;
+    }
+
+  }
+
+  pos = hash_pc(obj, off) & (pc_tab_size - 1);
+
+  while (pc_tab[pos]) {
+
+    struct pc* p = &pcs[pc_tab[pos] - 1];
+
+    if (p->obj == obj && p->off == off) return p;
+    pos = (pos + 1) & (pc_tab_size - 1);
+
+  }
+
+  if (pc_cnt == pc_alloc) {
+    pc_alloc = MAX(pc_alloc * 2, 65536);
+    pcs = ck_realloc(pcs, pc_alloc * sizeof(struct pc));
+  }
+
+  memset(&pcs[pc_cnt], 0, sizeof(struct pc));
+  pcs[pc_cnt].obj  = obj;
+  pcs[pc_cnt].off  = off;
+  pcs[pc_cnt].file = -1;
+  pc_tab[pos] = ++pc_cnt;
+
+  return &pcs[pc_cnt - 1];
+
+}
+
+
+/* Splits "file:<name> [func:<f>] line:<n> relblock:<n>" in place, from
+   the end, since file names may contain spaces. */
+
+static u8 parse_rec(u8* s, u8** file, u32* line, u32* relblock) {
+
+  u8* sp;
+  u8 have = 0;
+
+  if (strncmp((char*)s, "file:", 5)) return 0;
+
+  while ((sp = (u8*)strrchr((char*)s + 5, ' '))) {
+
+    if (!strncmp((char*)sp + 1, "line:", 5)) {
+      *line = atoi((char*)sp + 6);
+      have |= 1;
+    } else if (!strncmp((char*)sp + 1, "relblock:", 9)) {
+      *relblock = strtoul((char*)sp + 10, NULL, 10);
+      have |= 2;
+    } else if (strncmp((char*)sp + 1, "func:", 5) &&
+               strncmp((char*)sp + 1, "id:", 3)) break;
+
+    *sp = 0;
+
+  }
+
+  *file = s + 5;
+
+  return have == 3 && **file;
+
+}
+
+
+/* PC records are collected, everything else goes straight to out. */
+
+static void read_input(u8* fn, FILE* out) {
+
+  FILE* f = strcmp((char*)fn, "-") ? fopen((char*)fn, "r") : stdin;
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!f) PFATAL("Unable to open '%s'", fn);
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    u8* file;
+    u32 line, relblock;
+
+    if (strncmp(buf, "file:", 5) || !strstr(buf, " line:0 ")) {
+      fwrite(buf, 1, len, out);
+      total_passed++;
+      continue;
+    }
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+
+    if (!parse_rec((u8*)buf, &file, &line, &relblock) || line) {
+      fprintf(out, "%s\n", buf);
+      total_passed++;
+      continue;
+    }
+
+    find_pc(find_obj(file), relblock);
+
+  }
+
+  free(buf);
+  if (f != stdin) fclose(f);
+
+}
+
+
+static void read_manifest(u8* fn) {
+
+  FILE* f = fopen((char*)fn, "r");
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!f) PFATAL("Unable to open '%s'", fn);
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    u8* file;
+    u32 line, relblock;
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+    if (!parse_rec((u8*)buf, &file, &line, &relblock)) continue;
+
+    if (mblk_cnt == mblk_alloc) {
+      mblk_alloc = MAX(mblk_alloc * 2, 65536);
+      mblks = ck_realloc(mblks, mblk_alloc * sizeof(struct mblk));
+    }
+
+    mblks[mblk_cnt].file     = find_file(file);
+    mblks[mblk_cnt].line     = line;
+    mblks[mblk_cnt].relblock = relblock;
+    mblk_cnt++;
+
+  }
+
+  free(buf);
+  fclose(f);
+
+}
+
+
+static int cmp_mblk(const void* a, const void* b) {
+
+  const struct mblk *x = a, *y = b;
+
+  if (x->file != y->file) return x->file < y->file ? -1 : 1;
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+  return x->relblock < y->relblock ? -1 : x->relblock > y->relblock;
+
+}
+
+
+/* Sorts the manifest and drops duplicates (the manifest is appended to
+   by every compiler run). */
+
+static void index_manifest(void) {
+
+  u32 i, n = 0;
+
+  qsort(mblks, mblk_cnt, sizeof(struct mblk), cmp_mblk);
+
+  for (i = 0; i < mblk_cnt; i++) {
+
+    if (n && !cmp_mblk(&mblks[n - 1], &mblks[i])) continue;
+    mblks[n++] = mblks[i];
+
+    if (mfile_cnt && mfiles[mfile_cnt - 1] == mblks[i].file) continue;
+    mfiles = ck_realloc(mfiles, (mfile_cnt + 1) * sizeof(u32));
+    mfiles[mfile_cnt++] = mblks[i].file;
+
+  }
+
+  mblk_cnt = n;
+
+}
+
+
+/* First manifest block for (file, line), or mblk_cnt. */
+
+static u32 find_mblk(u32 file, u32 line) {
+
+  u32 lo = 0, hi = mblk_cnt;
+
+  while (lo < hi) {
+
+    u32 mid = (lo + hi) / 2;
+
+    if (mblks[mid].file < file || (mblks[mid].file == file && mblks[mid].line < line))
+      lo = mid + 1;
+    else hi = mid;
+
+  }
+
+  return lo;
+
+}
+
+
+/* The manifest name for a line table name: the longest one that is a
+   suffix of it. Names without a match stay as they are. */
+
+static u32 map_name(u32 file) {
+
+  u32 i, best_len = 0;
+  s32 best = -1;
+
+  if (!mfile_cnt) return file;
+
+  if (file >= name_map_size) {
+
+    u32 n = MAX(file + 1, name_map_size * 2);
+
+    name_map = ck_realloc(name_map, n * sizeof(s32));
+    memset(name_map + name_map_size, 0, (n - name_map_size) * sizeof(s32));
+    name_map_size = n;
+
+  }
+
+  if (name_map[file]) return name_map[file] > 0 ? name_map[file] - 1 : file;
+
+  for (i = 0; i < mfile_cnt; i++) {
+
+    u32 len = strlen((char*)files[mfiles[i]]);
+
+    if (len > best_len && llcov_suffix_match(files[file], files[mfiles[i]])) {
+      best = mfiles[i];
+      best_len = len;
+    }
+
+  }
+
+  name_map[file] = best < 0 ? -1 : best + 1;
+
+  return best < 0 ? file : (u32)best;
+
+}
+
+
+/* Cache lines: object, size, mtime, offset, line, discriminator, file,
+   separated by tabs; file last since it may contain anything. */
+
+static void read_cache(u8* fn) {
+
+  FILE* f = fopen((char*)fn, "r");
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+
+  if (!f) {
+    if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
+    return;
+  }
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    char* field[7];
+    char* p = buf;
+    u32 i, o;
+    struct pc* pc;
+    u32 pos;
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+
+    for (i = 0; i < 7 && p; i++) {
+      field[i] = p;
+      p = i < 6 ? strchr(p, '\t') : NULL;
+      if (p) *p++ = 0;
+    }
+
+    if (i < 7) continue;
+
+    /* Only objects that appear in the input, in the same version */
+
+    for (o = 0; o < obj_cnt; o++)
+      if (!strcmp((char*)objs[o].path, field[0])) break;
+
+    if (o == obj_cnt || !objs[o].size ||
+        objs[o].size != strtoull(field[1], NULL, 10) ||
+        objs[o].mtime != strtoull(field[2], NULL, 10)) continue;
+
+    /* Look the offset up without adding it */
+
+    pos = hash_pc(o, strtoul(field[3], NULL, 16)) & (pc_tab_size - 1);
+
+    for (pc = NULL; pc_tab[pos]; pos = (pos + 1) & (pc_tab_size - 1)) {
+      struct pc* c = &pcs[pc_tab[pos] - 1];
+      if (c->obj == o && c->off == strtoul(field[3], NULL, 16)) {
+        pc = c;
+        break;
+      }
+    }
+
+    if (!pc || pc->done) continue;
+
+    pc->line = strtoul(field[4], NULL, 10);
+    pc->disc = strtoul(field[5], NULL, 10);
+    pc->file = *field[6] ? (s32)find_file((u8*)field[6]) : -1;
+    pc->done = 1;
+
+    total_cached++;
+
+  }
+
+  free(buf);
+  fclose(f);
+
+}
+
+
+static void write_cache(u8* fn) {
+
+  u8* tmp = alloc_printf("%s.tmp", fn);
+  FILE* f = fopen((char*)tmp, "w");
+  u32 i;
+
+  if (!f) PFATAL("Unable to create '%s'", tmp);
+
+  for (i = 0; i < pc_cnt; i++) {
+
+    struct pc* p = &pcs[i];
+    struct obj* o = &objs[p->obj];
+
+    /* Objects that are gone cannot be checked next time */
+    if (!p->done || !o->size) continue;
+
+    fprintf(f, "%s\t%llu\t%llu\t%x\t%u\t%u\t%s\n", o->path, o->size, o->mtime,
+            p->off, p->line, p->disc, p->file < 0 ? "" : (char*)files[p->file]);
+
+  }
+
+  if (fclose(f)) PFATAL("Unable to write '%s'", tmp);
+  if (rename((char*)tmp, (char*)fn)) PFATAL("Unable to rename '%s'", tmp);
+
+  ck_free(tmp);
+
+}
+
+
+/* A chunk of offsets of one object, looked up by one symbolizer run. */
+
+struct job {
+  u32* idx;                           /* Into pcs                         */
+  u32  cnt;
+  u8*  in_fn;
+  u8*  out_fn;
+  pid_t pid;
+};
+
+
+static u8* make_temp(u8* tmp_dir, const char* what) {
+
+  u8* fn = alloc_printf("%s/.llcov-symbolize-%s-XXXXXX", tmp_dir, what);
+  s32 fd = mkstemp((char*)fn);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  close(fd);
+  return fn;
+
+}
+
+
+static void start_job(struct job* j, u8* tmp_dir) {
+
+  FILE* f;
+  u32 i;
+  s32 in_fd, out_fd;
+
+  j->in_fn  = make_temp(tmp_dir, "in");
+  j->out_fn = make_temp(tmp_dir, "out");
+
+  f = fopen((char*)j->in_fn, "w");
+  if (!f) PFATAL("Unable to create '%s'", j->in_fn);
+
+  /* Offsets are return addresses, the probe call is just before */
+
+  for (i = 0; i < j->cnt; i++)
+    fprintf(f, "0x%x\n", pcs[j->idx[i]].off - 1);
+
+  if (fclose(f)) PFATAL("Unable to write '%s'", j->in_fn);
+
+  in_fd  = open((char*)j->in_fn, O_RDONLY);
+  out_fd = open((char*)j->out_fn, O_WRONLY | O_TRUNC);
+  if (in_fd < 0 || out_fd < 0) PFATAL("Unable to open temporary files");
+
+  j->pid = fork();
+  if (j->pid < 0) PFATAL("fork() failed");
+
+  if (!j->pid) {
+
+    dup2(in_fd, 0);
+    dup2(out_fd, 1);
+
+    execlp((char*)tool, (char*)tool, "-a", "-e",
+           (char*)objs[pcs[j->idx[0]].obj].path, (char*)NULL);
+    PFATAL("Unable to execute '%s'", tool);
+
+  }
+
+  close(in_fd);
+  close(out_fd);
+
+}
+
+
+/* Reads "0x<addr>" / "<file>:<line>[ (discriminator <n>)]" pairs. */
+
+static void finish_job(struct job* j) {
+
+  FILE* f = fopen((char*)j->out_fn, "r");
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+  u32 i = 0;
+
+  if (!f) PFATAL("Unable to open '%s'", j->out_fn);
+
+  while (i < j->cnt && (len = getline(&buf, &alloc, f)) > 0) {
+
+    struct pc* p = &pcs[j->idx[i]];
+    char *colon, *disc;
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+    if (!strncmp(buf, "0x", 2)) continue;
+
+    i++;
+    p->done = 1;
+    total_looked_up++;
+
+    disc = strstr(buf, " (discriminator ");
+    if (disc) {
+      p->disc = atoi(disc + 16);
+      *disc = 0;
+    }
+
+    colon = strrchr(buf, ':');
+    if (!colon || colon == buf || !strncmp(buf, "??", 2)) continue;
+
+    *colon = 0;
+    p->line = atoi(colon + 1);
+    if (p->line) p->file = find_file((u8*)buf);
+
+  }
+
+  if (i < j->cnt) WARNF("'%s' answered %u of %u lookups", tool, i, j->cnt);
+
+  free(buf);
+  fclose(f);
+
+  unlink((char*)j->in_fn);
+  unlink((char*)j->out_fn);
+  ck_free(j->in_fn);
+  ck_free(j->out_fn);
+
+}
+
+
+static int cmp_pc_obj(const void* a, const void* b) {
+
+  const struct pc *x = &pcs[*(u32*)a], *y = &pcs[*(u32*)b];
+
+  if (x->obj != y->obj) return x->obj < y->obj ? -1 : 1;
+  return x->off < y->off ? -1 : x->off > y->off;
+
+}
+
+
+/* Looks up everything the cache did not have, jobs_max at a time. */
+
+static void look_up(u32 jobs_max, u8* tmp_dir) {
+
+  u32* todo = ck_alloc((pc_cnt + 1) * sizeof(u32));
+  u32 todo_cnt = 0, chunk, job_cnt = 0, running = 0, next = 0, i, j;
+  struct job* jobs;
+
+  for (i = 0; i < pc_cnt; i++)
+    if (!pcs[i].done) todo[todo_cnt++] = i;
+
+  if (!todo_cnt) {
+    ck_free(todo);
+    return;
+  }
+
+  qsort(todo, todo_cnt, sizeof(u32), cmp_pc_obj);
+
+  /* A few chunks per process, but not so small that startup dominates */
+
+  chunk = MAX(todo_cnt / (jobs_max * 4), 1024);
+  jobs  = ck_alloc((todo_cnt / chunk + obj_cnt + 1) * sizeof(struct job));
+
+  for (i = 0; i < todo_cnt; i = j) {
+
+    for (j = i; j < todo_cnt && j - i < chunk &&
+         pcs[todo[j]].obj == pcs[todo[i]].obj; j++);
+
+    jobs[job_cnt].idx = todo + i;
+    jobs[job_cnt].cnt = j - i;
+    job_cnt++;
+
+  }
+
+  ACTF("Looking up %u offsets in %u objects, %u jobs...", todo_cnt, obj_cnt, job_cnt);
+
+  while (next < job_cnt || running) {
+
+    s32 status;
+    pid_t pid;
+
+    if (next < job_cnt && running < jobs_max) {
+      start_job(&jobs[next++], tmp_dir);
+      running++;
+      continue;
+    }
+
+    pid = wait(&status);
+    if (pid < 0) PFATAL("wait() failed");
+
+    for (i = 0; i < next; i++)
+      if (jobs[i].pid == pid) break;
+
+    if (i == next) continue;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      WARNF("'%s' failed on '%s'", tool, objs[pcs[jobs[i].idx[0]].obj].path);
+
+    finish_job(&jobs[i]);
+    running--;
+
+  }
+
+  ck_free(jobs);
+  ck_free(todo);
+
+}
+
+
+struct out_rec {
+  u32 file, line, relblock;
+  u32 obj, off;                       /* Tie breaker for address order    */
+};
+
+
+static int cmp_out(const void* a, const void* b) {
+
+  const struct out_rec *x = a, *y = b;
+
+  if (x->file != y->file) return x->file < y->file ? -1 : 1;
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+  if (x->relblock != y->relblock) return x->relblock < y->relblock ? -1 : 1;
+  if (x->obj != y->obj) return x->obj < y->obj ? -1 : 1;
+  return x->off < y->off ? -1 : x->off > y->off;
+
+}
+
+
+#define NO_DISC 0xFFFFFFFF
+
+static void write_output(FILE* out) {
+
+  struct out_rec* recs = ck_alloc((pc_cnt + 1) * sizeof(struct out_rec));
+  u32 cnt = 0, i, j;
+
+  for (i = 0; i < pc_cnt; i++) {
+
+    struct pc* p = &pcs[i];
+
+    if (p->file < 0) {
+      total_unknown++;
+      continue;
+    }
+
+    recs[cnt].file     = map_name(p->file);
+    recs[cnt].line     = p->line;
+    recs[cnt].relblock = p->disc ? p->disc - 1 : NO_DISC;
+    recs[cnt].obj      = p->obj;
+    recs[cnt].off      = p->off;
+    cnt++;
+
+  }
+
+  /* Blocks without a discriminator come last on their line, in address
+     order; number them, with the manifest's relblocks if there is one. */
+
+  qsort(recs, cnt, sizeof(struct out_rec), cmp_out);
+
+  for (i = 0; i < cnt; i = j) {
+
+    u32 m = find_mblk(recs[i].file, recs[i].line), k = 0;
+
+    for (j = i; j < cnt && recs[j].file == recs[i].file &&
+         recs[j].line == recs[i].line; j++) {
+
+      if (recs[j].relblock != NO_DISC) continue;
+
+      if (m + k < mblk_cnt && mblks[m + k].file == recs[j].file &&
+          mblks[m + k].line == recs[j].line)
+        recs[j].relblock = mblks[m + k].relblock;
+      else recs[j].relblock = k;
+
+      k++;
+
+    }
+
+  }
+
+  qsort(recs, cnt, sizeof(struct out_rec), cmp_out);
+
+  for (i = 0; i < cnt; i++) {
+
+    if (i && recs[i].file == recs[i - 1].file && recs[i].line == recs[i - 1].line &&
+        recs[i].relblock == recs[i - 1].relblock) continue;
+
+    if (mblk_cnt) {
+
+      u32 m = find_mblk(recs[i].file, recs[i].line);
+
+      while (m < mblk_cnt && mblks[m].file == recs[i].file &&
+             mblks[m].line == recs[i].line && mblks[m].relblock < recs[i].relblock) m++;
+
+      if (m == mblk_cnt || mblks[m].file != recs[i].file || mblks[m].line != recs[i].line ||
+          mblks[m].relblock != recs[i].relblock) total_not_in_manifest++;
+
+    }
+
+    fprintf(out, "file:%s line:%u relblock:%u\n", files[recs[i].file], recs[i].line,
+            recs[i].relblock);
+
+  }
+
+  ck_free(recs);
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] coverage_file ...\n\n"
+
+       "Coverage files are in LLCov text format, '-' reads standard input\n"
+       "(use llcov-decode for binary output first).\n\n"
+
+       "Options:\n\n"
+
+       "  -o file       - output file (default: stdout)\n"
+       "  -m file       - instrumentation manifest (LLCOV_LOGINSTFILE) for\n"
+       "                  file names and relblocks, may be given more than once\n"
+       "  -c file       - cache lookups in this file across runs\n"
+       "  -j n          - symbolizer processes (default: all cores)\n"
+       "  -s tool       - addr2line-compatible symbolizer (default: addr2line)\n\n",
+
+       argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  u8** manifests = ck_alloc(argc * sizeof(u8*));
+  u8 *out_fn = NULL, *cache_fn = NULL, *tmp_dir;
+  u32 manifest_cnt = 0, jobs_max = sysconf(_SC_NPROCESSORS_ONLN), i;
+  FILE* out;
+  s32 opt;
+
+  SAYF(cCYA "llcov-symbolize " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+o:m:c:j:s:")) > 0)
+
+    switch (opt) {
+
+      case 'o': out_fn = (u8*)optarg; break;
+      case 'm': manifests[manifest_cnt++] = (u8*)optarg; break;
+      case 'c': cache_fn = (u8*)optarg; break;
+      case 'j': jobs_max = atoi(optarg); break;
+      case 's': tool = (u8*)optarg; break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (optind == argc) usage((u8*)argv[0]);
+  if (!jobs_max) FATAL("Process count must be non-zero");
+
+  tmp_dir = (u8*)getenv("TMPDIR");
+  if (!tmp_dir || !*tmp_dir) tmp_dir = (u8*)"/tmp";
+
+  if (out_fn) {
+    out = fopen((char*)out_fn, "w");
+    if (!out) PFATAL("Unable to create '%s'", out_fn);
+  } else out = stdout;
+
+  for (i = 0; i < manifest_cnt; i++) read_manifest(manifests[i]);
+  index_manifest();
+
+  for (i = optind; i < argc; i++) read_input((u8*)argv[i], out);
+
+  if (pc_cnt) {
+
+    if (cache_fn) read_cache(cache_fn);
+
+    look_up(jobs_max, tmp_dir);
+
+    if (cache_fn) write_cache(cache_fn);
+
+    write_output(out);
+
+  }
+
+  if (fclose(out)) PFATAL("Unable to write output");
+
+  if (total_unknown)
+    WARNF("%llu offsets have no line information (stripped or wrong object?)",
+          total_unknown);
+
+  if (total_not_in_manifest)
+    WARNF("%llu blocks are not in the manifest (wrong build?)", total_not_in_manifest);
+
+  OKF("%u offsets in %u objects (%llu cached, %llu looked up), %llu records passed through.",
+      pc_cnt, obj_cnt, total_cached, total_looked_up, total_passed);
+
+  return 0;
+
+}
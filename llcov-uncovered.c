@@ -0,0 +1,420 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Builds a list that keeps only the blocks existing coverage has not
+  reached yet, e.g. so that a fuzzer is notified of new coverage without
+  paying for the blocks the test suite covers anyway.
+
+  Input is the instrumentation manifest of a build (LLCOV_LOGINSTFILE),
+  which has every instrumented block including its relblock, and the
+  merged coverage of that build. Output is a whitelist of the uncovered
+  blocks, or with -b a blacklist of the covered ones.
+
+  Whole files and runs of lines without a single covered (or uncovered)
+  block are written as file and line range entries, and only lines where
+  covered and uncovered blocks mix are listed block by block. This keeps
+  the list short, which is what the pass loads and matches fastest.
+
+  For builds with LLCOV_STABLE_IDS, coverage carries the stable block id
+  of the manifest in place of the relblock; -i keys blocks by that id, and
+  the list then names blocks by id too.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+struct blk {
+  u32 file, line, relblock;
+  u8  covered;
+};
+
+static struct blk* blks;
+static u32 blk_cnt, blk_alloc;
+static u32* blk_tab;                  /* Hash table of blk indices + 1    */
+static u32  blk_tab_size;
+
+static u8** files;                    /* File id -> name                  */
+static u32* file_tab;                 /* Hash table of file ids + 1       */
+static u32  file_cnt, file_tab_size;
+
+static u8 blacklist;                  /* List covered blocks instead (-b) */
+static u8 exact;                      /* One entry per block (-x)         */
+static u8 use_ids;                    /* Key blocks by stable id (-i)     */
+
+static u64 total_unknown, total_entries;
+
+
+static u32 hash_str(const u8* s) {
+
+  u32 h = 2166136261U;
+
+  while (*s) h = (h ^ *s++) * 16777619U;
+  return h;
+
+}
+
+
+static u32 hash_blk(u32 file, u32 line, u32 relblock) {
+
+  u64 h = ((u64)file << 40) ^ ((u64)line << 8) ^ relblock;
+
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return h;
+
+}
+
+
+/* Returns the id of a file name; with add = 0, -1 if it is unknown. */
+
+static s32 find_file(const u8* name, u8 add) {
+
+  u32 pos;
+
+  if (file_cnt * 2 >= file_tab_size) {
+
+    u32 size = file_tab_size ? file_tab_size * 2 : 1024, i;
+
+    ck_free(file_tab);
+    file_tab = ck_alloc(size * sizeof(u32));
+    file_tab_size = size;
+
+    for (i = 0; i < file_cnt; i++) {
+      pos = hash_str(files[i]) & (size - 1);
+      while (file_tab[pos]) pos = (pos + 1) & (size - 1);
+      file_tab[pos] = i + 1;
+    }
+
+    files = ck_realloc(files, size * sizeof(u8*));
+
+  }
+
+  pos = hash_str(name) & (file_tab_size - 1);
+
+  while (file_tab[pos]) {
+    if (!strcmp((char*)files[file_tab[pos] - 1], (char*)name)) return file_tab[pos] - 1;
+    pos = (pos + 1) & (file_tab_size - 1);
+  }
+
+  if (!add) return -1;
+
+  files[file_cnt] = (u8*)ck_strdup((u8*)name);
+  file_tab[pos] = ++file_cnt;
+
+  return file_cnt - 1;
+
+}
+
+
+/* Returns the block, adding it if add is set; NULL if unknown. */
+
+static struct blk* find_blk(u32 file, u32 line, u32 relblock, u8 add) {
+
+  u32 pos;
+
+  if (blk_cnt * 2 >= blk_tab_size) {
+
+    u32 size = blk_tab_size ? blk_tab_size * 2 : 65536, i;
+
+    ck_free(blk_tab);
+    blk_tab = ck_alloc(size * sizeof(u32));
+    blk_tab_size = size;
+
+    for (i = 0; i < blk_cnt; i++) {
+      pos = hash_blk(blks[i].file, blks[i].line, blks[i].relblock) & (size - 1);
+      while (blk_tab[pos]) pos = (pos + 1) & (size - 1);
+      blk_tab[pos] = i + 1;
+    }
+
+  }
+
+  pos = hash_blk(file, line, relblock) & (blk_tab_size - 1);
+
+  while (blk_tab[pos]) {
+
+    struct blk* b = &blks[blk_tab[pos] - 1];
+
+    if (b->file == file && b->line == line && b->relblock == relblock) return b;
+    pos = (pos + 1) & (blk_tab_size - 1);
+
+  }
+
+  if (!add) return NULL;
+
+  if (blk_cnt == blk_alloc) {
+    blk_alloc = MAX(blk_alloc * 2, 65536);
+    blks = ck_realloc(blks, blk_alloc * sizeof(struct blk));
+  }
+
+  blks[blk_cnt].file     = file;
+  blks[blk_cnt].line     = line;
+  blks[blk_cnt].relblock = relblock;
+  blk_tab[pos] = ++blk_cnt;
+
+  return &blks[blk_cnt - 1];
+
+}
+
+
+/* Splits "file:<name> [func:<f>] line:<n> relblock:<n>" in place, from
+   the end, since file names may contain spaces. */
+
+static u8 parse_rec(u8* s, u8** file, u32* line, u32* relblock, u32* bid) {
+
+  u8* sp;
+  u8 have = 0;
+
+  *bid = 0;
+
+  if (strncmp((char*)s, "file:", 5)) return 0;
+
+  while ((sp = (u8*)strrchr((char*)s + 5, ' '))) {
+
+    if (!strncmp((char*)sp + 1, "line:", 5)) {
+      *line = atoi((char*)sp + 6);
+      have |= 1;
+    } else if (!strncmp((char*)sp + 1, "relblock:", 9)) {
+      *relblock = atoi((char*)sp + 10);
+      have |= 2;
+    } else if (!strncmp((char*)sp + 1, "id:", 3)) {
+      *bid = atoi((char*)sp + 4);
+    } else if (strncmp((char*)sp + 1, "func:", 5)) break;
+
+    *sp = 0;
+
+  }
+
+  *file = s + 5;
+
+  return have == 3 && **file;
+
+}
+
+
+static void read_input(u8* fn, u8 manifest) {
+
+  FILE* f = strcmp((char*)fn, "-") ? fopen((char*)fn, "r") : stdin;
+  char* buf = NULL;
+  size_t alloc = 0;
+  ssize_t len;
+  u64 recs = 0;
+
+  if (!f) PFATAL("Unable to open '%s'", fn);
+
+  while ((len = getline(&buf, &alloc, f)) > 0) {
+
+    u8* file;
+    u32 line, relblock, bid;
+    s32 id;
+    struct blk* b;
+
+    if (buf[len - 1] == '\n') buf[len - 1] = 0;
+    if (!parse_rec((u8*)buf, &file, &line, &relblock, &bid)) continue;
+
+    if (manifest && use_ids) {
+      if (!bid) continue;
+      relblock = bid;
+    }
+
+    recs++;
+
+    if (manifest) {
+      find_blk(find_file(file, 1), line, relblock, 1);
+      continue;
+    }
+
+    /* Coverage of blocks the manifest does not know is ignored */
+
+    if ((id = find_file(file, 0)) < 0 ||
+        !(b = find_blk(id, line, relblock, 0))) {
+      total_unknown++;
+      continue;
+    }
+
+    b->covered = 1;
+
+  }
+
+  if (manifest && !recs)
+    FATAL("No blocks with %s in '%s', is it from an older pass?",
+          use_ids ? "block ids" : "relblocks", fn);
+
+  free(buf);
+  if (f != stdin) fclose(f);
+
+}
+
+
+static int cmp_blk(const void* a, const void* b) {
+
+  const struct blk *x = a, *y = b;
+
+  if (x->file != y->file) return x->file < y->file ? -1 : 1;
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+  return x->relblock < y->relblock ? -1 : x->relblock > y->relblock;
+
+}
+
+
+static void emit_range(FILE* out, u8* name, u32 first, u32 last) {
+
+  if (first == last) fprintf(out, "file:%s line:%u\n", name, first);
+  else fprintf(out, "file:%s line:%u-%u\n", name, first, last);
+
+  total_entries++;
+
+}
+
+
+/* Blocks [0, n) of one file, sorted by line and relblock. */
+
+static void emit_file(FILE* out, struct blk* b, u32 n) {
+
+  u8* name = files[b[0].file];
+  u32 i, j, want = 0, run_first = 0, run_last = 0;
+  u8 in_run = 0;
+
+  /* A block goes on the list if its coverage differs from the mode */
+
+#define WANTED(_b) ((_b)->covered == blacklist)
+
+  for (i = 0; i < n; i++) want += WANTED(&b[i]);
+
+  if (!want) return;
+
+  if (!exact && want == n) {
+    fprintf(out, "file:%s\n", name);
+    total_entries++;
+    return;
+  }
+
+  for (i = 0; i < n; i = j) {
+
+    u32 line_want = 0;
+
+    for (j = i; j < n && b[j].line == b[i].line; j++) line_want += WANTED(&b[j]);
+
+    if (!exact && line_want == j - i) {
+
+      /* Whole line, extend or start a run */
+
+      if (!in_run) run_first = b[i].line;
+      run_last = b[i].line;
+      in_run = 1;
+      continue;
+
+    }
+
+    if (in_run) {
+      emit_range(out, name, run_first, run_last);
+      in_run = 0;
+    }
+
+    for (; i < j; i++)
+      if (WANTED(&b[i])) {
+        fprintf(out, "file:%s line:%u relblock:%u\n", name, b[i].line, b[i].relblock);
+        total_entries++;
+      }
+
+  }
+
+  if (in_run) emit_range(out, name, run_first, run_last);
+
+#undef WANTED
+
+}
+
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] -m manifest coverage_file ...\n\n"
+
+       "Coverage files are in LLCov text format (see llcov-merge and\n"
+       "llcov-decode), '-' reads standard input.\n\n"
+
+       "Options:\n\n"
+
+       "  -m file       - instrumentation manifest (LLCOV_LOGINSTFILE), may\n"
+       "                  be given more than once\n"
+       "  -o file       - output file (default: stdout)\n"
+       "  -b            - write a blacklist of the covered blocks instead\n"
+       "  -x            - one entry per block, no file or range entries\n"
+       "  -i            - key blocks by stable block id (LLCOV_STABLE_IDS)\n\n",
+
+       argv0);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  u8** manifests = ck_alloc(argc * sizeof(u8*));
+  u8* out_fn = NULL;
+  u32 manifest_cnt = 0, covered = 0, i, j;
+  FILE* out;
+  s32 opt;
+
+  SAYF(cCYA "llcov-uncovered " cBRI "0.9a" cRST " by <choller@mozilla.com>\n");
+
+  while ((opt = getopt(argc, argv, "+m:o:bxi")) > 0)
+
+    switch (opt) {
+
+      case 'm': manifests[manifest_cnt++] = (u8*)optarg; break;
+      case 'o': out_fn = (u8*)optarg; break;
+      case 'b': blacklist = 1; break;
+      case 'x': exact = 1; break;
+      case 'i': use_ids = 1; break;
+
+      default: usage((u8*)argv[0]);
+
+    }
+
+  if (!manifest_cnt || optind == argc) usage((u8*)argv[0]);
+
+  for (i = 0; i < manifest_cnt; i++) read_input(manifests[i], 1);
+  for (i = optind; i < argc; i++) read_input((u8*)argv[i], 0);
+
+  if (total_unknown)
+    WARNF("%llu covered blocks are not in the manifest (wrong build?)", total_unknown);
+
+  qsort(blks, blk_cnt, sizeof(struct blk), cmp_blk);
+
+  if (out_fn) {
+    out = fopen((char*)out_fn, "w");
+    if (!out) PFATAL("Unable to create '%s'", out_fn);
+  } else out = stdout;
+
+  for (i = 0; i < blk_cnt; i = j) {
+
+    for (j = i; j < blk_cnt && blks[j].file == blks[i].file; j++)
+      covered += blks[j].covered;
+
+    emit_file(out, blks + i, j - i);
+
+  }
+
+  if (fclose(out)) PFATAL("Unable to write output");
+
+  OKF("%u of %u blocks covered, wrote %llu %slist entries.", covered, blk_cnt,
+      total_entries, blacklist ? "black" : "white");
+
+  return 0;
+
+}
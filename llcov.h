@@ -0,0 +1,72 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  In-process control API, provided by every LLCov runtime.
+
+  Lets the instrumented program itself drive coverage collection, e.g. to
+  reset coverage between test cases of a fuzzer or test harness and read
+  back what a single input covered, without going through files.
+
+  Blocks are identified by dense site ids, handed out in the order the
+  blocks are first executed. All functions are thread-safe; results are
+  racy with respect to probes running at the same time in other threads.
+
+  Programs that also have to link without a runtime can declare these
+  functions weak and check for NULL before calling them.
+ */
+
+#ifndef _HAVE_LLCOV_H
+#define _HAVE_LLCOV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Forget all coverage collected so far. Takes time proportional to the
+   number of blocks covered since the previous reset, not to the size of
+   the program. With snapshots enabled, pending coverage is written out
+   first. */
+
+void llcov_reset(void);
+
+/* Write every block covered since the last reset to fd, in the usual
+   "file:... line:... relblock:..." text format (also with
+   LLCOV_FORMAT=binary, which only applies to LLCOV_FILE). Returns the
+   number of records written or -1 on error. */
+
+long llcov_dump_to_fd(int fd);
+
+/* Number of distinct blocks covered since the last reset. */
+
+size_t llcov_covered_count(void);
+
+/* Coverage by site id: one byte per site, non-zero if the site has been
+   covered since the last reset. *size receives the number of sites known
+   so far. The array stays valid for the lifetime of the process and is
+   updated in place. Returns NULL if the runtime keeps no coverage map
+   (LLCOV_ABORT). */
+
+const uint8_t* llcov_get_bitmap(size_t* size);
+
+/* With LLCOV_HITCOUNTS set, the bytes returned by llcov_get_bitmap() count
+   executions (up to 255) instead. This folds them into AFL-style log2
+   buckets (1, 2, 4, 8, ..., 128) in place; call it once at the end of a
+   run, and llcov_reset() before the next one. */
+
+void llcov_classify_counts(void);
+
+/* Describe site id. Any output pointer may be NULL. Returns 0 on success,
+   -1 if there is no such site. */
+
+int llcov_get_site(size_t id, const char** filename, const char** funcname,
+                   uint32_t* line, uint32_t* relblock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ! _HAVE_LLCOV_H */
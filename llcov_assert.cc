@@ -6,20 +6,69 @@
 #include <set>
 #include <tuple>
 
-static FILE* filefd = NULL;
+#include "llcov-rt-inl.h"
+#include "llcov-api-inl.h"
+
+static void rt_api_init() {
+    rt_get_mode();
+    rt_map_demand();
+}
+
+static std::set< std::tuple<uint32_t, uint32_t, std::string> > seen;
+static pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void seen_atfork_prepare() {
+    pthread_mutex_lock(&seen_lock);
+}
+
+static void seen_atfork_parent() {
+    pthread_mutex_unlock(&seen_lock);
+}
+
+static void seen_atfork_child() {
+    pthread_mutex_init(&seen_lock, NULL);
+}
+
+/* A child writing to its own segment has to report everything again,
+   including the blocks its parent already reported. */
+static void child_hook(bool new_segment) {
+    if (!new_segment) return;
+
+    seen.clear();
+
+    u32 cnt = rt_api_sites();
+    for (u32 i = 0; i < cnt; i++) rt_site_flags[i] &= ~RT_FLAG_REPORTED;
+}
+
+static pthread_once_t hooks_once = PTHREAD_ONCE_INIT;
+
+static void install_hooks() {
+    rt_child_hook = child_hook;
+    pthread_atfork(seen_atfork_prepare, seen_atfork_parent, seen_atfork_child);
+}
+
+/* Sites in the map that have been reported are flagged there, so only the
+   first execution of a block (or blocks that did not fit into the map)
+   ever go to the set, which also catches the same file name at different
+   addresses. */
 
 inline __attribute__((always_inline))
-void writeData(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
-    static std::set< std::tuple<uint32_t, uint32_t, std::string> > seen;
+void writeData(int fd, const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
+    s32 id = rt_map_lookup(funcname, filename, line, relblock);
+
+    rt_map_mark(id);
+    if (id >= 0 && (__atomic_load_n(&rt_site_flags[id], __ATOMIC_RELAXED) & RT_FLAG_REPORTED)) return;
+
     std::tuple<uint32_t, uint32_t, std::string> tup(line, relblock, std::string(filename));
-    if (seen.find(tup) == seen.end()) {
-        fprintf(filefd, "file:%s line:%u relblock:%u\n", filename, line, relblock);
-        /*fwrite(funcname, strlen(funcname)+1, 1, filefd);
-        fwrite(filename, strlen(filename)+1, 1, filefd);
-        fwrite(&line, sizeof(uint32_t), 1, filefd);
-        fwrite(&relblock, sizeof(uint32_t), 1, filefd);*/
-        fflush(filefd);
-        seen.insert(tup);
+
+    pthread_mutex_lock(&seen_lock);
+    bool fresh = seen.insert(tup).second;
+    pthread_mutex_unlock(&seen_lock);
+
+    if (id >= 0) __atomic_fetch_or(&rt_site_flags[id], RT_FLAG_REPORTED, __ATOMIC_RELAXED);
+
+    if (fresh) {
+        rt_write_rec(fd, filename, line, relblock);
     }
 }
 
@@ -27,17 +76,24 @@ extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename
 	__attribute__((visibility("default")));
 
 extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
-    if (filefd != NULL) {
-        writeData(funcname, filename, line, relblock);
-    } else if (getenv("LLCOV_ABORT")) {
+    int fd;
+
+    switch (rt_get_mode()) {
+    case RT_FILE:
+        pthread_once(&hooks_once, install_hooks);
+        if ((fd = __atomic_load_n(&rt_outfd, __ATOMIC_ACQUIRE)) < 0) fd = rt_open_output();
+        if (fd >= 0) writeData(fd, funcname, filename, line, relblock);
+        break;
+    case RT_MAP:
+        /* Snapshots only ever contain newly covered blocks */
+        rt_map_hit(funcname, filename, line, relblock);
+        break;
+    case RT_ABORT:
 	    fprintf(stderr, "Assertion failure: LLCov: Block executed in file %s, line %u (function %s, line-relative block %u)\n", filename, line, funcname, relblock);
         abort();
-    } else if (getenv("LLCOV_STDERR")) {
+    case RT_STDERR:
+        rt_map_hit(funcname, filename, line, relblock);
         fprintf(stderr, "file:%s line:%u func:%s relblock:%u\n", filename, line, funcname, relblock);
-    } else if (getenv("LLCOV_FILE")) {
-        filefd = fopen(getenv("LLCOV_FILE"), "a");
-        if (filefd != NULL) {
-            writeData(funcname, filename, line, relblock);
-        }
+        break;
     }
 }
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* The filter replaces the site map, which is only set up on request */
+#define RT_MAP_OPTIONAL
+
+#include "llcov-rt-inl.h"
+#include "llcov-api-inl.h"
+
+/*
+ * Fixed-memory dedup runtime: Like llcov_assert.cc, every block is written
+ * only once, but blocks already reported are remembered in a blocked Bloom
+ * filter of a size chosen at startup instead of an ever-growing set. The
+ * probe never allocates; the filter is a static buffer (or, for a size
+ * given in LLCOV_BLOOM_SIZE that does not fit there, mapped once at init).
+ *
+ * Each key sets k bits within a single 64-byte block, so a lookup touches
+ * one cache line. A false positive means a block is not reported, so the
+ * filter is sized for a target false-positive rate (LLCOV_BLOOM_FPR) at the
+ * expected number of distinct blocks (LLCOV_BLOOM_EXPECT), unless
+ * LLCOV_BLOOM_SIZE gives the size directly. Keys spread unevenly over the
+ * blocks, and the fuller blocks dominate the rate, so size and k come from
+ * a model of the blocked filter rather than the textbook formulas, which
+ * are several times too optimistic here.
+ * Once the filter fills up beyond what it was tuned for, the rate
+ * degrades; set LLCOV_BLOOM_STATS to get the fill level at exit. A warning
+ * is printed regardless once the estimated rate exceeds the target.
+ *
+ * The filter is all the memory this runtime needs, so the coverage map
+ * behind llcov.h is only set up with LLCOV_MAP_SIZE (or for binary output
+ * and snapshots, which go through the map instead of the filter).
+ *
+ * Blocks are keyed by file name address, so a file name that exists at
+ * several addresses (e.g. a header included by different objects) may be
+ * reported once per address.
+ */
+
+#define BLOOM_BLOCK_WORDS 8           /* 64-byte blocks of 512 bits */
+
+static u64 bloom_static[LLCOV_BLOOM_SIZE / sizeof(u64)] __attribute__((aligned(64)));
+
+static u64* bloom;
+static u32 bloom_blocks;              /* Power of two                  */
+static u32 bloom_shift;               /* 64 - log2(bloom_blocks)       */
+static u32 bloom_k;                   /* Bits per key                  */
+static double bloom_fpr;              /* Target false-positive rate    */
+static u64 bloom_expect;              /* Blocks the filter is sized for */
+
+static u64 bloom_bits_set;
+static u64 bloom_reported;
+
+static void bloom_clear() {
+    memset(bloom, 0, (size_t)bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(u64));
+    __atomic_store_n(&bloom_bits_set, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bloom_reported, 0, __ATOMIC_RELAXED);
+}
+
+/* Accepts plain bytes or a k/m suffix. */
+
+static size_t bloom_parse_size(const char* s) {
+    char* end;
+    size_t v = strtoul(s, &end, 10);
+
+    if (*end == 'k' || *end == 'K') v <<= 10;
+    if (*end == 'm' || *end == 'M') v <<= 20;
+    return v;
+}
+
+static double bloom_pow(double x, u32 n) {
+    double p = 1;
+
+    while (n--) p *= x;
+    return p;
+}
+
+/* Expected false-positive rate with 'keys' keys per block on average and k
+   bits per key: the number of keys in a block is Poisson distributed, a
+   block holding i keys has each bit set with 1 - (1 - 1/512)^(k i). */
+
+static double bloom_model_fpr(double keys, u32 k) {
+    double term = 1, weight = 0, sum = 0;
+    double miss = bloom_pow(1 - 1.0 / (BLOOM_BLOCK_WORDS * 64), k);
+    double clear = 1;
+
+    if (keys > 500) return 1;
+
+    for (u32 i = 0; i < keys * 4 + 64; i++) {
+        sum += term * bloom_pow(1 - clear, k);
+        weight += term;
+        term *= keys / (i + 1);
+        clear *= miss;
+    }
+
+    return sum / weight;
+}
+
+/* The best k for a given load, and its rate */
+
+static u32 bloom_best_k(double keys, double* fpr) {
+    u32 best = 1;
+
+    *fpr = 1;
+
+    for (u32 k = 1; k <= 16; k++) {
+        double p = bloom_model_fpr(keys, k);
+        if (p < *fpr) {
+            *fpr = p;
+            best = k;
+        }
+    }
+
+    return best;
+}
+
+/* Estimated false-positive rate at the current fill level, the average of
+   (fill)^k over all blocks. Only used at exit. */
+
+static double bloom_est_fpr() {
+    double p = 0;
+
+    for (u32 b = 0; b < bloom_blocks; b++) {
+        u32 set = 0;
+
+        for (u32 w = 0; w < BLOOM_BLOCK_WORDS; w++)
+            set += __builtin_popcountll(__atomic_load_n(&bloom[b * BLOOM_BLOCK_WORDS + w], __ATOMIC_RELAXED));
+
+        p += bloom_pow((double)set / (BLOOM_BLOCK_WORDS * 64), bloom_k);
+    }
+
+    return p / bloom_blocks;
+}
+
+static void bloom_atexit() {
+    double est = bloom_est_fpr();
+    bool saturated = est > bloom_fpr;
+
+    if (!saturated && !getenv("LLCOV_BLOOM_STATS")) return;
+
+    fprintf(stderr, "LLCov: bloom filter %zu bytes, k=%u, %llu blocks reported (sized for %llu), "
+                    "%.1f%% bits set, estimated false-positive rate %.2g%s\n",
+            (size_t)bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(u64), bloom_k,
+            (unsigned long long)bloom_reported, (unsigned long long)bloom_expect,
+            100.0 * bloom_bits_set / ((double)bloom_blocks * BLOOM_BLOCK_WORDS * 64), est,
+            saturated ? " (above target, increase LLCOV_BLOOM_EXPECT)" : "");
+}
+
+/* A child writing to its own segment has to report everything again. */
+static void child_hook(bool new_segment) {
+    if (new_segment) bloom_clear();
+}
+
+static pthread_once_t bloom_once = PTHREAD_ONCE_INIT;
+
+static void bloom_init() {
+    const char* e = getenv("LLCOV_BLOOM_SIZE");
+    const char* f = getenv("LLCOV_BLOOM_FPR");
+    const char* x = getenv("LLCOV_BLOOM_EXPECT");
+    size_t size, blocks = 1;
+    double p;
+
+    bloom_fpr = f ? atof(f) : LLCOV_BLOOM_FPR;
+    if (bloom_fpr <= 0 || bloom_fpr >= 1) bloom_fpr = LLCOV_BLOOM_FPR;
+
+    bloom_expect = x && atoll(x) > 0 ? atoll(x) : LLCOV_BLOOM_EXPECT;
+
+    if (e) {
+        /* Explicit size, rounded down */
+        size = bloom_parse_size(e);
+        while (blocks * 2 * BLOOM_BLOCK_WORDS * sizeof(u64) <= size && blocks < (1U << 31)) blocks <<= 1;
+    } else {
+        /* The smallest filter that meets the target */
+        while (bloom_best_k((double)bloom_expect / blocks, &p) && p > bloom_fpr && blocks < (1U << 31))
+            blocks <<= 1;
+    }
+
+    bloom = bloom_static;
+    bloom_blocks = blocks;
+
+    if (blocks * BLOOM_BLOCK_WORDS * sizeof(u64) > sizeof(bloom_static)) {
+        void* p = mmap(NULL, blocks * BLOOM_BLOCK_WORDS * sizeof(u64), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("LLCov: unable to allocate bloom filter, using the default size");
+            bloom_blocks = sizeof(bloom_static) / (BLOOM_BLOCK_WORDS * sizeof(u64));
+        } else {
+            bloom = (u64*)p;
+        }
+    }
+
+    bloom_shift = 64;
+    for (u32 b = bloom_blocks; b > 1; b >>= 1) bloom_shift--;
+
+    bloom_k = bloom_best_k((double)bloom_expect / bloom_blocks, &p);
+
+    rt_child_hook = child_hook;
+    atexit(bloom_atexit);
+}
+
+/* Set the bits for a key. Returns true if the key was (probably) new. */
+
+static inline bool bloom_insert(const char* filename, uint32_t line, uint32_t relblock) {
+    u64 h = rt_map_hash(filename, line, relblock);
+
+    /* The map hash is fine for a probed hash table but too weak to derive
+       k independent bit positions from, mix it some more */
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    u64* blk = bloom + (bloom_shift < 64 ? (h >> bloom_shift) : 0) * BLOOM_BLOCK_WORDS;
+    u64 want[BLOOM_BLOCK_WORDS] = { 0 };
+    bool fresh = false;
+
+    /* Bit positions from the top bits of an LCG seeded with the whole hash.
+       Double hashing (a + i * b) within 512 bits has only some 2^17 distinct
+       patterns, and keys sharing a block collide far too often with it. */
+    for (u32 i = 0; i < bloom_k; i++) {
+        h = h * 6364136223846793005ULL + 1442695040888963407ULL;
+        want[h >> 61] |= 1ULL << (h >> 55 & 63);
+    }
+
+    for (u32 w = 0; w < BLOOM_BLOCK_WORDS; w++) {
+        if (!want[w] || (__atomic_load_n(&blk[w], __ATOMIC_RELAXED) & want[w]) == want[w]) continue;
+
+        u64 old = __atomic_fetch_or(&blk[w], want[w], __ATOMIC_RELAXED);
+        u64 added = want[w] & ~old;
+
+        if (added) {
+            __atomic_fetch_add(&bloom_bits_set, __builtin_popcountll(added), __ATOMIC_RELAXED);
+            fresh = true;
+        }
+    }
+
+    if (fresh) __atomic_fetch_add(&bloom_reported, 1, __ATOMIC_RELAXED);
+    return fresh;
+}
+
+static void rt_api_init() {
+    rt_get_mode();
+    rt_map_demand();
+}
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) 
+	__attribute__((visibility("default")));
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
+    int fd;
+
+    switch (rt_get_mode()) {
+    case RT_FILE:
+        pthread_once(&bloom_once, bloom_init);
+        if (rt_map_size) rt_map_hit(funcname, filename, line, relblock);
+        if (!bloom_insert(filename, line, relblock)) break;
+        if ((fd = __atomic_load_n(&rt_outfd, __ATOMIC_ACQUIRE)) < 0) fd = rt_open_output();
+        if (fd >= 0) rt_write_rec(fd, filename, line, relblock);
+        break;
+    case RT_MAP:
+        /* Snapshots only ever contain newly covered blocks */
+        rt_map_hit(funcname, filename, line, relblock);
+        break;
+    case RT_ABORT:
+        fprintf(stderr, "Assertion failure: LLCov: Block executed in file %s, line %u (function %s, line-relative block %u)\n", filename, line, funcname, relblock);
+        abort();
+    case RT_STDERR:
+        rt_map_hit(funcname, filename, line, relblock);
+        fprintf(stderr, "file:%s line:%u func:%s relblock:%u\n", filename, line, funcname, relblock);
+        break;
+    }
+}
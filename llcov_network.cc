@@ -1,50 +1,817 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-static int sockfd = 0;
+#include "config.h"
+#include "llcov-proto.h"
+#include "llcov-lz.h"
+#include "llcov-map-inl.h"
+#include "llcov-crash-inl.h"
+#include "llcov-api-inl.h"
 
-extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) 
-	__attribute__((visibility("default")));
+/*
+ * Network runtime: Probes never touch the socket. They push their record
+ * into a lock-free ring buffer and return. A background thread drains the
+ * ring, deduplicates, interns file names and sends framed records (see
+ * llcov-proto.h) over a non-blocking TCP or Unix socket, reconnecting as
+ * needed. If the sender cannot keep up, probes drop records and count them
+ * instead of waiting.
+ *
+ * Probes also record into the coverage map (llcov-map-inl.h), which backs
+ * the control API and remembers which sites have been queued, so the ring
+ * only ever sees a block once per process.
+ */
+
+#define MODE_UNINIT 0
+#define MODE_OFF    1
+#define MODE_NET    2
+#define MODE_STDERR 3
+#define MODE_ABORT  4
+#define MODE_MAP    5     /* Only record in the map (no LLCOV_HOST) */
+
+static int mode = MODE_UNINIT;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int need_restart;
+
+/* Probe-side ring (multi-producer, single-consumer) */
+
+struct ring_slot {
+    u64 seq;
+    const char* filename;
+    u32 line;
+    u32 relblock;
+};
+
+static ring_slot* ring;
+static u64 ring_head __attribute__((aligned(64)));
+static u64 ring_tail __attribute__((aligned(64)));
+static u64 dropped __attribute__((aligned(64)));
+
+static __thread u64 tcache[LLCOV_NET_TCACHE];
+
+/* Sender state, only touched by the sender thread */
+
+struct htab_ent {
+    u64 hash;
+    const char* ptr;
+    u32 line;
+    u32 relblock;
+    u32 val;
+};
+
+struct htab {
+    htab_ent* ents;
+    u32 size;
+    u32 cnt;
+};
+
+struct pend_rec {
+    u32 file_id;
+    u32 line;
+    u32 relblock;
+};
+
+static htab seen;           /* (filename ptr, line, relblock) already queued */
+static htab str_by_ptr;     /* filename ptr -> id                            */
+static htab str_by_name;    /* filename contents -> id                       */
+
+static const char** id_names;
+static u8* id_sent;         /* STRING frame sent on current connection       */
+static u32 id_cnt, id_alloc;
+
+static pend_rec* pending;
+static u32 pend_head, pend_cnt;
+
+static u8* wbuf;
+static u32 wbuf_len, wbuf_off, wbuf_alloc, wbuf_recs;
+
+static bool net_compress;   /* LLCOV_COMPRESS: send batches as LZ frames     */
+static u8* zbuf;
+static u32 zbuf_alloc;
+static u32* lz_htab;
+
+static int sockfd = -1;
+static int connecting;
+static int hello_sent;
+static u64 stats_dropped_sent;
+static u64 sent_recs;
+static u64 next_retry_ms;
+static u32 retry_ms = LLCOV_NET_RETRY_MIN;
+
+static char* net_host;
+static char* net_port;
+static char* net_path;
+
+static u8 build_id[LLCOV_MAX_BUILD_ID];
+static u16 build_id_len;
+
+static volatile int exit_requested;
+static volatile int drained;
+static int net_down;        /* Last connection attempt failed, or lost   */
+static u32 exit_ms = LLCOV_NET_EXIT_MS;
+static int crash_flushed;
+static __thread bool in_sender;
+
+static u64 now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(u32 ms) {
+    struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static inline u64 hash_rec(const char* filename, u32 line, u32 relblock) {
+    u64 h = (u64)(uintptr_t)filename * 0x9E3779B97F4A7C15ULL;
+    h ^= ((u64)line << 32 | relblock) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    return h | 1;
+}
+
+static u64 hash_str(const char* s) {
+    u64 h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (u8)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h | 1;
+}
+
+/* Find the entry for a key, or the empty slot where it belongs. */
+
+static htab_ent* htab_find(htab* t, u64 hash, const char* ptr, u32 line, u32 relblock, bool by_name) {
+    u32 mask = t->size - 1;
+    u32 i = (u32)hash & mask;
+    for (;;) {
+        htab_ent* e = &t->ents[i];
+        if (!e->hash) return e;
+        if (e->hash == hash && e->line == line && e->relblock == relblock
+                && (by_name ? !strcmp(e->ptr, ptr) : e->ptr == ptr))
+            return e;
+        i = (i + 1) & mask;
+    }
+}
+
+static void htab_grow(htab* t) {
+    if (t->size && t->cnt * 2 < t->size) return;
+
+    u32 old_size = t->size;
+    htab_ent* old = t->ents;
+
+    t->size = old_size ? old_size * 2 : 1024;
+    t->ents = (htab_ent*)calloc(t->size, sizeof(htab_ent));
+    if (!t->ents) abort();
+
+    for (u32 i = 0; i < old_size; i++) {
+        if (!old[i].hash) continue;
+        u32 j = (u32)old[i].hash & (t->size - 1);
+        while (t->ents[j].hash) j = (j + 1) & (t->size - 1);
+        t->ents[j] = old[i];
+    }
+    free(old);
+}
+
+/* Map a file name pointer to a stream-wide id, merging equal strings
+   coming from different translation units. */
+
+static u32 intern(const char* filename) {
+    u64 h = hash_rec(filename, 0, 0);
+    htab_ent* e = htab_find(&str_by_ptr, h, filename, 0, 0, false);
+    if (e->hash) return e->val;
+
+    u64 hn = hash_str(filename);
+    htab_ent* n = htab_find(&str_by_name, hn, filename, 0, 0, true);
+    u32 id;
+
+    if (n->hash) {
+        id = n->val;
+    } else {
+        if (id_cnt == id_alloc) {
+            id_alloc = id_alloc ? id_alloc * 2 : 256;
+            id_names = (const char**)realloc(id_names, id_alloc * sizeof(char*));
+            id_sent = (u8*)realloc(id_sent, id_alloc);
+            if (!id_names || !id_sent) abort();
+        }
+        id = id_cnt++;
+        id_names[id] = filename;
+        id_sent[id] = 0;
+
+        n->hash = hn; n->ptr = filename; n->val = id;
+        str_by_name.cnt++;
+        htab_grow(&str_by_name);
+    }
+
+    e->hash = h; e->ptr = filename; e->val = id;
+    str_by_ptr.cnt++;
+    htab_grow(&str_by_ptr);
+
+    return id;
+}
+
+/* Move records from the ring into the pending queue, dropping duplicates.
+   Returns the number of ring slots consumed. */
+
+static u32 drain_ring() {
+    u32 n = 0;
+
+    while (pend_cnt < LLCOV_NET_PENDING) {
+        ring_slot* s = &ring[ring_tail & (LLCOV_NET_RING - 1)];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) break;
+
+        const char* filename = s->filename;
+        u32 line = s->line;
+        u32 relblock = s->relblock;
+
+        __atomic_store_n(&s->seq, ring_tail + LLCOV_NET_RING, __ATOMIC_RELEASE);
+        ring_tail++;
+        n++;
+
+        u64 h = hash_rec(filename, line, relblock);
+        htab_ent* e = htab_find(&seen, h, filename, line, relblock, false);
+        if (e->hash) continue;
+
+        e->hash = h; e->ptr = filename; e->line = line; e->relblock = relblock;
+        seen.cnt++;
+        htab_grow(&seen);
+
+        pend_rec* p = &pending[(pend_head + pend_cnt) % LLCOV_NET_PENDING];
+        p->file_id = intern(filename);
+        p->line = line;
+        p->relblock = relblock;
+        pend_cnt++;
+    }
+
+    return n;
+}
+
+static u8* wbuf_reserve(u32 len) {
+    if (wbuf_len + len > wbuf_alloc) {
+        while (wbuf_len + len > wbuf_alloc)
+            wbuf_alloc = wbuf_alloc ? wbuf_alloc * 2 : 65536;
+        wbuf = (u8*)realloc(wbuf, wbuf_alloc);
+        if (!wbuf) abort();
+    }
+    u8* p = wbuf + wbuf_len;
+    wbuf_len += len;
+    return p;
+}
+
+/* Replace the contents of wbuf by a single LZ frame, if that is smaller.
+   This runs on the sender thread, probes never pay for it. */
+
+static void compress_wbuf() {
+    u32 need = LLCOV_FRAME_HDR_SIZE + 4 + LLCOV_LZ_BOUND(wbuf_len);
+
+    if (!lz_htab) lz_htab = (u32*)malloc(LLCOV_LZ_HASH_SIZE * sizeof(u32));
+    if (need > zbuf_alloc) {
+        zbuf_alloc = need;
+        zbuf = (u8*)realloc(zbuf, zbuf_alloc);
+    }
+    if (!lz_htab || !zbuf) abort();
+
+    u32 zlen = llcov_lz_compress(wbuf, wbuf_len, zbuf + LLCOV_FRAME_HDR_SIZE + 4, lz_htab);
+    if (LLCOV_FRAME_HDR_SIZE + 4 + zlen >= wbuf_len) return;
+
+    llcov_put_frame_hdr(zbuf, LLCOV_FR_LZ, 4 + zlen);
+    llcov_put_u32(zbuf + LLCOV_FRAME_HDR_SIZE, wbuf_len);
+
+    u8* t = wbuf;
+    u32 a = wbuf_alloc;
+    wbuf = zbuf;
+    wbuf_alloc = zbuf_alloc;
+    wbuf_len = LLCOV_FRAME_HDR_SIZE + 4 + zlen;
+    zbuf = t;
+    zbuf_alloc = a;
+}
+
+/* Serialize the next batch of pending records. The records stay queued
+   until the whole buffer made it to the socket, so a connection loss
+   mid-way causes them to be sent again on the next connection. */
+
+static void fill_wbuf() {
+    u8* p;
+
+    wbuf_len = wbuf_off = wbuf_recs = 0;
+
+    if (!hello_sent) {
+        p = wbuf_reserve(LLCOV_HELLO_SIZE(build_id_len));
+        llcov_put_hello(p, getpid(), build_id, build_id_len);
+    }
+
+    u64 d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (d != stats_dropped_sent) {
+        p = wbuf_reserve(LLCOV_FRAME_HDR_SIZE + 16);
+        p += llcov_put_frame_hdr(p, LLCOV_FR_STATS, 16);
+        llcov_put_u64(p, d);
+        llcov_put_u64(p + 8, sent_recs);
+        stats_dropped_sent = d;
+    }
+
+    u32 n = MIN(pend_cnt, (u32)LLCOV_NET_BATCH);
+
+    for (u32 i = 0; i < n; i++) {
+        u32 id = pending[(pend_head + i) % LLCOV_NET_PENDING].file_id;
+        if (id_sent[id]) continue;
+
+        u32 slen = strlen(id_names[id]);
+        p = wbuf_reserve(LLCOV_FRAME_HDR_SIZE + 4 + slen);
+        p += llcov_put_frame_hdr(p, LLCOV_FR_STRING, 4 + slen);
+        llcov_put_u32(p, id);
+        memcpy(p + 4, id_names[id], slen);
+        id_sent[id] = 1;
+    }
+
+    if (n) {
+        u32 start = wbuf_len, len = 0;
+        llcov_vstate st = { 0, 0 };
+
+        p = wbuf_reserve(LLCOV_FRAME_HDR_SIZE + n * LLCOV_VREC_MAX);
+        for (u32 i = 0; i < n; i++) {
+            pend_rec* r = &pending[(pend_head + i) % LLCOV_NET_PENDING];
+            len += llcov_put_vrec(p + LLCOV_FRAME_HDR_SIZE + len, &st, r->file_id, r->line, r->relblock);
+        }
+        llcov_put_frame_hdr(p, LLCOV_FR_VBLOCKS, len);
+        wbuf_len = start + LLCOV_FRAME_HDR_SIZE + len;
+    }
+
+    wbuf_recs = n;
+
+    if (net_compress && wbuf_len > 64 && wbuf_len <= LLCOV_MAX_FRAME) compress_wbuf();
+}
+
+static void disconnect() {
+    __atomic_store_n(&net_down, 1, __ATOMIC_RELAXED);
+
+    if (sockfd >= 0) close(sockfd);
+    sockfd = -1;
+    connecting = 0;
+    hello_sent = 0;
+    wbuf_len = wbuf_off = wbuf_recs = 0;
+    if (id_cnt) memset(id_sent, 0, id_cnt);
+
+    next_retry_ms = now_ms() + retry_ms;
+    retry_ms = MIN(retry_ms * 2, (u32)LLCOV_NET_RETRY_MAX);
+}
+
+static void start_connect() {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if (net_path) {
+        struct sockaddr_un* sun = (struct sockaddr_un*)&addr;
+        sun->sun_family = AF_UNIX;
+        strncpy(sun->sun_path, net_path, sizeof(sun->sun_path) - 1);
+        addr_len = sizeof(struct sockaddr_un);
+        family = AF_UNIX;
+    } else {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(net_host, net_port, &hints, &res) || !res) {
+            disconnect();
+            return;
+        }
+        memcpy(&addr, res->ai_addr, res->ai_addrlen);
+        addr_len = res->ai_addrlen;
+        family = res->ai_family;
+        freeaddrinfo(res);
+    }
+
+    sockfd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        disconnect();
+        return;
+    }
+
+    if (connect(sockfd, (struct sockaddr*)&addr, addr_len) == 0) {
+        connecting = 0;
+        retry_ms = LLCOV_NET_RETRY_MIN;
+        __atomic_store_n(&net_down, 0, __ATOMIC_RELAXED);
+    } else if (errno == EINPROGRESS || errno == EAGAIN) {
+        connecting = 1;
+    } else {
+        disconnect();
+    }
+}
+
+static void finish_connect() {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        disconnect();
+        return;
+    }
+
+    connecting = 0;
+    retry_ms = LLCOV_NET_RETRY_MIN;
+    __atomic_store_n(&net_down, 0, __ATOMIC_RELAXED);
+}
+
+/* Push as much of the write buffer as the socket takes without blocking. */
+
+static void flush_wbuf() {
+    if (wbuf_off == wbuf_len) fill_wbuf();
+
+    while (wbuf_off < wbuf_len) {
+        ssize_t r = send(sockfd, wbuf + wbuf_off, wbuf_len - wbuf_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) disconnect();
+            return;
+        }
+        wbuf_off += r;
+    }
+
+    /* Whole batch is out, retire its records */
+    pend_head = (pend_head + wbuf_recs) % LLCOV_NET_PENDING;
+    pend_cnt -= wbuf_recs;
+    sent_recs += wbuf_recs;
+    hello_sent = 1;
+    wbuf_len = wbuf_off = wbuf_recs = 0;
+}
+
+static int note_cb(struct dl_phdr_info* info, size_t size, void* data) {
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* ph = &info->dlpi_phdr[i];
+        if (ph->p_type != PT_NOTE) continue;
+
+        const u8* p = (const u8*)(info->dlpi_addr + ph->p_vaddr);
+        const u8* end = p + ph->p_memsz;
+
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)* nh = (const ElfW(Nhdr)*)p;
+            const u8* name = p + sizeof(ElfW(Nhdr));
+            const u8* desc = name + ((nh->n_namesz + 3) & ~3);
+
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 && !memcmp(name, "GNU", 4)) {
+                build_id_len = MIN(nh->n_descsz, (u32)LLCOV_MAX_BUILD_ID);
+                memcpy(build_id, desc, build_id_len);
+                return 1;
+            }
+            p = desc + ((nh->n_descsz + 3) & ~3);
+        }
+    }
+
+    /* Only look at the main program, which is reported first */
+    return 1;
+}
+
+/* Identify the binary we are running in, so the collector can keep
+   coverage of different builds apart. Falls back to a hash of the
+   executable path if there is no GNU build id note. */
+
+static void find_build_id() {
+    dl_iterate_phdr(note_cb, NULL);
+    if (build_id_len) return;
+
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len < 0) len = 0;
+    path[len] = 0;
+
+    llcov_put_u64(build_id, hash_str(path));
+    build_id_len = 8;
+}
+
+static void* sender_thread(void*) {
+    u32 idle_ms = 1;
+
+    in_sender = true;
+    find_build_id();
+    htab_grow(&seen);
+    htab_grow(&str_by_ptr);
+    htab_grow(&str_by_name);
+
+    for (;;) {
+        /* Read before draining: everything queued before the request is
+           in the ring by then */
+        int exiting = __atomic_load_n(&exit_requested, __ATOMIC_ACQUIRE);
+        u32 n = drain_ring();
+
+        if (sockfd < 0 && now_ms() >= next_retry_ms) start_connect();
+
+        struct pollfd pfd;
+        int timeout;
+
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (connecting || (sockfd >= 0 && (pend_cnt || wbuf_off < wbuf_len)))
+            pfd.events |= POLLOUT;
+
+        if (n) {
+            idle_ms = 1;
+            timeout = 0;
+        } else {
+            if (exiting && !pend_cnt && wbuf_off == wbuf_len)
+                drained = 1;
+            timeout = idle_ms;
+            idle_ms = MIN(idle_ms * 2, 16u);
+        }
+
+        if (sockfd < 0) {
+            if (timeout) sleep_ms(timeout);
+            continue;
+        }
+
+        if (poll(&pfd, 1, timeout) < 0) continue;
+
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            if (connecting) finish_connect(); else disconnect();
+            continue;
+        }
+
+        if (pfd.revents & POLLIN) {
+            /* The collector never talks back, so this is EOF or junk */
+            u8 junk[256];
+            ssize_t r = recv(sockfd, junk, sizeof(junk), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+                disconnect();
+                continue;
+            }
+        }
+
+        if (pfd.revents & POLLOUT) {
+            if (connecting) finish_connect();
+            if (sockfd >= 0 && !connecting) flush_wbuf();
+        }
+    }
+
+    return NULL;
+}
+
+/* Give the sender a bounded amount of time (LLCOV_NET_EXIT_MS) to get
+   queued records out, unless the collector cannot be reached anyway.
+   Async-signal-safe. */
+
+static void net_drain() {
+    __atomic_store_n(&exit_requested, 1, __ATOMIC_RELEASE);
+    for (u32 i = 0; i < exit_ms && !drained && !__atomic_load_n(&net_down, __ATOMIC_RELAXED); i++)
+        sleep_ms(1);
+}
+
+static void net_atexit() {
+    net_drain();
+
+    u64 d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    u64 queued = drained ? 0 : pend_cnt + __atomic_load_n(&ring_head, __ATOMIC_RELAXED) - ring_tail;
+
+    if (d || !drained)
+        fprintf(stderr, "LLCov: network runtime dropped %llu probe records (ring full), %llu still queued at exit%s\n",
+                (unsigned long long)d, (unsigned long long)queued, net_down ? " (collector unreachable)" : "");
+}
+
+static bool start_sender() {
+    pthread_t t;
+    pthread_attr_t attr;
+    bool ok;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    ok = !pthread_create(&t, &attr, sender_thread, NULL);
+    if (!ok) perror("LLCov: pthread_create");
+
+    pthread_attr_destroy(&attr);
+    return ok;
+}
+
+/* Fatal signal with LLCOV_CRASH_FLUSH: the sender keeps running while the
+   crashing thread waits for it, just as at exit. If the sender itself
+   crashed, whatever it still had queued is lost. */
+
+static void net_crash_flush() {
+    if (in_sender || __atomic_exchange_n(&crash_flushed, 1, __ATOMIC_ACQ_REL)) return;
+    net_drain();
+}
+
+/* The sender thread does not survive fork() and may have left its state
+   half-updated. The child starts over with fresh tables (leaking the old
+   ones), its own connection and HELLO, and gets a new sender on its next
+   probe. Starting the thread right here is not safe in a child of a
+   multi-threaded process. */
+
+static void net_atfork_child() {
+    if (sockfd >= 0) close(sockfd);
+    sockfd = -1;
+    connecting = hello_sent = 0;
+
+    memset(&seen, 0, sizeof(seen));
+    memset(&str_by_ptr, 0, sizeof(str_by_ptr));
+    memset(&str_by_name, 0, sizeof(str_by_name));
+    id_names = NULL;
+    id_sent = NULL;
+    id_cnt = id_alloc = 0;
+
+    pend_head = pend_cnt = 0;
+    wbuf = NULL;
+    wbuf_len = wbuf_off = wbuf_alloc = wbuf_recs = 0;
+    zbuf = NULL;
+    zbuf_alloc = 0;
+    lz_htab = NULL;
+
+    stats_dropped_sent = sent_recs = dropped = 0;
+    next_retry_ms = 0;
+    retry_ms = LLCOV_NET_RETRY_MIN;
+    exit_requested = drained = crash_flushed = net_down = 0;
+
+    ring_head = ring_tail = 0;
+    for (u64 i = 0; i < LLCOV_NET_RING; i++) ring[i].seq = i;
+    memset(tcache, 0, sizeof(tcache));
+
+    /* New connection, new HELLO: everything has to be sent again */
+    u32 cnt = rt_api_sites();
+    for (u32 i = 0; i < cnt; i++) rt_site_flags[i] &= ~RT_FLAG_SENT;
+
+    need_restart = 1;
+    __atomic_store_n(&mode, MODE_UNINIT, __ATOMIC_RELEASE);
+}
+
+static void net_init() {
+    const char* host = getenv("LLCOV_HOST");
+    int m = MODE_OFF;
 
-extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
     if (getenv("LLCOV_ABORT")) {
-	    fprintf(stderr, "Assertion failure: LLCov: Block executed in file %s, line %u (function %s, line-relative block %u)\n", filename, line, funcname, relblock);
-        abort();
-    } else if (sockfd > 0) {
-        
+        __atomic_store_n(&mode, MODE_ABORT, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (!rt_map_init()) perror("LLCov: unable to allocate coverage map");
+
+    /* Ring overruns show up in the live statistics */
+    __atomic_store_n(&rt_stats_dropped, &dropped, __ATOMIC_RELEASE);
+
+    net_compress = getenv("LLCOV_COMPRESS") != NULL;
+
+    const char* e = getenv("LLCOV_NET_EXIT_MS");
+    if (e) {
+        char* end;
+        errno = 0;
+        unsigned long ms = strtoul(e, &end, 10);
+        if (*e == '-' || end == e || *end || errno) {
+            fprintf(stderr, "LLCov: ignoring invalid LLCOV_NET_EXIT_MS: %s\n", e);
+        } else {
+            exit_ms = ms > LLCOV_NET_EXIT_MAX ? LLCOV_NET_EXIT_MAX : ms;
+        }
+    }
+
+    if (host && !strncmp(host, "unix:", 5) && strlen(host + 5) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+        fprintf(stderr, "LLCov: socket path in LLCOV_HOST too long: %s\n", host + 5);
+        host = NULL;
+    }
+
+    if (host && *host) {
+        if (!strncmp(host, "unix:", 5)) {
+            net_path = strdup(host + 5);
+        } else {
+            char port[16];
+            const char* colon = strchr(host, ':');
+            if (colon && !strchr(colon + 1, ':')) {
+                net_host = strndup(host, colon - host);
+                net_port = strdup(colon + 1);
+            } else {
+                snprintf(port, sizeof(port), "%u", LLCOV_NET_PORT);
+                net_host = strdup(host);
+                net_port = strdup(port);
+            }
+        }
+
+        ring = (ring_slot*)mmap(NULL, LLCOV_NET_RING * sizeof(ring_slot), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        pending = (pend_rec*)malloc(LLCOV_NET_PENDING * sizeof(pend_rec));
+
+        if (ring == MAP_FAILED || !pending) {
+            perror("LLCov: network runtime");
+        } else {
+            for (u64 i = 0; i < LLCOV_NET_RING; i++) ring[i].seq = i;
+
+            if (start_sender()) {
+                atexit(net_atexit);
+                pthread_atfork(NULL, NULL, net_atfork_child);
+                if (getenv("LLCOV_CRASH_FLUSH")) rt_crash_init(net_crash_flush);
+                m = MODE_NET;
+            }
+        }
     } else if (getenv("LLCOV_STDERR")) {
-        fprintf(stderr, "file:%s line:%u function:%s relblock:%u\n", filename, line, funcname, relblock);
-    } else if (sockfd == 0) {
-        char* llcov_host = getenv("LLCOV_HOST");
-        if (llcov_host) {
-                struct sockaddr_in pin;
-                struct hostent *hp;
-                
-                if ((hp = gethostbyname(llcov_host)) == 0) {
-                    perror("gethostbyname");
-                    sockfd = -1;
-                    return;
-                }
-
-                memset(&pin, 0, sizeof(pin));
-                pin.sin_family = AF_INET;
-                pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
-                pin.sin_port = htons(7777);
-
-                if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                    perror("socket");
-                    sockfd = -1;
-                    return;
-                }
-
-                if (connect(sockfd,(struct sockaddr *)  &pin, sizeof(pin)) == -1) {
-                    perror("connect");
-                    sockfd = -1;
-                    return;
-                }
+        m = MODE_STDERR;
+    }
+
+    /* Nowhere to send coverage to: probes only fill the map for the
+       control API once it is used, see rt_api_init() */
+    if (m == MODE_OFF && rt_map_size && getenv("LLCOV_MAP_SIZE")) m = MODE_MAP;
+
+    __atomic_store_n(&mode, m, __ATOMIC_RELEASE);
+}
+
+static void rt_api_init() {
+    int m = MODE_OFF;
+
+    if (__atomic_load_n(&mode, __ATOMIC_ACQUIRE) == MODE_UNINIT && !need_restart)
+        pthread_once(&init_once, net_init);
+
+    if (rt_map_size)
+        __atomic_compare_exchange_n(&mode, &m, MODE_MAP, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* Lock-free enqueue. Never blocks, drops the record if the ring is full.
+   Returns false if the record was dropped. Without a map site, the
+   per-thread cache keeps hot blocks out of the ring instead. */
+
+static inline bool net_push(const char* filename, uint32_t line, uint32_t relblock, bool filter) {
+    u64 h = hash_rec(filename, line, relblock);
+    u64* tc = &tcache[h >> 56 & (LLCOV_NET_TCACHE - 1)];
+
+    if (filter) {
+        /* Already pushed recently by this thread */
+        if (*tc == h) return true;
+        *tc = h;
+    }
+
+    u64 pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        ring_slot* s = &ring[pos & (LLCOV_NET_RING - 1)];
+        u64 seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        s64 dif = (s64)(seq - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                s->filename = filename;
+                s->line = line;
+                s->relblock = relblock;
+                __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            /* Forget the record so we retry it the next time around */
+            if (filter) *tc = 0;
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock)
+	__attribute__((visibility("default")));
+
+extern "C" void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock) {
+    int m = __atomic_load_n(&mode, __ATOMIC_ACQUIRE);
+
+    if (m == MODE_UNINIT) {
+        if (__atomic_exchange_n(&need_restart, 0, __ATOMIC_ACQ_REL)) {
+            /* First probe in a forked child */
+            if (start_sender()) __atomic_store_n(&mode, MODE_NET, __ATOMIC_RELEASE);
         } else {
-            sockfd = -1;
+            pthread_once(&init_once, net_init);
         }
+        m = __atomic_load_n(&mode, __ATOMIC_ACQUIRE);
+    }
+
+    if (m == MODE_NET) {
+        s32 id = rt_map_lookup(funcname, filename, line, relblock);
+
+        rt_map_mark(id);
+
+        if (id < 0) {
+            net_push(filename, line, relblock, true);
+        } else if (!(__atomic_load_n(&rt_site_flags[id], __ATOMIC_RELAXED) & RT_FLAG_SENT)) {
+            /* Racing threads may both push, the sender dedups anyway */
+            if (net_push(filename, line, relblock, false))
+                __atomic_fetch_or(&rt_site_flags[id], RT_FLAG_SENT, __ATOMIC_RELAXED);
+        }
+    } else if (m == MODE_ABORT) {
+        fprintf(stderr, "Assertion failure: LLCov: Block executed in file %s, line %u (function %s, line-relative block %u)\n", filename, line, funcname, relblock);
+        abort();
+    } else if (m == MODE_MAP) {
+        rt_map_hit(funcname, filename, line, relblock);
+    } else if (m == MODE_STDERR) {
+        rt_map_hit(funcname, filename, line, relblock);
+        fprintf(stderr, "file:%s line:%u function:%s relblock:%u\n", filename, line, funcname, relblock);
     }
 }
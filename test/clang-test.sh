@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Checks which TUs llcov-clang compiles with the pass when a whitelist is
+# set. The real compiler is replaced by a script that logs its arguments
+# (and runs cc for the -M include scan), so neither clang nor the pass
+# have to be around. Run by 'make test'.
+#
+# Usage: clang-test.sh [ build-dir ]
+#
+
+TOP=${1:-.}
+TOP=`cd "$TOP" && pwd`
+TMP=`mktemp -d /tmp/llcov-clang-test.XXXXXX` || exit 1
+FAIL=0
+
+trap 'rm -rf "$TMP"' EXIT
+
+for v in `env | sed -n 's/^\(LLCOV_[A-Z_]*\)=.*/\1/p'`; do
+  unset "$v"
+done
+
+export LLCOV_QUIET=1
+
+cat >"$TMP/fakecc" <<EOT
+#!/bin/sh
+for a; do [ "\$a" = "-M" ] && exec cc "\$@"; done
+echo "\$@" >"$TMP/log"
+EOT
+chmod +x "$TMP/fakecc"
+
+mkdir "$TMP/dom"
+echo 'int foo(void) { return 1; }' >"$TMP/dom/foo.cpp"
+echo '#include "dom/foo.cpp"' >"$TMP/Unified_cpp_0.cpp"
+echo '#include "foo.h"' >"$TMP/bar.c"
+echo 'int bar;' >"$TMP/other.c"
+
+# name source whitelist-entry expect-pass (1 or 0)
+check() {
+
+  echo "$3" >"$TMP/list"
+  rm -f "$TMP/log"
+
+  (cd "$TMP" && LLCOV_CC="$TMP/fakecc" LLCOV_WHITELIST="$TMP/list" \
+    "$TOP/llcov-clang" -c "$2" -o "$TMP/x.o")
+
+  if grep -q llcov-llvm-pass.so "$TMP/log" 2>/dev/null; then GOT=1; else GOT=0; fi
+
+  if [ "$GOT" != "$4" ]; then
+    echo "[-] clang: $1: pass loaded: $GOT, expected $4"
+    FAIL=1
+  else
+    echo "[+] clang: $1"
+  fi
+
+}
+
+check "own source" other.c "file:other.c" 1
+check "unrelated source" other.c "file:dom/foo.cpp" 0
+check "included source" Unified_cpp_0.cpp "file:dom/foo.cpp" 1
+check "included header" bar.c "file:foo.h" 1
+check "missing header" other.c "file:foo.h" 0
+
+exit $FAIL
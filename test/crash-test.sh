@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Checks that LLCOV_CRASH_FLUSH gets coverage out of crashing programs,
+# for the snapshot modes of the default runtime and for the network
+# runtime. Run by 'make test'.
+#
+# Usage: crash-test.sh [ build-dir ]
+#
+
+TOP=${1:-.}
+TMP=`mktemp -d /tmp/llcov-crash-test.XXXXXX` || exit 1
+BLOCKS=5000
+FAIL=0
+
+trap 'rm -rf "$TMP"' EXIT
+
+for v in `env | sed -n 's/^\(LLCOV_[A-Z_]*\)=.*/\1/p'`; do
+  unset "$v"
+done
+
+export LLCOV_CRASH_FLUSH=1
+
+# Counts the distinct crash.c blocks in the text records on stdin against
+# $BLOCKS, and complains with NAME if any are missing.
+
+count() {
+
+  NAME=$1
+  GOT=`grep '^file:crash.c ' | sort -u | wc -l | tr -d ' '`
+
+  if [ "$GOT" != "$BLOCKS" ]; then
+    echo "[-] crash: $NAME: $GOT of $BLOCKS blocks written"
+    FAIL=1
+  else
+    echo "[+] crash: $NAME"
+  fi
+
+}
+
+# name how env...
+check_file() {
+
+  NAME=$1
+  HOW=$2
+  shift 2
+
+  rm -f "$TMP/out"
+  env LLCOV_FILE="$TMP/out" "$@" "$TOP/test/llcov-crash-rt" "$HOW" $BLOCKS 2>/dev/null
+
+  case " $* " in
+    *" LLCOV_FORMAT=binary "*) "$TOP/llcov-decode" "$TMP/out" 2>/dev/null | count "$NAME" ;;
+    *) count "$NAME" <"$TMP/out" ;;
+  esac
+
+}
+
+# Snapshots far apart, so everything is still in the map when it crashes
+
+for HOW in segv abort; do
+  check_file "snapshots, $HOW" $HOW LLCOV_SNAPSHOT_INTERVAL=3600
+  check_file "binary, $HOW" $HOW LLCOV_FORMAT=binary
+done
+
+# Network runtime: records still in the ring when it crashes
+
+for HOW in segv abort; do
+
+  rm -rf "$TMP/collect" "$TMP/sock"
+
+  "$TOP/llcov-collectd" -j 1 -u "$TMP/sock" -o "$TMP/collect" >/dev/null 2>&1 &
+  CPID=$!
+  n=0
+  while [ ! -S "$TMP/sock" ] && [ $n -lt 100 ]; do sleep 0.05; n=$((n + 1)); done
+
+  LLCOV_HOST="unix:$TMP/sock" "$TOP/test/llcov-crash-net" $HOW $BLOCKS 2>/dev/null
+
+  kill $CPID; wait $CPID
+  cat "$TMP"/collect/*.cov 2>/dev/null | count "network, $HOW"
+
+done
+
+exit $FAIL
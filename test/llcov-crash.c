@@ -0,0 +1,41 @@
+/*
+  LLCov - LLVM Live Coverage instrumentation
+  -----------------------------------------
+
+  Crash test program, linked against one of the runtimes. Runs blocks
+  crash.c:1 to crash.c:N (relblock 0) and then dies the way it is told:
+
+    segv  - NULL pointer write
+    abort - abort()
+    exit  - no crash, for comparison
+
+  test/crash-test.sh checks that all N blocks make it to the output.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void llvm_llcov_block_call(const char* funcname, const char* filename, uint32_t line, uint32_t relblock);
+
+int main(int argc, char** argv) {
+
+  uint32_t n, i;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s segv|abort|exit blocks\n", argv[0]);
+    return 1;
+  }
+
+  n = atoi(argv[2]);
+
+  for (i = 1; i <= n; i++)
+    llvm_llcov_block_call("main", "crash.c", i, 0);
+
+  if (!strcmp(argv[1], "segv")) *(volatile int*)0 = 1;
+  if (!strcmp(argv[1], "abort")) abort();
+
+  return 0;
+
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# LLCov - LLVM Live Coverage instrumentation
+# -----------------------------------------
+#
+# Checks that llcov-merge keeps every kind of record intact. Run by
+# 'make test'.
+#
+# Usage: merge-test.sh [ llcov-merge ]
+#
+
+MERGE=${1:-./llcov-merge}
+TMP=`mktemp -d /tmp/llcov-merge-test.XXXXXX` || exit 1
+FAIL=0
+
+trap 'rm -rf "$TMP"' EXIT
+
+# name expected-output merge-args...
+check() {
+
+  NAME=$1
+  EXPECT=$2
+  shift 2
+
+  if ! "$MERGE" "$@" -o "$TMP/out" "$TMP/in" 2>"$TMP/log"; then
+    echo "[-] merge: $NAME: llcov-merge failed"
+    cat "$TMP/log"
+    FAIL=1
+  elif grep -q "malformed" "$TMP/log" || ! printf "$EXPECT" | cmp -s - "$TMP/out"; then
+    echo "[-] merge: $NAME: unexpected output"
+    cat "$TMP/out" "$TMP/log"
+    FAIL=1
+  else
+    echo "[+] merge: $NAME"
+  fi
+
+}
+
+# PC records carry full 32-bit object offsets, below and above 64 KiB and
+# also below LLCOV_ID_BASE, which must not go through id translation
+
+cat >"$TMP/in" <<EOT
+file:/bin/x line:0 relblock:70000
+file:/bin/x line:0 relblock:4294967295
+file:/bin/x line:0 relblock:100
+file:/bin/x line:0 relblock:70000
+EOT
+
+cat >"$TMP/manifest" <<EOT
+file:/bin/x func:f line:1 relblock:100 id:40000
+EOT
+
+check "pc offsets" "file:/bin/x line:0 relblock:100\nfile:/bin/x line:0 relblock:70000\nfile:/bin/x line:0 relblock:4294967295\n"
+check "pc offsets, -m" "file:/bin/x line:0 relblock:100\nfile:/bin/x line:0 relblock:70000\nfile:/bin/x line:0 relblock:4294967295\n" -m "$TMP/manifest"
+
+# Line and relblock records next to PC records of the same file
+
+cat >"$TMP/in" <<EOT
+file:a.c line:16777215 relblock:65535
+file:a.c line:1 relblock:0
+file:a.c line:0 relblock:65536
+EOT
+
+check "lines and pcs" "file:a.c line:1 relblock:0\nfile:a.c line:16777215 relblock:65535\nfile:a.c line:0 relblock:65536\n"
+
+exit $FAIL